@@ -15,7 +15,10 @@
 #include <sys/sendfile.h>
 #include <sys/time.h>
 #include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
 #include <linux/falloc.h>
+#include <linux/fs.h>
 #include <time.h>
 #include <fcntl.h>
 
@@ -23,12 +26,14 @@
 #include "list.h"
 #include "backend.h"
 #include "dredger.h"
+#include "ioengine.h"
+#include "util.h"
 
 #define LOG_AREA "backend-file"
 
 struct backend_file {
 	struct backend common;
-	size_t thresh;
+	unsigned long long thresh;
 	char prefix[FILENAME_MAX];
 	char filename[FILENAME_MAX];
 	int fd;
@@ -36,6 +41,28 @@ struct backend_file {
 
 #define to_backend_file(b) container_of(b, struct backend_file, common)
 
+#define BACKEND_FILE_BUFSIZE (1024 * 1024)
+
+/*
+ * Whole files are copied in chunks, and the progress is recorded
+ * on the destination file now and then. An interrupted copy then
+ * resumes from there, provided the source is unchanged.
+ */
+#define BACKEND_FILE_CHUNK (64 * 1024 * 1024)
+#define BACKEND_FILE_CHECKPOINT (1024ULL * 1024 * 1024)
+#define BACKEND_FILE_XATTR "user.trawler.copied"
+
+/*
+ * Files smaller than this are copied back on recall, larger ones
+ * are bind-mounted from the backend. Can be set with the 'thresh'
+ * option; the default of 0 bind-mounts all files.
+ */
+#define BACKEND_FILE_THRESH 0
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 static int get_fname(int fd, char *fname)
 {
 	int len;
@@ -49,6 +76,402 @@ static int get_fname(int fd, char *fname)
 	return len;
 }
 
+/* Offset to resume an interrupted copy of @src_st at, or 0 */
+static off_t copy_resume_point(int dst_fd, struct stat *src_st)
+{
+	char buf[64];
+	unsigned long long offset, size;
+	long long mtime;
+	ssize_t len;
+
+	len = fgetxattr(dst_fd, BACKEND_FILE_XATTR, buf, sizeof(buf) - 1);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+	if (sscanf(buf, "%llu %llu %lld", &offset, &size, &mtime) != 3 ||
+	    size != src_st->st_size || mtime != src_st->st_mtime ||
+	    offset > size)
+		return 0;
+	return offset;
+}
+
+/* Record @offset as checkpoint, once the data before it is on disk */
+static void copy_mark(int dst_fd, struct stat *src_st, off_t offset)
+{
+	char buf[64];
+
+	sprintf(buf, "%llu %llu %lld", (unsigned long long)offset,
+		(unsigned long long)src_st->st_size,
+		(long long)src_st->st_mtime);
+	if (fsetxattr(dst_fd, BACKEND_FILE_XATTR, buf, strlen(buf), 0) < 0)
+		dbg("cannot set copy checkpoint, error %d", errno);
+}
+
+static void copy_checkpoint(int dst_fd, struct stat *src_st, off_t offset)
+{
+	/* The data has to be on disk before the checkpoint is */
+	if (ioengine_enabled() ? ioengine_fsync(dst_fd) : fdatasync(dst_fd))
+		return;
+	copy_mark(dst_fd, src_st, offset);
+}
+
+/* The copy is complete, drop the checkpoint */
+static void copy_done(int dst_fd)
+{
+	if (fremovexattr(dst_fd, BACKEND_FILE_XATTR) < 0 &&
+	    errno != ENODATA && errno != ENOTSUP)
+		dbg("cannot remove copy checkpoint, error %d", errno);
+}
+
+/*
+ * Find the first data extent of @fd in [@offset,@end) and return
+ * it in [@start,@stop). Returns ENXIO if there are only holes left.
+ * Without SEEK_DATA support all of the range is data.
+ */
+static int next_data_extent(int fd, off_t offset, off_t end,
+			    off_t *start, off_t *stop)
+{
+	off_t data, hole;
+
+	data = lseek(fd, offset, SEEK_DATA);
+	if (data < 0) {
+		if (errno == ENXIO)
+			return ENXIO;
+		data = offset;
+		hole = end;
+	} else if (data >= end) {
+		return ENXIO;
+	} else {
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+	}
+	*start = data;
+	*stop = hole;
+	return 0;
+}
+
+static int stat_file(int fd, struct stat *st)
+{
+	if (ioengine_enabled())
+		return ioengine_stat(fd, st);
+	if (fstat(fd, st) < 0)
+		return errno;
+	return 0;
+}
+
+static int punch_hole(int fd, off_t offset, off_t len)
+{
+	if (ioengine_enabled())
+		return ioengine_punch(fd, offset, len);
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      offset, len) < 0)
+		return errno;
+	return 0;
+}
+
+/*
+ * Check whether @fd has data in [@offset,@end). A recalled file
+ * is all holes already, so nothing needs to be punched into it.
+ */
+static int dst_has_data(int fd, off_t offset, off_t end)
+{
+	off_t data;
+
+	data = lseek(fd, offset, SEEK_DATA);
+	if (data < 0)
+		return errno != ENXIO;
+	return data < end;
+}
+
+/* Log the throughput in logical (with holes) and in physical bytes */
+static void copy_report(const char *what, unsigned long long logical,
+			unsigned long long physical, struct timespec *start)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+	info("%s %llu bytes (%llu bytes data) in %f seconds, "
+	     "%.1f MB/s logical, %.1f MB/s physical", what, logical,
+	     physical, elapsed, logical / elapsed / 1e6,
+	     physical / elapsed / 1e6);
+}
+
+/*
+ * Copy all data of @src_fd to @dst_fd, which has the size of
+ * the source already. A reflink is tried first, then
+ * copy_file_range(), then sendfile() for filesystems which
+ * cannot copy between each other. Only the data extents of the
+ * source are copied; its holes are punched into the destination.
+ */
+static int copy_file_data(int dst_fd, int src_fd, struct stat *src_st)
+{
+	off_t offset, last, data, stop, end = src_st->st_size;
+	unsigned long long logical, physical = 0;
+	struct timespec start;
+	loff_t in, out;
+	ssize_t bytes;
+	size_t len;
+	int use_range = 1, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	offset = copy_resume_point(dst_fd, src_st);
+	if (offset) {
+		info("Resuming copy at %llu of %llu bytes",
+		     (unsigned long long)offset, (unsigned long long)end);
+	} else if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+		physical = (unsigned long long)src_st->st_blocks * 512;
+		if (physical > end)
+			physical = end;
+		copy_done(dst_fd);
+		copy_report("Cloned", end, physical, &start);
+		return 0;
+	}
+	logical = end - offset;
+	last = stop = offset;
+	while (offset < end) {
+		if (offset >= stop) {
+			if (next_data_extent(src_fd, offset, end,
+					     &data, &stop))
+				data = stop = end;
+			if (data > offset) {
+				/* Keep the hole */
+				ret = dst_has_data(dst_fd, offset, data) ?
+					punch_hole(dst_fd, offset,
+						   data - offset) : 0;
+				if (ret && ret != EOPNOTSUPP) {
+					err("cannot punch hole at %llu, "
+					    "error %d",
+					    (unsigned long long)offset, ret);
+					return ret;
+				}
+				offset = data;
+				continue;
+			}
+		}
+		len = stop - offset;
+		if (ioengine_enabled()) {
+			/* Up to the next checkpoint in one job */
+			if (len > BACKEND_FILE_CHECKPOINT)
+				len = BACKEND_FILE_CHECKPOINT;
+			ret = ioengine_copy(dst_fd, src_fd, offset, len);
+			if (ret) {
+				err("copy failed at %llu, error %d",
+				    (unsigned long long)offset, ret);
+				return ret;
+			}
+			bytes = len;
+			goto next;
+		}
+		if (len > BACKEND_FILE_CHUNK)
+			len = BACKEND_FILE_CHUNK;
+		in = offset;
+		if (use_range) {
+			out = offset;
+			bytes = copy_file_range(src_fd, &in, dst_fd, &out,
+						len, 0);
+			if (bytes < 0 && (errno == EXDEV ||
+					  errno == EOPNOTSUPP ||
+					  errno == EINVAL ||
+					  errno == ENOSYS)) {
+				dbg("copy_file_range failed with error %d, "
+				    "using sendfile", errno);
+				use_range = 0;
+				continue;
+			}
+		} else if (lseek(dst_fd, offset, SEEK_SET) < 0) {
+			bytes = -1;
+		} else {
+			bytes = sendfile(dst_fd, src_fd, &in, len);
+		}
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			err("copy failed at %llu, error %d",
+			    (unsigned long long)offset, errno);
+			return errno;
+		}
+		if (bytes == 0) {
+			err("copy stopped at %llu of %llu bytes",
+			    (unsigned long long)offset,
+			    (unsigned long long)end);
+			return EFBIG;
+		}
+next:
+		offset += bytes;
+		physical += bytes;
+		if (offset < end &&
+		    offset - last >= BACKEND_FILE_CHECKPOINT) {
+			copy_checkpoint(dst_fd, src_st, offset);
+			last = offset;
+		}
+	}
+	copy_done(dst_fd);
+	copy_report("Copied", logical, physical, &start);
+	return 0;
+}
+
+/*
+ * A whole file copy on the I/O engine. It goes through the data
+ * extents of the source like copy_file_data(), with one job at a
+ * time, and calls @finish once all data is copied. @finish has
+ * to end the copy with copy_async_end() eventually.
+ */
+struct backend_file_copy {
+	struct ioengine_job job;
+	int fe_fd;
+	int be_fd;
+	struct stat src_st;
+	off_t offset;
+	/* Offset of the last checkpoint */
+	off_t last;
+	unsigned long long logical;
+	unsigned long long physical;
+	struct timespec start;
+	void (*finish) (struct backend_file_copy *cp);
+	void (*done) (void *arg, int error);
+	void *arg;
+};
+
+static void copy_async_end(struct backend_file_copy *cp, int error)
+{
+	cp->done(cp->arg, error);
+	free(cp);
+}
+
+/* Submit the next job of the copy, or finish it */
+static void copy_async_next(struct backend_file_copy *cp)
+{
+	struct ioengine_job *job = &cp->job;
+	off_t data, stop, end = cp->src_st.st_size;
+
+	if (cp->offset < end &&
+	    cp->offset - cp->last >= BACKEND_FILE_CHECKPOINT) {
+		/* The data has to be on disk before the checkpoint is */
+		job->op = IOENGINE_FSYNC;
+		ioengine_submit(job);
+		return;
+	}
+	while (cp->offset < end) {
+		if (next_data_extent(job->src_fd, cp->offset, end,
+				     &data, &stop))
+			data = stop = end;
+		if (data > cp->offset) {
+			if (!dst_has_data(job->dst_fd, cp->offset, data)) {
+				cp->offset = data;
+				continue;
+			}
+			/* Keep the hole */
+			job->op = IOENGINE_PUNCH;
+			job->offset = cp->offset;
+			job->len = data - cp->offset;
+			ioengine_submit(job);
+			return;
+		}
+		/* Up to the next checkpoint in one job */
+		job->op = IOENGINE_COPY;
+		job->offset = cp->offset;
+		job->len = stop - cp->offset;
+		if (job->len > BACKEND_FILE_CHECKPOINT)
+			job->len = BACKEND_FILE_CHECKPOINT;
+		ioengine_submit(job);
+		return;
+	}
+	copy_done(job->dst_fd);
+	copy_report("Copied", cp->logical, cp->physical, &cp->start);
+	cp->finish(cp);
+}
+
+static void copy_async_complete(struct ioengine_job *job)
+{
+	struct backend_file_copy *cp = job->arg;
+
+	switch (job->op) {
+	case IOENGINE_COPY:
+		if (job->error) {
+			err("copy failed at %llu, error %d",
+			    job->offset, job->error);
+			copy_async_end(cp, job->error);
+			return;
+		}
+		cp->offset += job->len;
+		cp->physical += job->len;
+		break;
+	case IOENGINE_PUNCH:
+		if (job->error && job->error != EOPNOTSUPP) {
+			err("cannot punch hole at %llu, error %d",
+			    job->offset, job->error);
+			copy_async_end(cp, job->error);
+			return;
+		}
+		cp->offset += job->len;
+		break;
+	default:
+		if (!job->error)
+			copy_mark(job->dst_fd, &cp->src_st, cp->offset);
+		cp->last = cp->offset;
+		break;
+	}
+	copy_async_next(cp);
+}
+
+static struct backend_file_copy *copy_async_alloc(int dst_fd, int src_fd,
+						  struct stat *src_st,
+						  void (*done) (void *arg,
+								int error),
+						  void *arg)
+{
+	struct backend_file_copy *cp;
+
+	cp = malloc(sizeof(struct backend_file_copy));
+	if (!cp)
+		return NULL;
+	memset(cp, 0, sizeof(struct backend_file_copy));
+	cp->job.src_fd = src_fd;
+	cp->job.dst_fd = dst_fd;
+	cp->job.complete = copy_async_complete;
+	cp->job.arg = cp;
+	memcpy(&cp->src_st, src_st, sizeof(struct stat));
+	cp->done = done;
+	cp->arg = arg;
+	return cp;
+}
+
+/*
+ * Start the copy; a reflink is tried first, and an interrupted
+ * copy is resumed like with copy_file_data(). @cp->finish may be
+ * called before this returns.
+ */
+static void copy_async_start(struct backend_file_copy *cp)
+{
+	int dst_fd = cp->job.dst_fd, src_fd = cp->job.src_fd;
+	off_t end = cp->src_st.st_size;
+
+	clock_gettime(CLOCK_MONOTONIC, &cp->start);
+	cp->offset = copy_resume_point(dst_fd, &cp->src_st);
+	if (cp->offset) {
+		info("Resuming copy at %llu of %llu bytes",
+		     (unsigned long long)cp->offset,
+		     (unsigned long long)end);
+	} else if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+		cp->physical = (unsigned long long)cp->src_st.st_blocks * 512;
+		if (cp->physical > end)
+			cp->physical = end;
+		copy_done(dst_fd);
+		copy_report("Cloned", end, cp->physical, &cp->start);
+		cp->finish(cp);
+		return;
+	}
+	cp->logical = end - cp->offset;
+	cp->last = cp->offset;
+	copy_async_next(cp);
+}
+
 static int create_leading_directories(char *pathname, mode_t mode)
 {
 	char dirname[FILENAME_MAX], *p;
@@ -90,18 +513,30 @@ struct backend *new_backend_file(void)
 		return NULL;
 
 	memset(be, 0x0, sizeof(struct backend_file));
+	be->thresh = BACKEND_FILE_THRESH;
 	return &be->common;
 }
 
+struct backend *clone_backend_file(struct backend *be)
+{
+	struct backend_file *be_file = to_backend_file(be);
+	struct backend_file *new_file;
+
+	new_file = malloc(sizeof(struct backend_file));
+	if (!new_file)
+		return NULL;
+
+	memcpy(new_file, be_file, sizeof(struct backend_file));
+	new_file->filename[0] = '\0';
+	new_file->fd = -1;
+	return &new_file->common;
+}
+
 int parse_backend_file_options(struct backend *be, char *args)
 {
 	struct backend_file *be_file = to_backend_file(be);
 	char *value;
 
-	if (strncmp(args, "prefix", 6)) {
-		err("Invalid option string '%s'", args);
-		return EINVAL;
-	}
 	value = strchr(args, '=');
 	if (!value) {
 		err("Invalid option string '%s'", args);
@@ -109,11 +544,25 @@ int parse_backend_file_options(struct backend *be, char *args)
 	}
 	*value = '\0';
 	value++;
-	strcpy(be_file->prefix, value);
+	if (!strcmp(args, "prefix")) {
+		strcpy(be_file->prefix, value);
+	} else if (!strcmp(args, "thresh")) {
+		be_file->thresh = parse_size(value);
+		if (be_file->thresh == (unsigned long long)-1)
+			return EINVAL;
+	} else {
+		err("Invalid option '%s'", args);
+		return EINVAL;
+	}
 	return 0;
 }
 
-int open_backend_file(struct backend *be, char *fname)
+/*
+ * Open the backend file for @fname. It is only created with
+ * BACKEND_CREATE; a missing backend file must not be mistaken
+ * for an empty one on recall.
+ */
+int open_backend_file(struct backend *be, char *fname, int flags)
 {
 	struct backend_file *be_file = to_backend_file(be);
 	char buf[FILENAME_MAX];
@@ -122,9 +571,12 @@ int open_backend_file(struct backend *be, char *fname)
 	strcpy(buf, be_file->prefix);
 	strcat(buf, fname);
 
-	if (create_leading_directories(buf, S_IRWXU) < 0)
+	if (!(flags & BACKEND_CREATE))
+		be_file->fd = open(buf, O_RDWR);
+	else if (create_leading_directories(buf, S_IRWXU) < 0)
 		return -1;
-	be_file->fd = open(buf, O_RDWR|O_CREAT, S_IRWXU);
+	else
+		be_file->fd = open(buf, O_RDWR|O_CREAT, S_IRWXU);
 	if (be_file->fd < 0) {
 		err("Cannot open %s, error %d", buf, errno);
 		ret = errno;
@@ -163,6 +615,12 @@ int check_backend_file(struct backend *be, char *fname)
 	strcat(buf, fname);
 	if (stat(buf, &be_st) < 0)
 		return errno;
+	/* The size is set before copying, so check for a partial copy */
+	if (getxattr(buf, BACKEND_FILE_XATTR, NULL, 0) >= 0) {
+		info("Backend file '%s' has not been copied completely",
+		     fname);
+		return ESTALE;
+	}
 	if (gmtime_r(&be_st.st_atime, &dtm)) {
 		info("Backend file '%s', size %d, tstamp "
 		     "%04d%02d%02d-%02d%02d%02d", buf, be_st.st_size,
@@ -182,34 +640,44 @@ int check_backend_file(struct backend *be, char *fname)
 	return 0;
 }
 
+/* Set the timestamps of @fd to those of @st */
+static void set_file_times(int fd, struct stat *st)
+{
+	struct timeval tv[2];
+
+	tv[0].tv_sec = difftime(st->st_atime, 0);
+	tv[0].tv_usec = 0;
+	tv[1].tv_sec = difftime(st->st_mtime, 0);
+	tv[1].tv_usec = 0;
+	if (futimes(fd, tv) < 0) {
+		err("cannot update file timestamps, error %d", errno);
+	}
+}
+
 /*
- * Migrate frontend file @fd to backend
+ * Get the backend file ready for a copy of @fe_fd. A frontend
+ * file bind-mounted from the backend is unmounted instead, and
+ * there is nothing to copy when @be_st is on another device than
+ * @fe_st.
  */
-int migrate_backend_file(struct backend *be, int fe_fd)
+static int migrate_prepare(struct backend_file *be_file, int fe_fd,
+			   struct stat *fe_st, struct stat *be_st)
 {
-	struct backend_file *be_file = to_backend_file(be);
-	struct stat fe_st, be_st;
 	char fe_fname[FILENAME_MAX];
-	struct timeval tv[2];
-	ssize_t bytes, len;
+	ssize_t len;
+	int ret;
 
-	if (fstat(be_file->fd, &be_st) < 0) {
-		err("Cannot stat backend fd, error %d", errno);
-		return errno;
-	}
-	if (fstat(fe_fd, &fe_st) < 0) {
-		err("Cannot stat frontend fd, error %d", errno);
-		return errno;
+	ret = stat_file(be_file->fd, be_st);
+	if (ret) {
+		err("Cannot stat backend fd, error %d", ret);
+		return ret;
 	}
-	if (fe_st.st_size != be_st.st_size) {
-		info("Updating file size from %ld bytes to %ld bytes",
-		     be_st.st_size, fe_st.st_size);
-		if (ftruncate(be_file->fd, fe_st.st_size) < 0) {
-			err("ftruncate failed, error %d", errno);
-			return errno;
-		}
+	ret = stat_file(fe_fd, fe_st);
+	if (ret) {
+		err("Cannot stat frontend fd, error %d", ret);
+		return ret;
 	}
-	if (be_st.st_dev != fe_st.st_dev) {
+	if (be_st->st_dev != fe_st->st_dev) {
 		/* Bind mount, just unmount it */
 		len = get_fname(fe_fd, fe_fname);
 		if (len < 0 || !strlen(fe_fname)) {
@@ -223,117 +691,407 @@ int migrate_backend_file(struct backend *be, int fe_fd)
 		}
 		return 0;
 	}
-	bytes = sendfile(be_file->fd, fe_fd, 0, fe_st.st_size);
-	if ( bytes < 0) {
-		err("sendfile failed, error %d", errno);
-		return errno;
-	} else if (bytes < fe_st.st_size) {
-		err("sendfile copied only %ld of %ld bytes",
-		    bytes, fe_st.st_size);
-		return EFBIG;
+	/*
+	 * Mark the copy as incomplete before the backend file gets
+	 * the size of the source, so that check_backend_file() does
+	 * not take it for up-to-date after a crash.
+	 */
+	if (!copy_resume_point(be_file->fd, fe_st))
+		copy_checkpoint(be_file->fd, fe_st, 0);
+	if (fe_st->st_size != be_st->st_size) {
+		info("Updating file size from %ld bytes to %ld bytes",
+		     be_st->st_size, fe_st->st_size);
+		if (ftruncate(be_file->fd, fe_st->st_size) < 0) {
+			err("ftruncate failed, error %d", errno);
+			return errno;
+		}
 	}
-	if (fchmod(be_file->fd, fe_st.st_mode) < 0) {
+	return 0;
+}
+
+static void migrate_attrs(int be_fd, struct stat *fe_st)
+{
+	if (fchmod(be_fd, fe_st->st_mode) < 0) {
 		err("cannot set file permissions, error %d", errno);
 	}
-	if (fchown(be_file->fd, fe_st.st_uid, fe_st.st_gid) < 0) {
+	if (fchown(be_fd, fe_st->st_uid, fe_st->st_gid) < 0) {
 		err("cannot update file owner, error %d", errno);
 	}
-	if (fallocate(fe_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
-		      0, fe_st.st_size) < 0) {
-		if (errno != EOPNOTSUPP) {
-			err("fallocate failed, error %d", errno);
-			return errno;
-		}
-		/* Fall back to sparse files */
-		if (ftruncate(fe_fd, 0) < 0) {
-			err("ftruncate failed, error %d", errno);
-			return errno;
-		}
-		/*
-		 * Any error from here can be ignored, as we have
-		 * successfull migrated the file.
-		 */
-		if (lseek(fe_fd, fe_st.st_size - 1, SEEK_SET) == 0) {
-			if (write(fe_fd, "\0", 1) < 1)
-				err("Cannot create sparse file, error %d",
-				    errno);
-		} else {
-			err("Cannot seek to end of sparse file, error %d",
+}
+
+/*
+ * Finish the stub @fe_fd once punching out all of its data
+ * returned @error. Without hole punching the stub is made a
+ * sparse file instead.
+ */
+static int migrate_stub(int fe_fd, struct stat *fe_st, int error)
+{
+	if (!error)
+		return 0;
+	if (error != EOPNOTSUPP) {
+		err("fallocate failed, error %d", error);
+		return error;
+	}
+	/* Fall back to sparse files */
+	if (ftruncate(fe_fd, 0) < 0) {
+		err("ftruncate failed, error %d", errno);
+		return errno;
+	}
+	/*
+	 * Any error from here can be ignored, as we have
+	 * successfull migrated the file.
+	 */
+	if (lseek(fe_fd, fe_st->st_size - 1, SEEK_SET) == 0) {
+		if (write(fe_fd, "\0", 1) < 1)
+			err("Cannot create sparse file, error %d",
 			    errno);
-		}
+	} else {
+		err("Cannot seek to end of sparse file, error %d",
+		    errno);
 	}
+	return 0;
+}
+
+/*
+ * Migrate frontend file @fd to backend
+ */
+int migrate_backend_file(struct backend *be, int fe_fd)
+{
+	struct backend_file *be_file = to_backend_file(be);
+	struct stat fe_st, be_st;
+	int ret;
+
+	ret = migrate_prepare(be_file, fe_fd, &fe_st, &be_st);
+	if (ret || be_st.st_dev != fe_st.st_dev)
+		return ret;
+	ret = copy_file_data(be_file->fd, fe_fd, &fe_st);
+	if (ret)
+		return ret;
+	migrate_attrs(be_file->fd, &fe_st);
+	ret = 0;
+	if (fallocate(fe_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      0, fe_st.st_size) < 0)
+		ret = errno;
+	ret = migrate_stub(fe_fd, &fe_st, ret);
+	if (ret)
+		return ret;
 	/* Update timestamp on backend file */
-	tv[0].tv_sec = difftime(fe_st.st_atime, 0);
-	tv[0].tv_usec = 0;
-	tv[1].tv_sec = difftime(fe_st.st_mtime, 0);
-	tv[1].tv_usec = 0;
-	if (futimes(be_file->fd, tv) < 0) {
-		err("cannot update file timestamps, error %d", errno);
-	}
+	set_file_times(be_file->fd, &fe_st);
 	return 0;
 }
 
-int unmigrate_backend_file(struct backend *be, int fe_fd)
+static void migrate_stub_complete(struct ioengine_job *job)
+{
+	struct backend_file_copy *cp = job->arg;
+	int ret;
+
+	ret = migrate_stub(cp->fe_fd, &cp->src_st, job->error);
+	/* Update timestamp on backend file */
+	if (!ret)
+		set_file_times(cp->be_fd, &cp->src_st);
+	copy_async_end(cp, ret);
+}
+
+/* All data is copied, punch it out of the frontend file */
+static void migrate_async_finish(struct backend_file_copy *cp)
+{
+	migrate_attrs(cp->be_fd, &cp->src_st);
+	cp->job.op = IOENGINE_PUNCH;
+	cp->job.dst_fd = cp->fe_fd;
+	cp->job.offset = 0;
+	cp->job.len = cp->src_st.st_size;
+	cp->job.complete = migrate_stub_complete;
+	ioengine_submit(&cp->job);
+}
+
+/*
+ * Migrate @fe_fd like migrate_backend_file(), but driven by the
+ * completions of the I/O engine. @done is called with the result,
+ * possibly before this returns; the backend file has to stay open
+ * until then.
+ */
+int migrate_async_backend_file(struct backend *be, int fe_fd,
+			       void (*done) (void *arg, int error),
+			       void *arg)
 {
 	struct backend_file *be_file = to_backend_file(be);
+	struct backend_file_copy *cp;
 	struct stat fe_st, be_st;
-	struct timeval tv[2];
-	ssize_t bytes, len;
+	int ret;
+
+	if (!ioengine_enabled())
+		return EOPNOTSUPP;
+	ret = migrate_prepare(be_file, fe_fd, &fe_st, &be_st);
+	if (ret)
+		return ret;
+	if (be_st.st_dev != fe_st.st_dev) {
+		done(arg, 0);
+		return 0;
+	}
+	cp = copy_async_alloc(be_file->fd, fe_fd, &fe_st, done, arg);
+	if (!cp)
+		return ENOMEM;
+	cp->fe_fd = fe_fd;
+	cp->be_fd = be_file->fd;
+	cp->finish = migrate_async_finish;
+	copy_async_start(cp);
+	return 0;
+}
+
+/*
+ * Check that the backend file belongs to the stub @fe_fd.
+ * Migration keeps the size of the stub, so a backend file of
+ * a different size is the wrong one or has been damaged, and
+ * recalling it would destroy the stub.
+ */
+static int check_stub(struct backend_file *be_file, int fe_fd,
+		      struct stat *fe_st, struct stat *be_st)
+{
+	int ret;
+
+	ret = stat_file(fe_fd, fe_st);
+	if (ret) {
+		err("Cannot stat frontend fd, error %d", ret);
+		return ret;
+	}
+	ret = stat_file(be_file->fd, be_st);
+	if (ret) {
+		err("Cannot stat backend fd, error %d", ret);
+		return ret;
+	}
+	if (be_st->st_size != fe_st->st_size) {
+		err("Backend file '%s' has %llu bytes, file has %llu bytes",
+		    be_file->filename, (unsigned long long)be_st->st_size,
+		    (unsigned long long)fe_st->st_size);
+		return ESTALE;
+	}
+	return 0;
+}
+
+static int unmigrate_mount(struct backend_file *be_file, int fe_fd)
+{
 	char fe_fname[FILENAME_MAX];
 	char be_fname[FILENAME_MAX];
 
-	if (fstat(fe_fd, &fe_st) < 0) {
-		err("Cannot stat frontend fd, error %d", errno);
+	/* The backend name is known, and mount follows the fd link */
+	strcpy(be_fname, be_file->prefix);
+	strcat(be_fname, be_file->filename);
+	sprintf(fe_fname, "/proc/self/fd/%d", fe_fd);
+	if (mount(fe_fname, be_fname, NULL, MS_BIND, NULL) < 0) {
+		err("bind mount failed, error %d", errno);
 		return errno;
 	}
-	if (fstat(be_file->fd, &be_st) < 0) {
-		err("Cannot stat backend fd, error %d", errno);
-		return errno;
+	return 0;
+}
+
+int unmigrate_backend_file(struct backend *be, int fe_fd)
+{
+	struct backend_file *be_file = to_backend_file(be);
+	struct stat fe_st, be_st;
+	int ret;
+
+	ret = check_stub(be_file, fe_fd, &fe_st, &be_st);
+	if (ret)
+		return ret;
+	if (be_st.st_size >= be_file->thresh)
+		return unmigrate_mount(be_file, fe_fd);
+	ret = copy_file_data(fe_fd, be_file->fd, &be_st);
+	if (ret == EFBIG)
+		return unmigrate_mount(be_file, fe_fd);
+	if (ret)
+		return ret;
+	set_file_times(fe_fd, &be_st);
+	return 0;
+}
+
+static void unmigrate_async_finish(struct backend_file_copy *cp)
+{
+	set_file_times(cp->fe_fd, &cp->src_st);
+	copy_async_end(cp, 0);
+}
+
+/*
+ * Recall all of @fe_fd like unmigrate_backend_file(), but driven
+ * by the completions of the I/O engine. A bind mount is set up
+ * right away. @done is called with the result, possibly before
+ * this returns; the backend file has to stay open until then.
+ */
+int unmigrate_async_backend_file(struct backend *be, int fe_fd,
+				 void (*done) (void *arg, int error),
+				 void *arg)
+{
+	struct backend_file *be_file = to_backend_file(be);
+	struct backend_file_copy *cp;
+	struct stat fe_st, be_st;
+	int ret;
+
+	if (!ioengine_enabled())
+		return EOPNOTSUPP;
+	ret = check_stub(be_file, fe_fd, &fe_st, &be_st);
+	if (ret)
+		return ret;
+	if (be_st.st_size >= be_file->thresh) {
+		done(arg, unmigrate_mount(be_file, fe_fd));
+		return 0;
 	}
-	if (be_st.st_size != fe_st.st_size) {
-		info("Updating file size from %ld bytes to %ld bytes",
-		     fe_st.st_size, be_st.st_size);
-		if (posix_fallocate(fe_fd, 0, be_st.st_size) < 0) {
-			err("fallocate failed, error %d", errno);
-			return errno;
+	cp = copy_async_alloc(fe_fd, be_file->fd, &be_st, done, arg);
+	if (!cp)
+		return ENOMEM;
+	cp->fe_fd = fe_fd;
+	cp->be_fd = be_file->fd;
+	cp->finish = unmigrate_async_finish;
+	copy_async_start(cp);
+	return 0;
+}
+
+/*
+ * Copy @len bytes at @offset from the backend file
+ * back into frontend file @fe_fd.
+ */
+int unmigrate_range_backend_file(struct backend *be, int fe_fd,
+				 unsigned long long offset,
+				 unsigned long long len)
+{
+	struct backend_file *be_file = to_backend_file(be);
+	unsigned long long end = offset + len;
+	struct stat fe_st, be_st;
+	off_t data, stop = offset;
+	char *buf;
+	ssize_t bytes, written;
+	size_t num;
+	int ret;
+
+	ret = check_stub(be_file, fe_fd, &fe_st, &be_st);
+	if (ret)
+		return ret;
+	buf = malloc(BACKEND_FILE_BUFSIZE);
+	if (!buf)
+		return ENOMEM;
+	while (offset < end) {
+		/* Holes in the backend file are holes in the frontend */
+		if (offset >= stop) {
+			if (next_data_extent(be_file->fd, offset, end,
+					     &data, &stop))
+				break;
+			offset = data;
 		}
-	}
-	if (be_st.st_size < be_file->thresh) {
-		bytes = sendfile(be_file->fd, fe_fd, 0, be_st.st_size);
+		if (ioengine_enabled()) {
+			ret = ioengine_copy(fe_fd, be_file->fd, offset,
+					    stop - offset);
+			if (ret) {
+				err("Cannot recall %llu bytes at %llu, "
+				    "error %d", (unsigned long long)(stop - offset),
+				    offset, ret);
+				break;
+			}
+			offset = stop;
+			continue;
+		}
+		num = stop - offset;
+		if (num > BACKEND_FILE_BUFSIZE)
+			num = BACKEND_FILE_BUFSIZE;
+		bytes = pread(be_file->fd, buf, num, offset);
 		if (bytes < 0) {
-			err("sendfile failed, error %d", errno);
-			return errno;
-		} else if (bytes < be_st.st_size) {
-			info("sendfile copied only %ld of %ld bytes",
-			    bytes, be_st.st_size);
-			goto try_mount;
+			if (errno == EINTR)
+				continue;
+			err("Cannot read backend file at %llu, error %d",
+			    offset, errno);
+			ret = errno;
+			break;
 		}
-	} else {
-		goto try_mount;
-	}
-	tv[0].tv_sec = difftime(be_st.st_atime, 0);
-	tv[0].tv_usec = 0;
-	tv[1].tv_sec = difftime(be_st.st_mtime, 0);
-	tv[1].tv_usec = 0;
-	if (futimes(fe_fd, tv) < 0) {
-		err("cannot update file timestamps, error %d", errno);
-	}
-	return 0;
-try_mount:
-	len = get_fname(be_file->fd, be_fname);
-	if (len < 0 || !strlen(be_fname)) {
-		err("cannot resolve backend filename, error %d", errno);
-		return errno;
+		if (bytes == 0) {
+			err("Backend file truncated at %llu", offset);
+			ret = EIO;
+			break;
+		}
+		written = pwrite(fe_fd, buf, bytes, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			err("Cannot write frontend file at %llu, error %d",
+			    offset, errno);
+			ret = errno;
+			break;
+		}
+		offset += written;
 	}
-	len = get_fname(fe_fd, fe_fname);
-	if (len < 0 || !strlen(fe_fname)) {
-		err("cannot resolve source filename, error %d", errno);
-		return errno;
+	free(buf);
+	return ret;
+}
+
+/* A range recall on the I/O engine, one data extent at a time */
+struct backend_file_recall {
+	struct ioengine_job job;
+	unsigned long long end;
+	void (*done) (void *arg, int error);
+	void *arg;
+};
+
+/* Copy the next data extent from @offset on, or finish the recall */
+static void recall_next(struct backend_file_recall *rc,
+			unsigned long long offset)
+{
+	off_t data, stop;
+
+	if (offset >= rc->end ||
+	    next_data_extent(rc->job.src_fd, offset, rc->end, &data, &stop)) {
+		rc->done(rc->arg, 0);
+		free(rc);
+		return;
 	}
-	if (mount(fe_fname, be_fname, NULL, MS_BIND, NULL) < 0) {
-		err("bind mount failed, error %d", errno);
-		return errno;
+	rc->job.offset = data;
+	rc->job.len = stop - data;
+	ioengine_submit(&rc->job);
+}
+
+static void recall_complete(struct ioengine_job *job)
+{
+	struct backend_file_recall *rc = job->arg;
+
+	if (job->error) {
+		err("Cannot recall %llu bytes at %llu, error %d",
+		    job->len, job->offset, job->error);
+		rc->done(rc->arg, job->error);
+		free(rc);
+		return;
 	}
+	recall_next(rc, job->offset + job->len);
+}
+
+/*
+ * Recall @len bytes at @offset like unmigrate_range_backend_file(),
+ * but driven by the completions of the I/O engine. The backend
+ * file has to stay open until @done has been called.
+ */
+int unmigrate_range_async_backend_file(struct backend *be, int fe_fd,
+				       unsigned long long offset,
+				       unsigned long long len,
+				       void (*done) (void *arg, int error),
+				       void *arg)
+{
+	struct backend_file *be_file = to_backend_file(be);
+	struct backend_file_recall *rc;
+	struct stat fe_st, be_st;
+	int ret;
+
+	if (!ioengine_enabled())
+		return EOPNOTSUPP;
+	ret = check_stub(be_file, fe_fd, &fe_st, &be_st);
+	if (ret)
+		return ret;
+	rc = malloc(sizeof(struct backend_file_recall));
+	if (!rc)
+		return ENOMEM;
+	memset(rc, 0, sizeof(struct backend_file_recall));
+	rc->job.op = IOENGINE_COPY;
+	rc->job.src_fd = be_file->fd;
+	rc->job.dst_fd = fe_fd;
+	rc->job.complete = recall_complete;
+	rc->job.arg = rc;
+	rc->end = offset + len;
+	rc->done = done;
+	rc->arg = arg;
+	recall_next(rc, offset);
 	return 0;
 }
 
@@ -354,11 +1112,16 @@ void close_backend_file(struct backend *be)
 struct backend_template backend_file = {
 	.name = "file",
 	.new = new_backend_file,
+	.clone = clone_backend_file,
 	.parse_options = parse_backend_file_options,
 	.open = open_backend_file,
 	.check = check_backend_file,
 	.migrate = migrate_backend_file,
+	.migrate_async = migrate_async_backend_file,
 	.unmigrate = unmigrate_backend_file,
+	.unmigrate_async = unmigrate_async_backend_file,
+	.unmigrate_range = unmigrate_range_backend_file,
+	.unmigrate_range_async = unmigrate_range_async_backend_file,
 	.close = close_backend_file,
 };
 
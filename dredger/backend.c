@@ -49,6 +49,29 @@ struct backend *new_backend(const char *name) {
 	return be;
 }
 
+/*
+ * Create a copy of @be sharing its configuration,
+ * but with its own per-file state.
+ */
+struct backend *clone_backend(struct backend *be) {
+	struct backend *new_be;
+
+	if (!be || !be->template->clone)
+		return NULL;
+
+	new_be = be->template->clone(be);
+	if (!new_be)
+		return NULL;
+
+	new_be->template = be->template;
+
+	return new_be;
+}
+
+void free_backend(struct backend *be) {
+	free(be);
+}
+
 int parse_backend_options(struct backend *be, char *optarg) {
 	if (!be || !be->template->parse_options)
 		return EINVAL;
@@ -56,11 +79,11 @@ int parse_backend_options(struct backend *be, char *optarg) {
 	return be->template->parse_options(be, optarg);
 }
 
-int open_backend(struct backend *be, char *filename) {
+int open_backend(struct backend *be, char *filename, int flags) {
 	if (!be || !be->template->open)
 		return EINVAL;
 
-	return be->template->open(be, filename);
+	return be->template->open(be, filename, flags);
 }
 
 int check_backend(struct backend *be, char *filename) {
@@ -84,6 +107,21 @@ int migrate_backend(struct backend *be, int fe_fd) {
 	return be->template->migrate(be, fe_fd);
 }
 
+/*
+ * Start migrating @fe_fd without waiting for the I/O; @done is
+ * called with the result once it is finished, possibly before
+ * this returns. Returns EOPNOTSUPP if the backend can only
+ * migrate synchronously right now.
+ */
+int migrate_backend_async(struct backend *be, int fe_fd,
+			  void (*done) (void *arg, int error),
+			  void *arg) {
+	if (!be || !be->template->migrate_async)
+		return EOPNOTSUPP;
+
+	return be->template->migrate_async(be, fe_fd, done, arg);
+}
+
 int unmigrate_backend(struct backend *be, int fe_fd) {
 	if (!be || !be->template->unmigrate)
 		return EINVAL;
@@ -91,6 +129,43 @@ int unmigrate_backend(struct backend *be, int fe_fd) {
 	return be->template->unmigrate(be, fe_fd);
 }
 
+/* Like migrate_backend_async(), for recalling all of @fe_fd */
+int unmigrate_backend_async(struct backend *be, int fe_fd,
+			    void (*done) (void *arg, int error),
+			    void *arg) {
+	if (!be || !be->template->unmigrate_async)
+		return EOPNOTSUPP;
+
+	return be->template->unmigrate_async(be, fe_fd, done, arg);
+}
+
+int unmigrate_range_backend(struct backend *be, int fe_fd,
+			    unsigned long long offset,
+			    unsigned long long len) {
+	if (!be || !be->template->unmigrate_range)
+		return EOPNOTSUPP;
+
+	return be->template->unmigrate_range(be, fe_fd, offset, len);
+}
+
+/*
+ * Start recalling @len bytes at @offset without waiting for the
+ * I/O; @done is called with the result once it is finished,
+ * possibly before this returns. Returns EOPNOTSUPP if the
+ * backend can only recall synchronously right now.
+ */
+int unmigrate_range_backend_async(struct backend *be, int fe_fd,
+				  unsigned long long offset,
+				  unsigned long long len,
+				  void (*done) (void *arg, int error),
+				  void *arg) {
+	if (!be || !be->template->unmigrate_range_async)
+		return EOPNOTSUPP;
+
+	return be->template->unmigrate_range_async(be, fe_fd, offset, len,
+						   done, arg);
+}
+
 void close_backend(struct backend *be) {
 	if (!be || !be->template->close)
 		return;
@@ -3,14 +3,32 @@
 
 struct backend;
 
+/* Create the backend file, for migration; recall never creates it */
+#define BACKEND_CREATE 0x1
+
 struct backend_template {
 	const char *name;
 	int (*parse_options) (struct backend *be, char *args);
 	struct backend * (*new) (void);
-	int (*open) (struct backend *be, char *fname);
+	struct backend * (*clone) (struct backend *be);
+	int (*open) (struct backend *be, char *fname, int flags);
 	int (*check) (struct backend *be, char *fname);
 	int (*migrate) (struct backend *be, int fe_fd);
+	int (*migrate_async) (struct backend *be, int fe_fd,
+			      void (*done) (void *arg, int error),
+			      void *arg);
 	int (*unmigrate) (struct backend *be, int fe_fd);
+	int (*unmigrate_async) (struct backend *be, int fe_fd,
+				void (*done) (void *arg, int error),
+				void *arg);
+	int (*unmigrate_range) (struct backend *be, int fe_fd,
+				unsigned long long offset,
+				unsigned long long len);
+	int (*unmigrate_range_async) (struct backend *be, int fe_fd,
+				      unsigned long long offset,
+				      unsigned long long len,
+				      void (*done) (void *arg, int error),
+				      void *arg);
 	void (*close) (struct backend *be);
 };
 
@@ -19,12 +37,28 @@ struct backend {
 };
 
 struct backend *new_backend(const char *name);
+struct backend *clone_backend(struct backend *be);
+void free_backend(struct backend *be);
 int parse_backend_options(struct backend *be, char *args);
-int open_backend(struct backend *be, char *fname);
+int open_backend(struct backend *be, char *fname, int flags);
 int check_backend(struct backend *be, char *fname);
 int setup_backend(struct backend *be);
 int migrate_backend(struct backend *be, int fe_fd);
+int migrate_backend_async(struct backend *be, int fe_fd,
+			  void (*done) (void *arg, int error),
+			  void *arg);
 int unmigrate_backend(struct backend *be, int fe_fd);
+int unmigrate_backend_async(struct backend *be, int fe_fd,
+			    void (*done) (void *arg, int error),
+			    void *arg);
+int unmigrate_range_backend(struct backend *be, int fe_fd,
+			    unsigned long long offset,
+			    unsigned long long len);
+int unmigrate_range_backend_async(struct backend *be, int fe_fd,
+				  unsigned long long offset,
+				  unsigned long long len,
+				  void (*done) (void *arg, int error),
+				  void *arg);
 void close_backend(struct backend *be);
 
 #endif
@@ -2,6 +2,17 @@
  * cli-server.c
  *
  * Command line interface for dredger.
+ *
+ * Commands are received on a single socket. Migrations are run
+ * by a number of worker threads, so several of them can wait for
+ * an I/O slot of the migrate class at the same time, and the
+ * scheduler decides between them and the recalls. Each worker
+ * replies to its client once its migration is finished; with the
+ * I/O engine the copy is left to the engine, which replies instead,
+ * and the worker picks up the next migration in the meantime.
+ * Commands without backend I/O are answered right away, so they
+ * are not held up behind migrations waiting for a slot.
+ *
  * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
  */
 #include <stdio.h>
@@ -20,28 +31,243 @@
 #include <linux/netlink.h>
 #include <pthread.h>
 
+#include "list.h"
 #include "logging.h"
 #include "backend.h"
 #include "dredger.h"
 #include "migrate.h"
+#include "ioengine.h"
 #include "cli.h"
 #include "cli-server.h"
 
 #define LOG_AREA "cli-server"
 
+#define CLI_WORKERS 4
+
+int cli_workers = CLI_WORKERS;
+
+/* A command received from a client */
+struct cli_request {
+	struct list_head list;
+	struct cli_monitor *cli;
+	enum cli_commands cmd;
+	int src_fd;
+	struct sockaddr_un sun;
+	socklen_t addrlen;
+	char filename[1024];
+};
+
+struct cli_worker {
+	pthread_t thr;
+	struct cli_monitor *cli;
+	struct backend *be;
+};
+
 struct cli_monitor {
 	int running;
 	int sock;
 	struct backend *be;
 	int fanotify_fd;
 	pthread_t thread;
+	/* Migrations waiting for a worker */
+	struct list_head queue;
+	int stopped;
+	pthread_mutex_t lock;
+	pthread_cond_t cmd_avail;
+	struct cli_worker *workers;
+	int num_workers;
+	/* Migrations running on the I/O engine */
+	int num_async;
+	pthread_cond_t async_done;
 };
 
+/* Send the result @ret of @req to the client, and free @req */
+static void cli_reply(struct cli_monitor *cli, struct cli_request *req,
+		      int ret)
+{
+	struct msghdr smsg;
+	struct iovec iov;
+	char status = ret;
+
+	memset(&smsg, 0x00, sizeof(struct msghdr));
+	iov.iov_base = &status;
+	iov.iov_len = ret ? 1 : 0;
+	smsg.msg_name = &req->sun;
+	smsg.msg_namelen = req->addrlen;
+	smsg.msg_iov = &iov;
+	smsg.msg_iovlen = 1;
+	if (sendmsg(cli->sock, &smsg, 0) < 0)
+		err("sendmsg failed, error %d", errno);
+	if (req->src_fd >= 0)
+		close(req->src_fd);
+	free(req);
+}
+
+static int cli_run_command(struct cli_monitor *cli, struct backend *be,
+			   struct cli_request *req)
+{
+	char *filestr = req->filename;
+	int ret;
+
+	switch (req->cmd) {
+	case CLI_MIGRATE:
+		ret = migrate_file(be, req->src_fd, filestr);
+		break;
+	case CLI_CHECK:
+		ret = check_backend(be, filestr);
+		if (ret < 0) {
+			err("File '%s' could not be checked, error %d",
+			    filestr, -ret);
+			ret = -ret;
+		} else if (ret > 0) {
+			info("File '%s' needs migration", filestr);
+			ret = 0;
+		} else {
+			info("File '%s' up-to-date", filestr);
+			ret = EALREADY;
+		}
+		break;
+	case CLI_MONITOR:
+		ret = monitor_file(cli->fanotify_fd, filestr);
+		break;
+	case CLI_SETUP:
+		ret = migrate_file(be, -1, filestr);
+		break;
+	default:
+		info("%s: Unhandled event %d", filestr, req->cmd);
+		ret = EINVAL;
+		break;
+	}
+	return ret;
+}
+
+/* Called from the I/O engine once a migration is finished */
+static void cli_migrate_done(void *arg, int error)
+{
+	struct cli_request *req = arg;
+	struct cli_monitor *cli = req->cli;
+
+	cli_reply(cli, req, error);
+	pthread_mutex_lock(&cli->lock);
+	if (!--cli->num_async)
+		pthread_cond_broadcast(&cli->async_done);
+	pthread_mutex_unlock(&cli->lock);
+}
+
+static void *cli_worker_thread(void *arg)
+{
+	struct cli_worker *worker = arg;
+	struct cli_monitor *cli = worker->cli;
+	struct cli_request *req;
+	int ret;
+
+	pthread_mutex_lock(&cli->lock);
+	while (1) {
+		if (list_empty(&cli->queue)) {
+			/* Queued commands are still run when stopping */
+			if (cli->stopped)
+				break;
+			pthread_cond_wait(&cli->cmd_avail, &cli->lock);
+			continue;
+		}
+		req = list_first_entry(&cli->queue, struct cli_request, list);
+		list_del(&req->list);
+		pthread_mutex_unlock(&cli->lock);
+
+		ret = EOPNOTSUPP;
+		if (req->cmd == CLI_MIGRATE && ioengine_enabled()) {
+			pthread_mutex_lock(&cli->lock);
+			cli->num_async++;
+			pthread_mutex_unlock(&cli->lock);
+			ret = migrate_file_async(worker->be, req->src_fd,
+						 req->filename,
+						 cli_migrate_done, req);
+			if (ret == EINPROGRESS) {
+				pthread_mutex_lock(&cli->lock);
+				continue;
+			}
+			pthread_mutex_lock(&cli->lock);
+			if (!--cli->num_async)
+				pthread_cond_broadcast(&cli->async_done);
+			pthread_mutex_unlock(&cli->lock);
+		}
+		if (ret == EOPNOTSUPP)
+			ret = cli_run_command(cli, worker->be, req);
+		cli_reply(cli, req, ret);
+
+		pthread_mutex_lock(&cli->lock);
+	}
+	pthread_mutex_unlock(&cli->lock);
+	return NULL;
+}
+
+static void cli_stop_workers(struct cli_monitor *cli)
+{
+	int i;
+
+	pthread_mutex_lock(&cli->lock);
+	cli->stopped = 1;
+	pthread_cond_broadcast(&cli->cmd_avail);
+	pthread_mutex_unlock(&cli->lock);
+	for (i = 0; i < cli->num_workers; i++) {
+		pthread_join(cli->workers[i].thr, NULL);
+		free_backend(cli->workers[i].be);
+	}
+	cli->num_workers = 0;
+	free(cli->workers);
+	cli->workers = NULL;
+
+	/* The engine still replies to running migrations */
+	pthread_mutex_lock(&cli->lock);
+	while (cli->num_async)
+		pthread_cond_wait(&cli->async_done, &cli->lock);
+	pthread_mutex_unlock(&cli->lock);
+}
+
+static int cli_start_workers(struct cli_monitor *cli, int num)
+{
+	struct cli_worker *worker;
+	int ret;
+
+	cli->workers = malloc(num * sizeof(struct cli_worker));
+	if (!cli->workers)
+		return ENOMEM;
+	for (cli->num_workers = 0; cli->num_workers < num;
+	     cli->num_workers++) {
+		worker = &cli->workers[cli->num_workers];
+		worker->cli = cli;
+		/* Each worker needs its own backend state */
+		worker->be = clone_backend(cli->be);
+		if (!worker->be) {
+			err("Failed to allocate backend for cli worker %d",
+			    cli->num_workers);
+			ret = ENOMEM;
+			goto out_stop;
+		}
+		ret = pthread_create(&worker->thr, NULL,
+				     cli_worker_thread, worker);
+		if (ret) {
+			err("Failed to start cli worker %d, error %d",
+			    cli->num_workers, ret);
+			free_backend(worker->be);
+			goto out_stop;
+		}
+	}
+	return 0;
+out_stop:
+	cli_stop_workers(cli);
+	return ret;
+}
+
 void cli_monitor_cleanup(void *ctx)
 {
 	struct cli_monitor *cli = ctx;
 
+	/* Do not stop half-way when cancelled after a shutdown command */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 	info("Shutdown cli monitor");
+	/* The workers still reply to their clients */
+	cli_stop_workers(cli);
 	if (cli->sock >= 0) {
 		close(cli->sock);
 		cli->sock = 0;
@@ -59,7 +285,7 @@ void *cli_monitor_thread(void *ctx)
 	pthread_cleanup_push(cli_monitor_cleanup, cli);
 
 	while (cli->running) {
-		int fdcount, ret, src_fd;
+		int fdcount, src_fd;
 		uid_t src_uid;
 		fd_set readfds;
 		struct msghdr smsg;
@@ -68,11 +294,13 @@ void *cli_monitor_thread(void *ctx)
 		struct cmsghdr *cmsg;
 		struct ucred *cred;
 		enum cli_commands cli_cmd;
+		struct cli_request *req;
 		char *filestr;
 		static char buf[1024];
 		struct sockaddr_un sun;
 		socklen_t addrlen;
 		size_t buflen;
+		int oldstate;
 
 		FD_ZERO(&readfds);
 		FD_SET(cli->sock, &readfds);
@@ -102,6 +330,8 @@ void *cli_monitor_thread(void *ctx)
 				    errno);
 			continue;
 		}
+		/* Do not lose the fd passed with the command */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 		src_fd = -1;
 		src_uid = -1;
 		for (cmsg = CMSG_FIRSTHDR(&smsg); cmsg != NULL;
@@ -122,6 +352,9 @@ void *cli_monitor_thread(void *ctx)
 		if (src_uid != 0) {
 			warn("Invalid message (uid=%d, fd %d), ignoring",
 			     src_uid, src_fd);
+			if (src_fd >= 0)
+				close(src_fd);
+			pthread_setcancelstate(oldstate, NULL);
 			continue;
 		}
 		info("received %d/%d bytes from %s", buflen, sizeof(buf),
@@ -136,55 +369,43 @@ void *cli_monitor_thread(void *ctx)
 		info("CLI event '%d' fd %d file '%s'", cli_cmd,
 		     src_fd, filestr);
 
+		req = malloc(sizeof(struct cli_request));
+		if (!req) {
+			err("Cannot allocate cli command");
+			if (src_fd >= 0)
+				close(src_fd);
+			pthread_setcancelstate(oldstate, NULL);
+			continue;
+		}
+		memset(req, 0, sizeof(struct cli_request));
+		req->cli = cli;
+		req->cmd = cli_cmd;
+		req->src_fd = src_fd;
+		memcpy(&req->sun, &sun, sizeof(struct sockaddr_un));
+		req->addrlen = smsg.msg_namelen;
+		strncpy(req->filename, filestr, sizeof(req->filename) - 1);
+
 		switch (cli_cmd) {
 		case CLI_NOFILE:
-			ret = EINVAL;
+			cli_reply(cli, req, EINVAL);
 			break;
 		case CLI_SHUTDOWN:
 			pthread_kill(daemon_thr, SIGTERM);
 			cli->running = 0;
-			ret = 0;
-			break;
-		case CLI_MIGRATE:
-			ret = migrate_file(cli->be, src_fd, filestr);
+			cli_reply(cli, req, 0);
 			break;
 		case CLI_CHECK:
-			ret = check_backend(cli->be, filestr);
-			if (ret < 0) {
-				err("File '%s' could not be checked, error %d",
-				    filestr, -ret);
-				ret = -ret;
-			} else if (ret > 0) {
-				info("File '%s' needs migration", filestr);
-				ret = 0;
-			} else {
-				info("File '%s' up-to-date", filestr);
-				ret = EALREADY;
-			}
-			break;
 		case CLI_MONITOR:
-			ret = monitor_file(cli->fanotify_fd, filestr);
-			break;
-		case CLI_SETUP:
-			ret = migrate_file(cli->be, -1, filestr);
+			cli_reply(cli, req, cli_run_command(cli, cli->be, req));
 			break;
 		default:
-			info("%s: Unhandled event %d",filestr, cli_cmd);
-			ret = EINVAL;
+			pthread_mutex_lock(&cli->lock);
+			list_add_tail(&req->list, &cli->queue);
+			pthread_cond_signal(&cli->cmd_avail);
+			pthread_mutex_unlock(&cli->lock);
 			break;
 		}
-		if (ret) {
-			buf[0] = ret;
-			iov.iov_len = 1;
-		} else {
-			buf[0] = 0;
-			iov.iov_len = 0;
-		}
-
-		if (sendmsg(cli->sock, &smsg, 0) < 0)
-			err("sendmsg failed, error %d", errno);
-		if (src_fd >= 0)
-			close(src_fd);
+		pthread_setcancelstate(oldstate, NULL);
 	}
 	pthread_cleanup_pop(1);
 	return ((void *)0);
@@ -204,6 +425,10 @@ pthread_t start_cli(struct backend *be, int fanotify_fd)
 	memset(cli, 0, sizeof(struct cli_monitor));
 	cli->fanotify_fd = fanotify_fd;
 	cli->be = be;
+	INIT_LIST_HEAD(&cli->queue);
+	pthread_mutex_init(&cli->lock, NULL);
+	pthread_cond_init(&cli->cmd_avail, NULL);
+	pthread_cond_init(&cli->async_done, NULL);
 
 	memset(&sun, 0x00, sizeof(struct sockaddr_un));
 	sun.sun_family = AF_LOCAL;
@@ -225,14 +450,22 @@ pthread_t start_cli(struct backend *be, int fanotify_fd)
 	setsockopt(cli->sock, SOL_SOCKET, SO_PASSCRED,
 		   &feature_on, sizeof(feature_on));
 
+	rc = cli_start_workers(cli, cli_workers);
+	if (rc) {
+		close(cli->sock);
+		free(cli);
+		return (pthread_t)0;
+	}
 	rc = pthread_create(&cli->thread, NULL, cli_monitor_thread, cli);
 	if (rc) {
 		cli->thread = 0;
+		cli_stop_workers(cli);
 		close(cli->sock);
 		err("Failed to start cli monitor: %d", errno);
 		free(cli);
 		return (pthread_t)0;
 	}
+	info("Started cli monitor with %d workers", cli_workers);
 
 	return cli->thread;
 }
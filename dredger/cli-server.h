@@ -3,6 +3,8 @@
 
 struct cli_monitor;
 
+extern int cli_workers;
+
 pthread_t start_cli(struct backend *be, int fanotify_fd);
 void stop_cli(pthread_t cli_thr);
 
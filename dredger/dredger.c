@@ -21,8 +21,13 @@
 #include "logging.h"
 #include "backend.h"
 #include "watcher.h"
+#include "migrate.h"
+#include "fhcache.h"
+#include "ioengine.h"
+#include "iosched.h"
 #include "cli.h"
 #include "cli-server.h"
+#include "util.h"
 
 #define LOG_AREA "watcher"
 
@@ -68,18 +73,37 @@ static void sigend(int sig)
 	pthread_mutex_unlock(&exit_mutex);
 }
 
+/*
+ * Run @cli_cmd for @filename, returning a positive exit
+ * status also if dredger could not be reached.
+ */
+static int run_command(enum cli_commands cli_cmd, char *filename)
+{
+	int ret = cli_command(cli_cmd, filename);
+
+	return ret < 0 ? -ret : ret;
+}
+
 int main(int argc, char **argv)
 {
 	int i;
 	int fanotify_fd, ret;
 	struct backend *be = NULL;
 	struct stat stbuf;
+	char *fs_mark = NULL;
 
 	logfd = stdout;
 	memset(frontend_prefix, 0x0, FILENAME_MAX);
 
-	while ((i = getopt(argc, argv, "b:c:d:m:n:o:p:su:")) != -1) {
+	while ((i = getopt(argc, argv, "a:b:c:d:fij:l:m:M:n:o:p:q:r:st:u:w:")) != -1) {
 		switch (i) {
+		case 'a':
+			ioengine_depth = strtoul(optarg, NULL, 10);
+			if (ioengine_depth < 1) {
+				err("Invalid I/O engine depth '%s'", optarg);
+				return EINVAL;
+			}
+			break;
 		case 'b':
 			be = new_backend(optarg);
 			if (!be) {
@@ -97,18 +121,48 @@ int main(int argc, char **argv)
 			strncpy(frontend_prefix, optarg, FILENAME_MAX);
 			break;
 		case 'c':
-			return cli_command(CLI_CHECK, optarg);
+			return run_command(CLI_CHECK, optarg);
+			break;
+		case 'f':
+			watcher_fill = 1;
+			break;
+		case 'i':
+			/* Without ignore marks, for comparison */
+			watcher_ignore = 0;
+			break;
+		case 'j':
+			cli_workers = strtoul(optarg, NULL, 10);
+			if (cli_workers < 1) {
+				err("Invalid number of migrations '%s'",
+				    optarg);
+				return EINVAL;
+			}
+			break;
+		case 'l':
+			sched_slots = strtoul(optarg, NULL, 10);
+			if (sched_slots < 1) {
+				err("Invalid number of I/O slots '%s'", optarg);
+				return EINVAL;
+			}
 			break;
 		case 'm':
-			ret = cli_command(CLI_CHECK, optarg);
+			ret = run_command(CLI_CHECK, optarg);
 			if (ret)
 				return ret;
-			ret = cli_command(CLI_MIGRATE, optarg);
+			ret = run_command(CLI_MIGRATE, optarg);
 			if (ret)
 				return ret;
 			/* Fallthrough */
 		case 'n':
-			return cli_command(CLI_MONITOR, optarg);
+			return run_command(CLI_MONITOR, optarg);
+			break;
+		case 'M':
+			if (stat(optarg, &stbuf) < 0) {
+				err("Filesystem %s not accessible, error %d",
+				    optarg, errno);
+				return EINVAL;
+			}
+			fs_mark = optarg;
 			break;
 		case 'o':
 			if (!be) {
@@ -128,20 +182,51 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'q':
+			watcher_queue_size = strtoul(optarg, NULL, 10);
+			if (watcher_queue_size < 1) {
+				err("Invalid queue size '%s'", optarg);
+				return EINVAL;
+			}
+			break;
+		case 'r':
+			recall_chunk_size = parse_size(optarg);
+			if (recall_chunk_size == (unsigned long long)-1)
+				return EINVAL;
+			break;
 		case 's':
-			return cli_command(CLI_SHUTDOWN, NULL);
+			return run_command(CLI_SHUTDOWN, NULL);
+			break;
+		case 't':
+			watcher_workers = strtoul(optarg, NULL, 10);
+			if (watcher_workers < 1) {
+				err("Invalid number of workers '%s'", optarg);
+				return EINVAL;
+			}
 			break;
 		case 'u':
-			ret = cli_command(CLI_CHECK, optarg);
+			ret = run_command(CLI_CHECK, optarg);
 			if (ret && ret != ENOENT)
 				return ret;
-			ret = cli_command(CLI_SETUP, optarg);
+			ret = run_command(CLI_SETUP, optarg);
 			if (ret)
 				return ret;
-			return cli_command(CLI_MONITOR, optarg);
+			return run_command(CLI_MONITOR, optarg);
+			break;
+		case 'w':
+			if (sched_parse_weights(optarg))
+				return EINVAL;
 			break;
 		default:
-			fprintf(stderr, "usage: %s [-d <dir>]\n", argv[0]);
+			fprintf(stderr, "usage: %s [-a <depth>] "
+				"[-b <backend>] [-c <file>] "
+				"[-d <dir>] [-f] [-i] [-j <migrations>] "
+				"[-l <slots>] [-m <file>] "
+				"[-M <filesystem>] [-n <file>] "
+				"[-o <option>] [-p <priority>] "
+				"[-q <queue size>] "
+				"[-r <chunk size>] [-s] [-t <workers>] "
+				"[-u <file>] [-w <weights>]\n", argv[0]);
 			return EINVAL;
 		}
 	}
@@ -150,16 +235,46 @@ int main(int argc, char **argv)
 		return EINVAL;
 	}
 
+	/* Background recall needs range recall */
+	if (watcher_fill && !recall_chunk_size)
+		recall_chunk_size = RECALL_CHUNK_SIZE;
+	/* Fall back to synchronous I/O without io_uring */
+	if (ioengine_depth && ioengine_init(ioengine_depth))
+		info("Using synchronous I/O");
+	/*
+	 * By default each worker can do I/O at the same time; range
+	 * recalls do not hold a worker, so with the I/O engine allow
+	 * as many as it keeps chunks in flight.
+	 */
+	if (!sched_slots) {
+		sched_slots = watcher_workers;
+		if (ioengine_enabled() && ioengine_depth > sched_slots)
+			sched_slots = ioengine_depth;
+	}
+	sched_init(sched_slots);
+
 	signal_set(SIGINT, sigend);
 	signal_set(SIGTERM, sigend);
 
-	fanotify_fd = fanotify_init(FAN_CLASS_PRE_CONTENT, O_RDWR);
+	/* Identify files by handle where permission events support it */
+	fanotify_fd = fanotify_init(FAN_CLASS_PRE_CONTENT | FAN_REPORT_FID,
+				    O_RDWR);
+	if (fanotify_fd >= 0)
+		fhcache_fid = 1;
+	else if (errno == EINVAL)
+		fanotify_fd = fanotify_init(FAN_CLASS_PRE_CONTENT, O_RDWR);
 	if (fanotify_fd < 0) {
 		fprintf(stderr, "cannot start fanotify, error %d\n",
 			errno);
 		return errno;
 	}
 
+	if (fs_mark) {
+		ret = monitor_filesystem(fanotify_fd, fs_mark);
+		if (ret)
+			return ret;
+	}
+
 	daemon_thr = pthread_self();
 
 	watcher_thr = start_watcher(be, fanotify_fd);
@@ -176,6 +291,7 @@ int main(int argc, char **argv)
 
 	stop_cli(cli_thr);
 	stop_watcher(watcher_thr);
+	ioengine_exit();
 
 	return 0;
 }
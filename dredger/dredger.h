@@ -3,6 +3,6 @@
 
 extern int daemon_stopped;
 extern pthread_t daemon_thr;
-extern char *frontend_prefix;
+extern char frontend_prefix[];
 
 #endif /* _DREDGER_H */
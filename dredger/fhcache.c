@@ -0,0 +1,207 @@
+/*
+ * fhcache.c
+ *
+ * File handle to backend key cache for dredger.
+ *
+ * Resolving the pathname of an event fd through /proc walks the
+ * whole path, and yields the new name once a file is renamed.
+ * So the pathname a file has been monitored with, which is the
+ * key of its backend file, is cached by file identity instead.
+ * Files accessed without being monitored under their own name,
+ * eg via a directory mark, are resolved on the first access.
+ * The least recently used entry is reused once the cache is full;
+ * monitored files have their key stored with the stub as well,
+ * which is read back on a miss.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+#include "list.h"
+#include "logging.h"
+#include "fhcache.h"
+
+#define LOG_AREA "fhcache"
+
+#define FHCACHE_HASH_SIZE 1024
+#define FHCACHE_SIZE 4096
+
+struct fhcache_entry {
+	struct fhcache_entry *next;
+	struct list_head lru;
+	struct fh_key key;
+	char *pathname;
+};
+
+/* Set when events carry file handles */
+int fhcache_fid;
+int fhcache_size = FHCACHE_SIZE;
+
+static struct fhcache_entry *fhcache_hash[FHCACHE_HASH_SIZE];
+static LIST_HEAD(fhcache_lru);
+static int fhcache_num;
+static unsigned long long fhcache_hits, fhcache_misses;
+static pthread_mutex_t fhcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t fh_key_len(struct fh_key *key)
+{
+	return offsetof(struct fh_key, handle) + key->len;
+}
+
+static unsigned int fhcache_hashfn(struct fh_key *key)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	unsigned int h = 2166136261U;
+	size_t i;
+
+	/* FNV-1a */
+	for (i = 0; i < fh_key_len(key); i++)
+		h = (h ^ p[i]) * 16777619U;
+	return h % FHCACHE_HASH_SIZE;
+}
+
+void fh_key_ino(struct fh_key *key, dev_t dev, ino_t ino)
+{
+	unsigned long long d = dev;
+
+	memset(key, 0, sizeof(struct fh_key));
+	key->fsid.val[0] = d;
+	key->fsid.val[1] = d >> 32;
+	key->len = sizeof(ino_t);
+	memcpy(key->handle, &ino, sizeof(ino_t));
+}
+
+/* Build the key for @pathname matching the keys of the events */
+int fh_key_path(struct fh_key *key, const char *pathname)
+{
+	struct {
+		struct file_handle fh;
+		unsigned char buf[MAX_HANDLE_SZ];
+	} h;
+	struct statfs stfs;
+	struct stat st;
+	int mount_id;
+
+	if (!fhcache_fid) {
+		if (stat(pathname, &st) < 0)
+			return errno;
+		fh_key_ino(key, st.st_dev, st.st_ino);
+		return 0;
+	}
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	if (name_to_handle_at(AT_FDCWD, pathname, &h.fh, &mount_id, 0) < 0)
+		return errno;
+	if (statfs(pathname, &stfs) < 0)
+		return errno;
+	memset(key, 0, sizeof(struct fh_key));
+	memcpy(&key->fsid, &stfs.f_fsid, sizeof(key->fsid));
+	key->type = h.fh.handle_type;
+	key->len = h.fh.handle_bytes;
+	memcpy(key->handle, h.fh.f_handle, key->len);
+	return 0;
+}
+
+static struct fhcache_entry *__fhcache_lookup(struct fh_key *key,
+					      unsigned int h)
+{
+	struct fhcache_entry *fe;
+
+	for (fe = fhcache_hash[h]; fe; fe = fe->next) {
+		if (fe->key.len == key->len &&
+		    !memcmp(&fe->key, key, fh_key_len(key)))
+			break;
+	}
+	return fe;
+}
+
+/* Copy the cached pathname for @key into @pathname */
+int fhcache_lookup(struct fh_key *key, char *pathname)
+{
+	struct fhcache_entry *fe;
+
+	pthread_mutex_lock(&fhcache_lock);
+	fe = __fhcache_lookup(key, fhcache_hashfn(key));
+	if (fe) {
+		list_move(&fe->lru, &fhcache_lru);
+		strcpy(pathname, fe->pathname);
+		fhcache_hits++;
+	} else
+		fhcache_misses++;
+	pthread_mutex_unlock(&fhcache_lock);
+	return fe ? 0 : ENOENT;
+}
+
+static void fhcache_unhash(struct fhcache_entry *fe)
+{
+	struct fhcache_entry **pp;
+
+	pp = &fhcache_hash[fhcache_hashfn(&fe->key)];
+	while (*pp != fe)
+		pp = &(*pp)->next;
+	*pp = fe->next;
+}
+
+void fhcache_insert(struct fh_key *key, const char *pathname)
+{
+	struct fhcache_entry *fe;
+	unsigned int h = fhcache_hashfn(key);
+	char *name;
+
+	name = strdup(pathname);
+	if (!name)
+		return;
+	pthread_mutex_lock(&fhcache_lock);
+	fe = __fhcache_lookup(key, h);
+	if (fe) {
+		/* Monitored again, possibly under another name */
+		free(fe->pathname);
+		fe->pathname = name;
+		list_move(&fe->lru, &fhcache_lru);
+		goto out_unlock;
+	}
+	if (fhcache_num < fhcache_size) {
+		fe = malloc(sizeof(struct fhcache_entry));
+		if (!fe) {
+			free(name);
+			goto out_unlock;
+		}
+		fhcache_num++;
+	} else {
+		fe = list_entry(fhcache_lru.prev, struct fhcache_entry, lru);
+		list_del(&fe->lru);
+		fhcache_unhash(fe);
+		free(fe->pathname);
+	}
+	memcpy(&fe->key, key, sizeof(struct fh_key));
+	fe->pathname = name;
+	fe->next = fhcache_hash[h];
+	fhcache_hash[h] = fe;
+	list_add(&fe->lru, &fhcache_lru);
+out_unlock:
+	pthread_mutex_unlock(&fhcache_lock);
+}
+
+/* Log and reset the hit statistics */
+void fhcache_report(void)
+{
+	unsigned long long hits, misses;
+	int num;
+
+	pthread_mutex_lock(&fhcache_lock);
+	hits = fhcache_hits;
+	misses = fhcache_misses;
+	num = fhcache_num;
+	fhcache_hits = fhcache_misses = 0;
+	pthread_mutex_unlock(&fhcache_lock);
+	if (!hits && !misses)
+		return;
+	info("%llu hits, %llu misses, %d entries", hits, misses, num);
+}
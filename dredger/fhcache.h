@@ -0,0 +1,28 @@
+#ifndef _FHCACHE_H
+#define _FHCACHE_H
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <linux/types.h>
+
+/*
+ * File identity: the file handle with FAN_REPORT_FID,
+ * or device and inode number otherwise.
+ */
+struct fh_key {
+	__kernel_fsid_t fsid;
+	unsigned int type;
+	unsigned int len;
+	unsigned char handle[MAX_HANDLE_SZ];
+};
+
+extern int fhcache_fid;
+extern int fhcache_size;
+
+void fh_key_ino(struct fh_key *key, dev_t dev, ino_t ino);
+int fh_key_path(struct fh_key *key, const char *pathname);
+int fhcache_lookup(struct fh_key *key, char *pathname);
+void fhcache_insert(struct fh_key *key, const char *pathname);
+void fhcache_report(void);
+
+#endif /* _FHCACHE_H */
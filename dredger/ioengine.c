@@ -0,0 +1,565 @@
+/*
+ * ioengine.c
+ *
+ * io_uring based I/O engine for the backends.
+ *
+ * A single thread keeps the I/O of all jobs in flight on one
+ * io_uring. Copies are split into chunks, each using one of a
+ * fixed number of registered buffers; a chunk is read and then
+ * written with a linked pair of submission entries, so it costs
+ * no thread switch in between. Chunks of all running jobs are
+ * issued in turn, so one large copy does not hold up the others.
+ * New jobs wake up the engine through an eventfd polled on the
+ * ring itself.
+ *
+ * Jobs complete through a callback, which may submit the next
+ * job right away. Recalls and migrations are driven that way, so
+ * they do not tie up a thread while their data is copied and the
+ * number of recalls in flight is only limited by the number of
+ * watcher events. Callbacks must not wait for jobs themselves;
+ * the other backend calls are synchronous and wait for their
+ * jobs with ioengine_copy() and friends.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/falloc.h>
+
+#include "list.h"
+#include "logging.h"
+#include "uring.h"
+#include "ioengine.h"
+
+#define LOG_AREA "ioengine"
+
+#define IOENGINE_CHUNK_SIZE (128 * 1024)
+
+/* Low bits of the user data, the rest is the slot or the job */
+#define IOENGINE_READ 1
+#define IOENGINE_WRITE 2
+#define IOENGINE_JOB 4
+#define IOENGINE_WAKEUP 0
+
+struct ioengine_slot {
+	struct ioengine_job *job;
+	unsigned long long pos;
+	unsigned long long end;
+	/* Bytes read for the chunk in flight, or the read error */
+	long long read;
+	int write_only;
+};
+
+/* Number of chunks in flight, 0 to do all I/O synchronously */
+int ioengine_depth;
+
+static struct uring ioengine_ring;
+static struct ioengine_slot *ioengine_slots;
+static int *ioengine_free;
+static int ioengine_num_free;
+/* Slots whose chunk could not be issued again for lack of entries */
+static int *ioengine_retry;
+static int ioengine_num_retry;
+/* The wakeup poll could not be armed again */
+static int ioengine_rearm;
+/* Punch and fsync jobs in flight */
+static int ioengine_ops;
+static char *ioengine_bufs;
+static int ioengine_evfd = -1;
+static pthread_t ioengine_thr;
+static int ioengine_stopped;
+static int ioengine_running;
+/* Jobs submitted, and jobs with chunks still to be issued */
+static LIST_HEAD(ioengine_queue);
+static LIST_HEAD(ioengine_active);
+static pthread_mutex_t ioengine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int ioengine_enabled(void)
+{
+	return ioengine_running;
+}
+
+static void ioengine_wakeup(void)
+{
+	uint64_t val = 1;
+
+	if (write(ioengine_evfd, &val, sizeof(val)) < 0)
+		err("cannot wake up engine, error %d", errno);
+}
+
+static int ioengine_arm_wakeup(void)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ioengine_ring);
+	if (!sqe)
+		return ENOSPC;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ioengine_evfd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = IOENGINE_WAKEUP;
+	return 0;
+}
+
+static void ioengine_finish(struct ioengine_job *job)
+{
+	dbg("job %p finished, error %d", job, job->error);
+	job->complete(job);
+}
+
+/*
+ * Issue the read and the linked write for the rest of the slot.
+ * Returns ENOSPC if the ring has no room for them.
+ */
+static int ioengine_issue_chunk(int idx)
+{
+	struct ioengine_slot *slot = &ioengine_slots[idx];
+	struct ioengine_job *job = slot->job;
+	struct io_uring_sqe *sqe;
+	char *buf = ioengine_bufs + (size_t)idx * IOENGINE_CHUNK_SIZE;
+
+	if (uring_sq_space(&ioengine_ring) < (slot->write_only ? 1 : 2))
+		return ENOSPC;
+	if (!slot->write_only) {
+		slot->read = slot->end - slot->pos;
+		sqe = uring_get_sqe(&ioengine_ring);
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->flags = IOSQE_IO_LINK;
+		sqe->fd = job->src_fd;
+		sqe->addr = (unsigned long)buf;
+		sqe->len = slot->read;
+		sqe->off = slot->pos;
+		sqe->buf_index = idx;
+		sqe->user_data = ((uint64_t)idx << 3) | IOENGINE_READ;
+	}
+	sqe = uring_get_sqe(&ioengine_ring);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = job->dst_fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = slot->read;
+	sqe->off = slot->pos;
+	sqe->buf_index = idx;
+	sqe->user_data = ((uint64_t)idx << 3) | IOENGINE_WRITE;
+	return 0;
+}
+
+/*
+ * Issue the single operation of a punch, fsync or statx job.
+ * Returns ENOSPC if the ring is full.
+ */
+static int ioengine_issue_job(struct ioengine_job *job)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&ioengine_ring);
+	if (!sqe)
+		return ENOSPC;
+	sqe->fd = job->dst_fd;
+	if (job->op == IOENGINE_PUNCH) {
+		sqe->opcode = IORING_OP_FALLOCATE;
+		sqe->off = job->offset;
+		sqe->addr = job->len;
+		sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+	} else if (job->op == IOENGINE_STATX) {
+		sqe->opcode = IORING_OP_STATX;
+		sqe->addr = (unsigned long)"";
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (unsigned long)job->stx;
+		sqe->statx_flags = AT_EMPTY_PATH;
+	} else {
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	}
+	sqe->user_data = (uintptr_t)job | IOENGINE_JOB;
+	job->inflight++;
+	ioengine_ops++;
+	return 0;
+}
+
+/* Hand out the free slots to the active jobs in turn */
+static void ioengine_issue(void)
+{
+	struct ioengine_job *job, *tmp;
+	struct ioengine_slot *slot;
+	unsigned long long len;
+	int idx, issued = 1;
+
+	if (ioengine_rearm && !ioengine_arm_wakeup())
+		ioengine_rearm = 0;
+	while (ioengine_num_retry &&
+	       !ioengine_issue_chunk(ioengine_retry[ioengine_num_retry - 1]))
+		ioengine_num_retry--;
+
+	pthread_mutex_lock(&ioengine_lock);
+	list_for_each_entry_safe(job, tmp, &ioengine_queue, list) {
+		if (job->op != IOENGINE_COPY) {
+			/* Leave room in the rings for the chunks */
+			if (ioengine_ops >= ioengine_depth * 2 ||
+			    ioengine_issue_job(job))
+				continue;
+			list_del(&job->list);
+			continue;
+		}
+		list_del(&job->list);
+		job->next = job->offset;
+		list_add_tail(&job->list, &ioengine_active);
+	}
+	pthread_mutex_unlock(&ioengine_lock);
+
+	while (ioengine_num_free && issued) {
+		issued = 0;
+		list_for_each_entry_safe(job, tmp, &ioengine_active, list) {
+			if (job->error) {
+				list_del_init(&job->list);
+				if (!job->inflight)
+					ioengine_finish(job);
+				continue;
+			}
+			if (!ioengine_num_free ||
+			    uring_sq_space(&ioengine_ring) < 2)
+				return;
+			idx = ioengine_free[--ioengine_num_free];
+			slot = &ioengine_slots[idx];
+			len = job->offset + job->len - job->next;
+			if (len > IOENGINE_CHUNK_SIZE)
+				len = IOENGINE_CHUNK_SIZE;
+			slot->job = job;
+			slot->pos = job->next;
+			slot->end = job->next + len;
+			slot->write_only = 0;
+			job->next += len;
+			if (job->next == job->offset + job->len)
+				list_del_init(&job->list);
+			job->inflight++;
+			ioengine_issue_chunk(idx);
+			issued++;
+		}
+	}
+}
+
+static void ioengine_put_slot(int idx)
+{
+	struct ioengine_job *job = ioengine_slots[idx].job;
+
+	ioengine_slots[idx].job = NULL;
+	ioengine_free[ioengine_num_free++] = idx;
+	if (--job->inflight)
+		return;
+	/* Chunks not yet issued are dropped on error */
+	if (job->error && !list_empty(&job->list))
+		list_del_init(&job->list);
+	if (list_empty(&job->list))
+		ioengine_finish(job);
+}
+
+static void ioengine_complete(struct io_uring_cqe *cqe)
+{
+	uint64_t data = cqe->user_data;
+	struct ioengine_slot *slot;
+	struct ioengine_job *job;
+	int idx = data >> 3;
+
+	if (data == IOENGINE_WAKEUP) {
+		uint64_t val;
+
+		if (read(ioengine_evfd, &val, sizeof(val)) < 0 &&
+		    errno != EAGAIN)
+			err("cannot read wakeup event, error %d", errno);
+		if (ioengine_arm_wakeup())
+			ioengine_rearm = 1;
+		return;
+	}
+	if (data & IOENGINE_JOB) {
+		job = (struct ioengine_job *)(uintptr_t)(data & ~7ULL);
+		if (cqe->res < 0)
+			job->error = -cqe->res;
+		job->inflight--;
+		ioengine_ops--;
+		ioengine_finish(job);
+		return;
+	}
+	slot = &ioengine_slots[idx];
+	job = slot->job;
+	if (data & IOENGINE_READ) {
+		/* A short read cancels the linked write */
+		slot->read = cqe->res;
+		if (cqe->res < 0 && !job->error)
+			job->error = -cqe->res;
+		return;
+	}
+	if (cqe->res == -ECANCELED) {
+		if (slot->read == 0 && !job->error) {
+			err("source file truncated at %llu", slot->pos);
+			job->error = EIO;
+		}
+		if (slot->read > 0 && !job->error) {
+			/* Write what has been read */
+			slot->write_only = 1;
+			goto reissue;
+		}
+	} else if (cqe->res < 0) {
+		if (!job->error)
+			job->error = -cqe->res;
+	} else {
+		slot->pos += cqe->res;
+		slot->write_only = 0;
+	}
+	if (job->error || slot->pos >= slot->end) {
+		ioengine_put_slot(idx);
+		return;
+	}
+	/* Short write, or the rest after a short read */
+reissue:
+	if (ioengine_issue_chunk(idx))
+		ioengine_retry[ioengine_num_retry++] = idx;
+}
+
+static void *ioengine_thread(void *arg)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	while (!__atomic_load_n(&ioengine_stopped, __ATOMIC_ACQUIRE)) {
+		ioengine_issue();
+		ret = uring_submit(&ioengine_ring, 1);
+		if (ret < 0) {
+			err("io_uring submission failed, error %d", -ret);
+			continue;
+		}
+		while ((cqe = uring_peek_cqe(&ioengine_ring))) {
+			ioengine_complete(cqe);
+			uring_cqe_seen(&ioengine_ring);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start the engine with @depth chunks in flight. Without
+ * io_uring support the backends do synchronous I/O instead.
+ */
+int ioengine_init(int depth)
+{
+	struct iovec *iov;
+	int i, ret;
+
+	ioengine_depth = depth;
+	ioengine_slots = calloc(depth, sizeof(struct ioengine_slot));
+	ioengine_free = calloc(depth, sizeof(int));
+	ioengine_retry = calloc(depth, sizeof(int));
+	iov = calloc(depth, sizeof(struct iovec));
+	ioengine_bufs = aligned_alloc(4096, (size_t)depth *
+				      IOENGINE_CHUNK_SIZE);
+	if (!ioengine_slots || !ioengine_free || !ioengine_retry || !iov ||
+	    !ioengine_bufs) {
+		ret = ENOMEM;
+		goto out_free;
+	}
+	/* Two entries per chunk and per job, and the wakeup poll */
+	ret = uring_init(&ioengine_ring, depth * 4 + 1);
+	if (ret < 0) {
+		ret = -ret;
+		goto out_free;
+	}
+	for (i = 0; i < depth; i++) {
+		iov[i].iov_base = ioengine_bufs + (size_t)i *
+			IOENGINE_CHUNK_SIZE;
+		iov[i].iov_len = IOENGINE_CHUNK_SIZE;
+		ioengine_free[i] = depth - 1 - i;
+	}
+	ioengine_num_free = depth;
+	ret = uring_register_buffers(&ioengine_ring, iov, depth);
+	if (ret < 0) {
+		err("cannot register buffers, error %d", -ret);
+		ret = -ret;
+		goto out_exit;
+	}
+	ioengine_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ioengine_evfd < 0) {
+		ret = errno;
+		goto out_exit;
+	}
+	ioengine_arm_wakeup();
+	ret = pthread_create(&ioengine_thr, NULL, ioengine_thread, NULL);
+	if (ret)
+		goto out_close;
+	free(iov);
+	ioengine_running = 1;
+	info("Started I/O engine with %d chunks in flight", depth);
+	return 0;
+
+out_close:
+	close(ioengine_evfd);
+	ioengine_evfd = -1;
+out_exit:
+	uring_exit(&ioengine_ring);
+out_free:
+	free(iov);
+	free(ioengine_bufs);
+	free(ioengine_retry);
+	free(ioengine_free);
+	free(ioengine_slots);
+	ioengine_bufs = NULL;
+	ioengine_retry = NULL;
+	ioengine_free = NULL;
+	ioengine_slots = NULL;
+	err("Cannot start I/O engine, error %d", ret);
+	return ret;
+}
+
+/* Stop the engine; all jobs have to be finished by now */
+void ioengine_exit(void)
+{
+	if (!ioengine_running)
+		return;
+	ioengine_running = 0;
+	__atomic_store_n(&ioengine_stopped, 1, __ATOMIC_RELEASE);
+	ioengine_wakeup();
+	pthread_join(ioengine_thr, NULL);
+	close(ioengine_evfd);
+	ioengine_evfd = -1;
+	uring_exit(&ioengine_ring);
+	free(ioengine_bufs);
+	free(ioengine_retry);
+	free(ioengine_free);
+	free(ioengine_slots);
+}
+
+/*
+ * Queue @job; @job->complete is called from the engine thread
+ * once it is finished. It may submit @job again from there.
+ */
+void ioengine_submit(struct ioengine_job *job)
+{
+	job->error = 0;
+	job->inflight = 0;
+	INIT_LIST_HEAD(&job->list);
+	if (job->op == IOENGINE_COPY && !job->len) {
+		job->complete(job);
+		return;
+	}
+	pthread_mutex_lock(&ioengine_lock);
+	list_add_tail(&job->list, &ioengine_queue);
+	pthread_mutex_unlock(&ioengine_lock);
+	ioengine_wakeup();
+}
+
+/* Waiting for a job from a backend call */
+struct ioengine_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+};
+
+static void ioengine_wait_complete(struct ioengine_job *job)
+{
+	struct ioengine_wait *w = job->arg;
+
+	pthread_mutex_lock(&w->lock);
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int ioengine_run(struct ioengine_job *job)
+{
+	struct ioengine_wait w = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	int oldstate;
+
+	/* The engine references @job and @w until it completes */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	job->complete = ioengine_wait_complete;
+	job->arg = &w;
+	INIT_LIST_HEAD(&job->list);
+	ioengine_submit(job);
+	pthread_mutex_lock(&w.lock);
+	while (!w.done)
+		pthread_cond_wait(&w.cond, &w.lock);
+	pthread_mutex_unlock(&w.lock);
+	pthread_setcancelstate(oldstate, NULL);
+	return job->error;
+}
+
+int ioengine_copy(int dst_fd, int src_fd, unsigned long long offset,
+		  unsigned long long len)
+{
+	struct ioengine_job job = {
+		.op = IOENGINE_COPY,
+		.src_fd = src_fd,
+		.dst_fd = dst_fd,
+		.offset = offset,
+		.len = len,
+	};
+
+	return ioengine_run(&job);
+}
+
+int ioengine_punch(int fd, unsigned long long offset,
+		   unsigned long long len)
+{
+	struct ioengine_job job = {
+		.op = IOENGINE_PUNCH,
+		.dst_fd = fd,
+		.offset = offset,
+		.len = len,
+	};
+
+	return ioengine_run(&job);
+}
+
+int ioengine_fsync(int fd)
+{
+	struct ioengine_job job = {
+		.op = IOENGINE_FSYNC,
+		.dst_fd = fd,
+	};
+
+	return ioengine_run(&job);
+}
+
+int ioengine_stat(int fd, struct stat *st)
+{
+	struct statx stx;
+	struct ioengine_job job = {
+		.op = IOENGINE_STATX,
+		.dst_fd = fd,
+		.stx = &stx,
+	};
+	int ret;
+
+	ret = ioengine_run(&job);
+	if (ret)
+		return ret;
+	memset(st, 0, sizeof(struct stat));
+	st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st->st_ino = stx.stx_ino;
+	st->st_mode = stx.stx_mode;
+	st->st_nlink = stx.stx_nlink;
+	st->st_uid = stx.stx_uid;
+	st->st_gid = stx.stx_gid;
+	st->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st->st_size = stx.stx_size;
+	st->st_blksize = stx.stx_blksize;
+	st->st_blocks = stx.stx_blocks;
+	st->st_atim.tv_sec = stx.stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+	return 0;
+}
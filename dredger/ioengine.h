@@ -0,0 +1,48 @@
+#ifndef _IOENGINE_H
+#define _IOENGINE_H
+
+#include <sys/stat.h>
+#include "list.h"
+
+enum ioengine_op {
+	IOENGINE_COPY,
+	IOENGINE_PUNCH,
+	IOENGINE_FSYNC,
+	IOENGINE_STATX,
+};
+
+/*
+ * An asynchronous job. @complete is called from the engine
+ * thread once the job is finished, with @error set on failure.
+ */
+struct ioengine_job {
+	enum ioengine_op op;
+	int src_fd;
+	int dst_fd;
+	unsigned long long offset;
+	unsigned long long len;
+	/* Attributes of @dst_fd for IOENGINE_STATX */
+	struct statx *stx;
+	int error;
+	void (*complete)(struct ioengine_job *job);
+	void *arg;
+	/* Used by the engine */
+	struct list_head list;
+	unsigned long long next;
+	int inflight;
+};
+
+extern int ioengine_depth;
+
+int ioengine_init(int depth);
+void ioengine_exit(void);
+int ioengine_enabled(void);
+void ioengine_submit(struct ioengine_job *job);
+int ioengine_copy(int dst_fd, int src_fd, unsigned long long offset,
+		  unsigned long long len);
+int ioengine_punch(int fd, unsigned long long offset,
+		   unsigned long long len);
+int ioengine_fsync(int fd);
+int ioengine_stat(int fd, struct stat *st);
+
+#endif /* _IOENGINE_H */
@@ -0,0 +1,215 @@
+/*
+ * iosched.c
+ *
+ * I/O scheduling between recalls, prefetch and migration.
+ *
+ * All backend I/O takes a slot from a fixed number of slots
+ * first. Each class has its own queue of threads waiting for
+ * a slot and its own limit on the slots in use. A free slot
+ * goes to the first class in priority order which still has
+ * credit left; credit is refilled from the class weights once
+ * no waiting class has any. A class with weight 0 only gets a
+ * slot if no weighted class is waiting, so by default recalls
+ * have strict priority over prefetch and migration.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "iosched.h"
+
+#define LOG_AREA "iosched"
+
+struct sched_queue {
+	const char *name;
+	int weight;
+	int cap;
+	int credit;
+	int active;
+	int waiting;
+	/* Statistics since the last report */
+	int max_waiting;
+	unsigned long long grants;
+	unsigned long long wait_usecs;
+	unsigned long long max_usecs;
+};
+
+/* Number of backend I/Os in flight, 0 for the number of workers */
+int sched_slots;
+
+static struct sched_queue sched_queue[SCHED_CLASSES] = {
+	[SCHED_RECALL] = { .name = "recall", .weight = 1, .cap = 0 },
+	[SCHED_PREFETCH] = { .name = "prefetch", .weight = 0, .cap = 1 },
+	[SCHED_MIGRATE] = { .name = "migrate", .weight = 0, .cap = 1 },
+};
+static int sched_active;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_free = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Parse the class weights as '<recall>,<prefetch>,<migrate>',
+ * each optionally followed by '/<cap>' to limit the slots used
+ * by that class.
+ */
+int sched_parse_weights(char *optarg)
+{
+	struct sched_queue *q;
+	char *p = optarg, *e;
+	int i;
+
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		q = &sched_queue[i];
+		q->weight = strtoul(p, &e, 10);
+		if (e == p)
+			goto out_invalid;
+		if (*e == '/') {
+			p = e + 1;
+			q->cap = strtoul(p, &e, 10);
+			if (e == p || q->cap < 1)
+				goto out_invalid;
+		}
+		if (*e == '\0')
+			break;
+		if (*e != ',')
+			goto out_invalid;
+		p = e + 1;
+	}
+	if (i == SCHED_CLASSES || sched_queue[SCHED_RECALL].weight < 1)
+		goto out_invalid;
+	return 0;
+out_invalid:
+	err("Invalid scheduler weights '%s'", optarg);
+	return EINVAL;
+}
+
+void sched_init(int slots)
+{
+	int i;
+
+	sched_slots = slots;
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		if (!sched_queue[i].cap || sched_queue[i].cap > slots)
+			sched_queue[i].cap = slots;
+	}
+	info("%d slots, weights %d/%d/%d", sched_slots,
+	     sched_queue[SCHED_RECALL].weight,
+	     sched_queue[SCHED_PREFETCH].weight,
+	     sched_queue[SCHED_MIGRATE].weight);
+}
+
+static int sched_eligible(struct sched_queue *q)
+{
+	return q->waiting && q->active < q->cap;
+}
+
+/* Select the class to get the next slot, or -1 if none is waiting */
+static int sched_pick(void)
+{
+	int i, refill = 0, strict = -1;
+
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		if (!sched_eligible(&sched_queue[i]))
+			continue;
+		if (sched_queue[i].credit)
+			return i;
+		if (sched_queue[i].weight)
+			refill = 1;
+		else if (strict < 0)
+			strict = i;
+	}
+	if (!refill)
+		return strict;
+	for (i = 0; i < SCHED_CLASSES; i++)
+		sched_queue[i].credit = sched_queue[i].weight;
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		if (sched_eligible(&sched_queue[i]) &&
+		    sched_queue[i].credit)
+			return i;
+	}
+	return strict;
+}
+
+static void sched_cancel(void *arg)
+{
+	struct sched_queue *q = arg;
+
+	q->waiting--;
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Wait for a slot for backend I/O of class @cls */
+void sched_get(enum sched_class cls)
+{
+	struct sched_queue *q = &sched_queue[cls];
+	struct timespec start, now;
+	unsigned long long usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&sched_lock);
+	q->waiting++;
+	if (q->waiting > q->max_waiting)
+		q->max_waiting = q->waiting;
+	pthread_cleanup_push(sched_cancel, q);
+	while (sched_active >= sched_slots || sched_pick() != cls)
+		pthread_cond_wait(&sched_free, &sched_lock);
+	pthread_cleanup_pop(0);
+	q->waiting--;
+	q->active++;
+	if (q->credit)
+		q->credit--;
+	sched_active++;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (now.tv_sec - start.tv_sec) * 1000000ULL +
+		(now.tv_nsec - start.tv_nsec) / 1000;
+	q->grants++;
+	q->wait_usecs += usecs;
+	if (usecs > q->max_usecs)
+		q->max_usecs = usecs;
+	/* Another class might be eligible now */
+	if (sched_active < sched_slots)
+		pthread_cond_broadcast(&sched_free);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+void sched_put(enum sched_class cls)
+{
+	pthread_mutex_lock(&sched_lock);
+	sched_queue[cls].active--;
+	sched_active--;
+	pthread_cond_broadcast(&sched_free);
+	pthread_mutex_unlock(&sched_lock);
+}
+
+/* Log and reset the per-class statistics */
+void sched_report(void)
+{
+	struct sched_queue st[SCHED_CLASSES];
+	int i;
+
+	/* Log from a copy, as logging might be a cancellation point */
+	pthread_mutex_lock(&sched_lock);
+	memcpy(st, sched_queue, sizeof(st));
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		sched_queue[i].max_waiting = sched_queue[i].waiting;
+		sched_queue[i].grants = 0;
+		sched_queue[i].wait_usecs = 0;
+		sched_queue[i].max_usecs = 0;
+	}
+	pthread_mutex_unlock(&sched_lock);
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		if (!st[i].grants && !st[i].max_waiting)
+			continue;
+		info("%s: %llu I/Os, %d active, queue depth %d (max %d), "
+		     "wait avg %llu us, max %llu us", st[i].name,
+		     st[i].grants, st[i].active, st[i].waiting,
+		     st[i].max_waiting,
+		     st[i].grants ? st[i].wait_usecs / st[i].grants : 0,
+		     st[i].max_usecs);
+	}
+}
@@ -0,0 +1,19 @@
+#ifndef _IOSCHED_H
+#define _IOSCHED_H
+
+enum sched_class {
+	SCHED_RECALL,
+	SCHED_PREFETCH,
+	SCHED_MIGRATE,
+	SCHED_CLASSES,
+};
+
+extern int sched_slots;
+
+int sched_parse_weights(char *optarg);
+void sched_init(int slots);
+void sched_get(enum sched_class cls);
+void sched_put(enum sched_class cls);
+void sched_report(void);
+
+#endif /* _IOSCHED_H */
@@ -6,22 +6,41 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 #include "fanotify.h"
 #include "fanotify-mark-syscall.h"
 
 #include "logging.h"
 #include "backend.h"
 #include "migrate.h"
+#include "resident.h"
+#include "fhcache.h"
+#include "migrated.h"
+#include "iosched.h"
 
 #define LOG_AREA "migrate"
 
+/*
+ * Chunk size for range recall, or 0 to always recall whole
+ * files. Reset to 0 if the kernel has no pre-content events.
+ */
+unsigned long long recall_chunk_size;
+
+/*
+ * Set when the whole filesystem is marked; monitored files are
+ * then only entered in the set of migrated files.
+ */
+int monitor_fs;
+
 int migrate_file(struct backend *be, int fe_fd, char *filename)
 {
 	int ret;
 
-	ret = open_backend(be, filename);
+	ret = open_backend(be, filename, BACKEND_CREATE);
 	if (ret) {
 		if (ret == EEXIST) {
 			info("file '%s' already migrated", filename);
@@ -33,10 +52,19 @@ int migrate_file(struct backend *be, int fe_fd, char *filename)
 	}
 	if (fe_fd < 0) {
 		info("start setup file '%s'", filename);
+		sched_get(SCHED_MIGRATE);
 		ret = setup_backend(be);
+		sched_put(SCHED_MIGRATE);
 	} else {
+		struct stat st;
+
 		info("start migration on file '%s'", filename);
+		sched_get(SCHED_MIGRATE);
 		ret = migrate_backend(be, fe_fd);
+		sched_put(SCHED_MIGRATE);
+		/* Nothing is resident anymore */
+		if (!ret && fstat(fe_fd, &st) == 0)
+			resident_forget(st.st_dev, st.st_ino);
 	}
 	close_backend(be);
 	if (ret) {
@@ -53,35 +81,491 @@ int unmigrate_file(struct backend *be, int fe_fd, char *filename)
 {
 	int ret;
 
-	ret = open_backend(be, filename);
+	ret = open_backend(be, filename, 0);
 	if (ret) {
-		if (ret == ENOENT) {
-			info("backend file %s already un-migrated",
-			     filename);
-			ret = 0;
-		} else {
-			err("failed to open backend file %s, error %d",
-			    filename, ret);
-		}
+		/* The data is gone if there is no backend file */
+		err("failed to open backend file %s, error %d",
+		    filename, ret);
 		return ret;
 	}
 	info("start un-migration on file '%s'", filename);
+	sched_get(SCHED_RECALL);
 	ret = unmigrate_backend(be, fe_fd);
-	if (ret < 0) {
+	sched_put(SCHED_RECALL);
+	if (ret) {
 		err("failed to unmigrate file %s, error %d",
 		    filename, ret);
 	} else {
+		struct stat st;
+
 		info("finished un-migration on file '%s'", filename);
+		/* Later accesses need not be recalled again */
+		if (fstat(fe_fd, &st) == 0)
+			resident_add(st.st_dev, st.st_ino, 0, st.st_size);
 	}
 	close_backend(be);
 
 	return ret;
 }
 
+/* A migration or whole file recall running on the I/O engine */
+struct migrate_async {
+	struct backend *be;
+	int fe_fd;
+	enum sched_class cls;
+	void (*done) (void *arg, int error);
+	void *arg;
+	char filename[FILENAME_MAX];
+};
+
+static void migrate_async_free(struct migrate_async *ma)
+{
+	sched_put(ma->cls);
+	close_backend(ma->be);
+	free_backend(ma->be);
+	free(ma);
+}
+
+/* Called from the I/O engine once the file has been copied */
+static void migrate_async_done(void *arg, int error)
+{
+	struct migrate_async *ma = arg;
+	void (*done) (void *arg, int error) = ma->done;
+	void *done_arg = ma->arg;
+	int migrate = ma->cls == SCHED_MIGRATE;
+	struct stat st;
+
+	if (error) {
+		err("failed to %s file %s, error %d",
+		    migrate ? "migrate" : "unmigrate", ma->filename, error);
+	} else if (migrate) {
+		info("finished migrating file '%s'", ma->filename);
+		/* Nothing is resident anymore */
+		if (fstat(ma->fe_fd, &st) == 0)
+			resident_forget(st.st_dev, st.st_ino);
+	} else {
+		info("finished un-migration on file '%s'", ma->filename);
+		/* Later accesses need not be recalled again */
+		if (fstat(ma->fe_fd, &st) == 0)
+			resident_add(st.st_dev, st.st_ino, 0, st.st_size);
+	}
+	migrate_async_free(ma);
+	done(done_arg, error);
+}
+
+static int migrate_async_start(struct backend *be, int fe_fd,
+			       char *filename, enum sched_class cls,
+			       void (*done) (void *arg, int error),
+			       void *arg)
+{
+	struct migrate_async *ma;
+	int migrate = cls == SCHED_MIGRATE, ret;
+
+	ma = malloc(sizeof(struct migrate_async));
+	if (!ma)
+		return ENOMEM;
+	/* The caller's backend is used again before this finishes */
+	ma->be = clone_backend(be);
+	if (!ma->be) {
+		free(ma);
+		return ENOMEM;
+	}
+	ret = open_backend(ma->be, filename, migrate ? BACKEND_CREATE : 0);
+	if (ret) {
+		err("failed to open backend file %s, error %d",
+		    filename, ret);
+		free_backend(ma->be);
+		free(ma);
+		return ret;
+	}
+	ma->fe_fd = fe_fd;
+	ma->cls = cls;
+	ma->done = done;
+	ma->arg = arg;
+	strcpy(ma->filename, filename);
+	info("start %s on file '%s'",
+	     migrate ? "migration" : "un-migration", filename);
+	sched_get(cls);
+	/* @ma belongs to the engine once the copy is started */
+	if (migrate)
+		ret = migrate_backend_async(ma->be, fe_fd,
+					    migrate_async_done, ma);
+	else
+		ret = unmigrate_backend_async(ma->be, fe_fd,
+					      migrate_async_done, ma);
+	if (!ret)
+		return EINPROGRESS;
+	if (ret != EOPNOTSUPP)
+		err("failed to %s file %s, error %d",
+		    migrate ? "migrate" : "unmigrate", filename, ret);
+	migrate_async_free(ma);
+	return ret;
+}
+
+/*
+ * Migrate @filename like migrate_file(), without waiting for the
+ * data to be copied. The I/O slot is taken until @done is called
+ * with the result from the I/O engine thread, possibly before this
+ * returns; @fe_fd has to stay open until then. Returns EINPROGRESS
+ * if the migration has been started, or an error; EOPNOTSUPP if
+ * the backend can only migrate synchronously.
+ */
+int migrate_file_async(struct backend *be, int fe_fd, char *filename,
+		       void (*done) (void *arg, int error), void *arg)
+{
+	return migrate_async_start(be, fe_fd, filename, SCHED_MIGRATE,
+				   done, arg);
+}
+
+/* Recall all of @filename like unmigrate_file(), see above */
+int unmigrate_file_async(struct backend *be, int fe_fd, char *filename,
+			 void (*done) (void *arg, int error), void *arg)
+{
+	return migrate_async_start(be, fe_fd, filename, SCHED_RECALL,
+				   done, arg);
+}
+
+/*
+ * Recall @len bytes at @start of the frontend file unless
+ * they are resident already. The I/O slot is taken with the
+ * file locked, so a slot is never held while waiting for
+ * another chunk copy of the same file.
+ */
+static int recall_chunk(struct backend *be, int fe_fd, char *filename,
+			struct stat *st, unsigned long long start,
+			unsigned long long len, enum sched_class cls)
+{
+	int ret = 0;
+
+	resident_lock_file(st->st_dev, st->st_ino);
+	if (!resident_check(st->st_dev, st->st_ino, start, start + len)) {
+		sched_get(cls);
+		ret = unmigrate_range_backend(be, fe_fd, start, len);
+		sched_put(cls);
+		if (ret)
+			err("failed to recall %llu bytes at %llu of %s, "
+			    "error %d", len, start, filename, ret);
+		else
+			ret = resident_add(st->st_dev, st->st_ino,
+					   start, start + len);
+	}
+	resident_unlock_file(st->st_dev, st->st_ino);
+	return ret;
+}
+
+/*
+ * Recall the chunks covering @count bytes at @offset of
+ * @filename which are not resident yet.
+ */
+int unmigrate_file_range(struct backend *be, int fe_fd, char *filename,
+			 unsigned long long offset, unsigned long long count)
+{
+	struct stat st;
+	unsigned long long start, end, len;
+	int ret;
+
+	if (fstat(fe_fd, &st) < 0) {
+		err("Cannot stat frontend fd, error %d", errno);
+		return errno;
+	}
+	start = offset - offset % recall_chunk_size;
+	end = offset + count + recall_chunk_size - 1;
+	end -= end % recall_chunk_size;
+	if (end > st.st_size)
+		end = st.st_size;
+	if (resident_check(st.st_dev, st.st_ino, start, end))
+		return 0;
+
+	ret = open_backend(be, filename, 0);
+	if (ret) {
+		err("failed to open backend file %s, error %d",
+		    filename, ret);
+		return ret;
+	}
+	info("start recall of '%s' from %llu to %llu",
+	     filename, start, end);
+	for (; start < end; start += len) {
+		len = recall_chunk_size;
+		if (len > end - start)
+			len = end - start;
+		ret = recall_chunk(be, fe_fd, filename, &st, start, len,
+				   SCHED_RECALL);
+		if (ret)
+			break;
+	}
+	close_backend(be);
+	return ret;
+}
+
+/* A range recall running on the I/O engine */
+struct recall_async {
+	struct backend *be;
+	int fe_fd;
+	dev_t dev;
+	ino_t ino;
+	/* Chunk being copied, and the end of the range */
+	unsigned long long start;
+	unsigned long long len;
+	unsigned long long end;
+	void (*done) (void *arg, int error);
+	void *arg;
+	char filename[FILENAME_MAX];
+};
+
+static void recall_async_done(void *arg, int error);
+
+/*
+ * Start copying the next chunk which is not resident yet.
+ * Returns ENODATA if there is none left.
+ */
+static int recall_async_next(struct recall_async *ra)
+{
+	for (; ra->start < ra->end; ra->start += ra->len) {
+		ra->len = recall_chunk_size;
+		if (ra->len > ra->end - ra->start)
+			ra->len = ra->end - ra->start;
+		if (!resident_check(ra->dev, ra->ino, ra->start,
+				    ra->start + ra->len))
+			return unmigrate_range_backend_async(ra->be, ra->fe_fd,
+							     ra->start, ra->len,
+							     recall_async_done,
+							     ra);
+	}
+	return ENODATA;
+}
+
+static void recall_async_free(struct recall_async *ra)
+{
+	sched_put(SCHED_RECALL);
+	resident_unlock_file(ra->dev, ra->ino);
+	close_backend(ra->be);
+	free_backend(ra->be);
+	free(ra);
+}
+
+/* Called from the I/O engine once a chunk has been copied */
+static void recall_async_done(void *arg, int error)
+{
+	struct recall_async *ra = arg;
+	void (*done) (void *arg, int error) = ra->done;
+	void *done_arg = ra->arg;
+
+	if (error)
+		err("failed to recall %llu bytes at %llu of %s, error %d",
+		    ra->len, ra->start, ra->filename, error);
+	else
+		error = resident_add(ra->dev, ra->ino, ra->start,
+				     ra->start + ra->len);
+	if (!error) {
+		ra->start += ra->len;
+		error = recall_async_next(ra);
+		if (!error)
+			return;
+		if (error == ENODATA)
+			error = 0;
+	}
+	recall_async_free(ra);
+	done(done_arg, error);
+}
+
+/*
+ * Recall the chunks covering @count bytes at @offset of
+ * @filename like unmigrate_file_range(), without waiting for
+ * the data to be copied. The file stays locked and the I/O
+ * slot taken until @done is called with the result from the
+ * I/O engine thread, possibly before this returns. Returns
+ * EINPROGRESS if the recall has been started, 0 if the range
+ * is resident already, or an error; EOPNOTSUPP if the backend
+ * can only recall synchronously.
+ */
+int unmigrate_file_range_async(struct backend *be, int fe_fd, char *filename,
+			       unsigned long long offset,
+			       unsigned long long count,
+			       void (*done) (void *arg, int error), void *arg)
+{
+	struct recall_async *ra;
+	struct stat st;
+	unsigned long long start, end;
+	int ret;
+
+	if (fstat(fe_fd, &st) < 0) {
+		err("Cannot stat frontend fd, error %d", errno);
+		return errno;
+	}
+	start = offset - offset % recall_chunk_size;
+	end = offset + count + recall_chunk_size - 1;
+	end -= end % recall_chunk_size;
+	if (end > st.st_size)
+		end = st.st_size;
+	if (resident_check(st.st_dev, st.st_ino, start, end))
+		return 0;
+
+	ra = malloc(sizeof(struct recall_async));
+	if (!ra)
+		return ENOMEM;
+	/* The worker's backend is used again before this finishes */
+	ra->be = clone_backend(be);
+	if (!ra->be) {
+		free(ra);
+		return ENOMEM;
+	}
+	ret = open_backend(ra->be, filename, 0);
+	if (ret) {
+		err("failed to open backend file %s, error %d",
+		    filename, ret);
+		free_backend(ra->be);
+		free(ra);
+		return ret;
+	}
+	ra->fe_fd = fe_fd;
+	ra->dev = st.st_dev;
+	ra->ino = st.st_ino;
+	ra->start = start;
+	ra->len = 0;
+	ra->end = end;
+	ra->done = done;
+	ra->arg = arg;
+	strcpy(ra->filename, filename);
+	info("start recall of '%s' from %llu to %llu",
+	     filename, start, end);
+	resident_lock_file(st.st_dev, st.st_ino);
+	sched_get(SCHED_RECALL);
+	/* @ra belongs to the engine once the first chunk is started */
+	ret = recall_async_next(ra);
+	if (!ret)
+		return EINPROGRESS;
+	recall_async_free(ra);
+	return ret == ENODATA ? 0 : ret;
+}
+
+/*
+ * Recall the rest of @filename in the background, starting
+ * from the head of the file. One chunk is copied at a time,
+ * so an access to another chunk waits for at most one chunk
+ * copy. Stops early once @stop is set.
+ */
+int unmigrate_file_fill(struct backend *be, int fe_fd, char *filename,
+			int *stop)
+{
+	struct stat st;
+	unsigned long long start, len;
+	int ret;
+
+	if (fstat(fe_fd, &st) < 0) {
+		err("Cannot stat frontend fd, error %d", errno);
+		return errno;
+	}
+	ret = open_backend(be, filename, 0);
+	if (ret) {
+		err("failed to open backend file %s, error %d",
+		    filename, ret);
+		return ret;
+	}
+	info("start background recall of '%s'", filename);
+	for (start = 0; start < st.st_size; start += len) {
+		if (__atomic_load_n(stop, __ATOMIC_SEQ_CST)) {
+			ret = EINTR;
+			break;
+		}
+		len = recall_chunk_size;
+		if (len > st.st_size - start)
+			len = st.st_size - start;
+		ret = recall_chunk(be, fe_fd, filename, &st, start, len,
+				   SCHED_PREFETCH);
+		if (ret)
+			break;
+	}
+	close_backend(be);
+	if (!ret)
+		info("finished background recall of '%s'", filename);
+	return ret;
+}
+
+/*
+ * Remember @filename as the backend key of the monitored file.
+ * The cache only holds the most recently used files and is lost
+ * on restart, so the key is stored with the stub, too; the name
+ * of the file may have changed by the time it is accessed.
+ */
+static void cache_file(char *filename)
+{
+	struct fh_key key;
+	int ret;
+
+	if (setxattr(filename, MIGRATE_KEY_XATTR, filename,
+		     strlen(filename), 0) < 0)
+		warn("cannot store backend key of '%s', error %d",
+		     filename, errno);
+	ret = fh_key_path(&key, filename);
+	if (ret) {
+		warn("cannot get file handle for '%s', error %d",
+		     filename, ret);
+		return;
+	}
+	fhcache_insert(&key, filename);
+}
+
+/*
+ * Read the backend key stored with the stub open at @fd into
+ * @filename. Returns the length of the key, or -1 if it has none.
+ */
+int read_file_key(int fd, char *filename)
+{
+	ssize_t len;
+
+	len = fgetxattr(fd, MIGRATE_KEY_XATTR, filename, FILENAME_MAX - 1);
+	if (len <= 0)
+		return -1;
+	filename[len] = '\0';
+	return len;
+}
+
+/* The file is migrated again, so accesses must not be ignored */
+static void unignore_file(int fanotify_fd, char *filename)
+{
+	fanotify_mark(fanotify_fd, FAN_MARK_REMOVE | FAN_MARK_IGNORED_MASK,
+		      FAN_PRE_ACCESS | FAN_ACCESS_PERM, AT_FDCWD, filename);
+}
+
 int monitor_file(int fanotify_fd, char *filename)
 {
 	int ret;
 
+	if (monitor_fs) {
+		struct stat st;
+
+		if (stat(filename, &st) < 0) {
+			err("cannot stat %s, error %d", filename, errno);
+			return errno;
+		}
+		/*
+		 * Only after adding it, so that the watcher either
+		 * sees the file migrated or its ignore mark goes;
+		 * see ignore_unmigrated().
+		 */
+		ret = migrated_add(st.st_dev, st.st_ino);
+		unignore_file(fanotify_fd, filename);
+		if (!ret)
+			cache_file(filename);
+		return ret;
+	}
+	unignore_file(fanotify_fd, filename);
+	if (recall_chunk_size) {
+		info("Set pre-content fanotify_mark on '%s'", filename);
+		ret = fanotify_mark(fanotify_fd, FAN_MARK_ADD,
+				    FAN_PRE_ACCESS, AT_FDCWD, filename);
+		if (ret == 0) {
+			cache_file(filename);
+			return 0;
+		}
+		if (errno != EINVAL) {
+			err("failed to add fanotify mark "
+			    "to %s, error %d\n", filename, errno);
+			return errno;
+		}
+		info("No pre-content events, recalling whole files");
+		recall_chunk_size = 0;
+	}
 	info("Set fanotify_mark on '%s'", filename);
 	ret = fanotify_mark(fanotify_fd, FAN_MARK_ADD,
 			    FAN_ACCESS_PERM|FAN_EVENT_ON_CHILD,
@@ -90,20 +574,128 @@ int monitor_file(int fanotify_fd, char *filename)
 		err("failed to add fanotify mark "
 		    "to %s, error %d\n", filename, errno);
 		ret = -ret;
-	}
+	} else
+		cache_file(filename);
 	return ret;
 }
 
+/*
+ * Mark the whole filesystem containing @pathname. Events for
+ * files not in the set of migrated files are allowed right away.
+ */
+int monitor_filesystem(int fanotify_fd, char *pathname)
+{
+	int ret;
+
+	if (recall_chunk_size) {
+		info("Set pre-content filesystem mark on '%s'", pathname);
+		ret = fanotify_mark(fanotify_fd,
+				    FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+				    FAN_PRE_ACCESS, AT_FDCWD, pathname);
+		if (ret == 0)
+			goto out;
+		if (errno != EINVAL) {
+			err("failed to add filesystem mark "
+			    "to %s, error %d", pathname, errno);
+			return errno;
+		}
+		info("No pre-content events, recalling whole files");
+		recall_chunk_size = 0;
+	}
+	info("Set filesystem mark on '%s'", pathname);
+	ret = fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			    FAN_ACCESS_PERM, AT_FDCWD, pathname);
+	if (ret < 0) {
+		err("failed to add filesystem mark "
+		    "to %s, error %d", pathname, errno);
+		return errno;
+	}
+out:
+	monitor_fs = 1;
+	return 0;
+}
+
+/*
+ * Let the kernel allow accesses to the resident file @fd
+ * without asking us. The mark of the file itself, if any, is
+ * removed, and an ignore mark covers events from directory
+ * marks. Evictable ignore marks do not pin the inode; once
+ * one is evicted the next access is answered from the resident
+ * extents and the mark is set again.
+ */
+/* Cleared once the kernel turns out not to support evictable marks */
+static unsigned int ignore_evictable = FAN_MARK_EVICTABLE;
+
+int ignore_file(int fanotify_fd, int fd, char *filename)
+{
+	unsigned int evictable = ignore_evictable;
+	unsigned int mask = recall_chunk_size ? FAN_PRE_ACCESS :
+		FAN_ACCESS_PERM;
+	int ret;
+
+	ret = fanotify_mark(fanotify_fd, FAN_MARK_REMOVE, mask, fd, NULL);
+	if (ret < 0 && errno != ENOENT)
+		err("failed to remove fanotify mark "
+		    "from %s, error %d", filename, errno);
+retry:
+	ret = fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_IGNORED_MASK |
+			    FAN_MARK_IGNORED_SURV_MODIFY | evictable,
+			    mask, fd, NULL);
+	if (ret < 0 && errno == EINVAL && evictable) {
+		info("No evictable marks, pinning ignored files");
+		evictable = ignore_evictable = 0;
+		goto retry;
+	}
+	if (ret < 0) {
+		err("failed to add fanotify ignore mark "
+		    "to %s, error %d", filename, errno);
+		return errno;
+	}
+	dbg("Set fanotify ignore mark on '%s'", filename);
+	return 0;
+}
+
+/*
+ * Stop the filesystem mark from reporting accesses to the file
+ * at @fd, which is not migrated. Only evictable marks are used
+ * here, as pinning every file accessed would pin most of the
+ * filesystem in memory.
+ */
+void ignore_unmigrated(int fanotify_fd, int fd, dev_t dev, ino_t ino)
+{
+	unsigned int mask = recall_chunk_size ? FAN_PRE_ACCESS :
+		FAN_ACCESS_PERM;
+
+	if (!ignore_evictable)
+		return;
+	if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_IGNORED_MASK |
+			  FAN_MARK_IGNORED_SURV_MODIFY | FAN_MARK_EVICTABLE,
+			  mask, fd, NULL) < 0) {
+		if (errno == EINVAL)
+			ignore_evictable = 0;
+		return;
+	}
+	/* Migrated in the meantime, and monitor_file() has run already */
+	if (migrated_check(dev, ino))
+		fanotify_mark(fanotify_fd, FAN_MARK_REMOVE |
+			      FAN_MARK_IGNORED_MASK, mask, fd, NULL);
+}
+
 int unmonitor_file(int fanotify_fd, char *filename)
 {
 	int ret;
 
 	ret = fanotify_mark(fanotify_fd, FAN_MARK_REMOVE,
+			    recall_chunk_size ? FAN_PRE_ACCESS :
 			    FAN_ACCESS_PERM|FAN_EVENT_ON_CHILD,
 			    AT_FDCWD, filename);
 	if (ret < 0) {
 		err("failed to remove fanotify mark "
 		    "from %s, error %d", filename, errno);
 	}
+	if (removexattr(filename, MIGRATE_KEY_XATTR) < 0 &&
+	    errno != ENODATA)
+		warn("cannot remove backend key of '%s', error %d",
+		     filename, errno);
 	return ret;
 }
@@ -1,9 +1,32 @@
 #ifndef _MIGRATE_H
 #define _MIGRATE_H
 
+#define RECALL_CHUNK_SIZE (1024 * 1024)
+/* Name the stub was monitored with, which keys its backend file */
+#define MIGRATE_KEY_XATTR "user.trawler.key"
+
+extern unsigned long long recall_chunk_size;
+extern int monitor_fs;
+
 int migrate_file(struct backend *be, int src_fd, char *filename);
+int migrate_file_async(struct backend *be, int fe_fd, char *filename,
+		       void (*done) (void *arg, int error), void *arg);
 int unmigrate_file(struct backend *be, int fe_fd, char *filename);
+int unmigrate_file_async(struct backend *be, int fe_fd, char *filename,
+			 void (*done) (void *arg, int error), void *arg);
+int unmigrate_file_range(struct backend *be, int fe_fd, char *filename,
+			 unsigned long long offset, unsigned long long count);
+int unmigrate_file_range_async(struct backend *be, int fe_fd, char *filename,
+			       unsigned long long offset,
+			       unsigned long long count,
+			       void (*done) (void *arg, int error), void *arg);
+int unmigrate_file_fill(struct backend *be, int fe_fd, char *filename,
+			int *stop);
 int monitor_file(int fanotify_fd, char *filename);
+int monitor_filesystem(int fanotify_fd, char *pathname);
+int ignore_file(int fanotify_fd, int fd, char *filename);
+void ignore_unmigrated(int fanotify_fd, int fd, dev_t dev, ino_t ino);
 int unmonitor_file(int fanotify_fd, char *filename);
+int read_file_key(int fd, char *filename);
 
 #endif /* _MIGRATE_H */
@@ -0,0 +1,319 @@
+/*
+ * migrated.c
+ *
+ * Set of migrated files for filesystem-wide monitoring.
+ *
+ * With a filesystem mark every access on the filesystem is
+ * reported, and most of them are for files which have never
+ * been migrated. So each event is checked against this set of
+ * device and inode numbers first.
+ *
+ * The set is a cuckoo hash with four entries per bucket, so a
+ * lookup reads at most two cache lines. It is fronted by a Bloom
+ * filter with three bits per file, which answers most lookups
+ * for files not in the set from a single word each. The filter
+ * cannot drop single files, so it is rebuilt from the table once
+ * as many files have been removed as are left in it.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "logging.h"
+#include "migrated.h"
+
+#define LOG_AREA "migrated"
+
+#define MIGRATED_SLOTS 4
+#define MIGRATED_MIN_BUCKETS 1024
+#define MIGRATED_MAX_KICKS 256
+/* Bloom filter bits per table entry */
+#define MIGRATED_BLOOM_BITS 8
+
+struct migrated_entry {
+	unsigned long long dev;
+	unsigned long long ino;
+};
+
+struct migrated_bucket {
+	struct migrated_entry e[MIGRATED_SLOTS];
+};
+
+static struct migrated_bucket *migrated_table;
+static unsigned long migrated_mask;
+static unsigned long long *migrated_bloom;
+static unsigned long migrated_bloom_mask;
+static unsigned long migrated_num;
+static unsigned long migrated_removed;
+static int migrated_overflow;
+static unsigned long long migrated_lookups, migrated_filtered;
+static pthread_rwlock_t migrated_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned long long migrated_hashfn(unsigned long long dev,
+					  unsigned long long ino)
+{
+	unsigned long long h = ino ^ (dev * 0x9e3779b97f4a7c15ULL);
+
+	/* splitmix64 finalizer */
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static unsigned long migrated_alt(unsigned long long h, unsigned long b)
+{
+	/* The other bucket of an entry in bucket @b */
+	unsigned long b1 = h & migrated_mask;
+	unsigned long b2 = (h >> 32) & migrated_mask;
+
+	if (b2 == b1)
+		b2 = b1 ^ 1;
+	return b == b1 ? b2 : b1;
+}
+
+static void bloom_set(unsigned long long h)
+{
+	int i;
+
+	for (i = 0; i < 3; i++, h >>= 21)
+		migrated_bloom[(h & migrated_bloom_mask) >> 6] |=
+			1ULL << (h & 63);
+}
+
+static int bloom_test(unsigned long long h)
+{
+	int i;
+
+	for (i = 0; i < 3; i++, h >>= 21) {
+		if (!(migrated_bloom[(h & migrated_bloom_mask) >> 6] &
+		      (1ULL << (h & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+static int migrated_empty(struct migrated_entry *e)
+{
+	return !e->dev && !e->ino;
+}
+
+static struct migrated_entry *__migrated_lookup(unsigned long long dev,
+						unsigned long long ino,
+						unsigned long long h)
+{
+	struct migrated_bucket *bkt;
+	unsigned long b = h & migrated_mask;
+	int i, n;
+
+	for (n = 0; n < 2; n++) {
+		bkt = &migrated_table[b];
+		for (i = 0; i < MIGRATED_SLOTS; i++) {
+			if (bkt->e[i].ino == ino && bkt->e[i].dev == dev)
+				return &bkt->e[i];
+		}
+		b = migrated_alt(h, b);
+	}
+	return NULL;
+}
+
+/*
+ * Place @ent in one of its buckets, moving other entries to
+ * their alternate bucket if both are full. On failure @ent
+ * holds the entry which is left without a slot.
+ */
+static int __migrated_place(struct migrated_entry *ent)
+{
+	struct migrated_entry tmp;
+	unsigned long long h;
+	unsigned long b;
+	int i, n, kick = 0;
+
+	h = migrated_hashfn(ent->dev, ent->ino);
+	b = h & migrated_mask;
+	for (n = 0; n < MIGRATED_MAX_KICKS; n++) {
+		for (i = 0; i < MIGRATED_SLOTS; i++) {
+			if (migrated_empty(&migrated_table[b].e[i])) {
+				migrated_table[b].e[i] = *ent;
+				return 0;
+			}
+		}
+		if (!n) {
+			b = migrated_alt(h, b);
+			continue;
+		}
+		/* Evict a different slot each time to avoid cycles */
+		tmp = migrated_table[b].e[kick];
+		migrated_table[b].e[kick] = *ent;
+		*ent = tmp;
+		kick = (kick + 1) % MIGRATED_SLOTS;
+		h = migrated_hashfn(ent->dev, ent->ino);
+		b = migrated_alt(h, b);
+	}
+	return ENOSPC;
+}
+
+static void migrated_rebuild_bloom(void)
+{
+	unsigned long b;
+	int i;
+
+	memset(migrated_bloom, 0, (migrated_bloom_mask + 1) / 8);
+	for (b = 0; b <= migrated_mask; b++) {
+		for (i = 0; i < MIGRATED_SLOTS; i++) {
+			struct migrated_entry *e = &migrated_table[b].e[i];
+
+			if (!migrated_empty(e))
+				bloom_set(migrated_hashfn(e->dev, e->ino));
+		}
+	}
+	migrated_removed = 0;
+}
+
+/* Resize the table to @buckets buckets and place all entries again */
+static int migrated_resize(unsigned long buckets)
+{
+	struct migrated_bucket *old = migrated_table, *table;
+	unsigned long long *bloom;
+	unsigned long old_buckets = old ? migrated_mask + 1 : 0, b;
+	unsigned long bits = buckets * MIGRATED_SLOTS * MIGRATED_BLOOM_BITS;
+	struct migrated_entry ent;
+	int i;
+
+	table = calloc(buckets, sizeof(struct migrated_bucket));
+	bloom = calloc(bits / 64, sizeof(unsigned long long));
+	if (!table || !bloom) {
+		free(table);
+		free(bloom);
+		return ENOMEM;
+	}
+	migrated_table = table;
+	migrated_mask = buckets - 1;
+	for (b = 0; b < old_buckets; b++) {
+		for (i = 0; i < MIGRATED_SLOTS; i++) {
+			ent = old[b].e[i];
+			if (migrated_empty(&ent))
+				continue;
+			if (__migrated_place(&ent)) {
+				/* Too many collisions, grow further */
+				free(table);
+				free(bloom);
+				migrated_table = old;
+				migrated_mask = old_buckets - 1;
+				return migrated_resize(buckets * 2);
+			}
+		}
+	}
+	free(old);
+	free(migrated_bloom);
+	migrated_bloom = bloom;
+	migrated_bloom_mask = bits - 1;
+	migrated_rebuild_bloom();
+	dbg("resized to %lu buckets", buckets);
+	return 0;
+}
+
+/* Add the file to the set of migrated files */
+int migrated_add(dev_t dev, ino_t ino)
+{
+	struct migrated_entry ent = { dev, ino };
+	unsigned long long h = migrated_hashfn(dev, ino);
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&migrated_lock);
+	if (!migrated_table) {
+		ret = migrated_resize(MIGRATED_MIN_BUCKETS);
+		if (ret)
+			goto out_unlock;
+	}
+	if (__migrated_lookup(dev, ino, h))
+		goto out_unlock;
+	/* Keep the table at most 90% full */
+	if ((migrated_num + 1) * 10 >
+	    (migrated_mask + 1) * MIGRATED_SLOTS * 9) {
+		ret = migrated_resize((migrated_mask + 1) * 2);
+		if (ret)
+			goto out_unlock;
+	}
+	/*
+	 * A failed placement leaves another entry in @ent, which
+	 * is not in the filter any more once the table is resized.
+	 */
+	for (;;) {
+		bloom_set(migrated_hashfn(ent.dev, ent.ino));
+		if (!__migrated_place(&ent))
+			break;
+		ret = migrated_resize((migrated_mask + 1) * 2);
+		if (ret) {
+			/* @ent is lost, so no file can be skipped anymore */
+			err("cannot grow migrated set, error %d, "
+			    "checking all files", ret);
+			migrated_overflow = 1;
+			goto out_unlock;
+		}
+	}
+	migrated_num++;
+out_unlock:
+	pthread_rwlock_unlock(&migrated_lock);
+	return ret;
+}
+
+/* Remove the file, once all of it is resident again */
+void migrated_del(dev_t dev, ino_t ino)
+{
+	struct migrated_entry *e;
+
+	pthread_rwlock_wrlock(&migrated_lock);
+	if (!migrated_table)
+		goto out_unlock;
+	e = __migrated_lookup(dev, ino, migrated_hashfn(dev, ino));
+	if (!e)
+		goto out_unlock;
+	memset(e, 0, sizeof(struct migrated_entry));
+	migrated_num--;
+	if (++migrated_removed > migrated_num)
+		migrated_rebuild_bloom();
+out_unlock:
+	pthread_rwlock_unlock(&migrated_lock);
+}
+
+/* Check whether the file is in the set of migrated files */
+int migrated_check(dev_t dev, ino_t ino)
+{
+	unsigned long long h = migrated_hashfn(dev, ino);
+	int ret = 0;
+
+	__atomic_fetch_add(&migrated_lookups, 1, __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&migrated_lock);
+	if (migrated_overflow)
+		ret = 1;
+	else if (!migrated_table || !bloom_test(h))
+		__atomic_fetch_add(&migrated_filtered, 1, __ATOMIC_RELAXED);
+	else if (__migrated_lookup(dev, ino, h))
+		ret = 1;
+	pthread_rwlock_unlock(&migrated_lock);
+	return ret;
+}
+
+/* Log and reset the lookup statistics */
+void migrated_report(void)
+{
+	unsigned long long lookups, filtered;
+	unsigned long num, buckets;
+
+	lookups = __atomic_exchange_n(&migrated_lookups, 0, __ATOMIC_RELAXED);
+	filtered = __atomic_exchange_n(&migrated_filtered, 0,
+				       __ATOMIC_RELAXED);
+	if (!lookups)
+		return;
+	pthread_rwlock_rdlock(&migrated_lock);
+	num = migrated_num;
+	buckets = migrated_table ? migrated_mask + 1 : 0;
+	pthread_rwlock_unlock(&migrated_lock);
+	info("%llu lookups, %llu filtered, %lu files in %lu buckets",
+	     lookups, filtered, num, buckets);
+}
@@ -0,0 +1,9 @@
+#ifndef _MIGRATED_H
+#define _MIGRATED_H
+
+int migrated_add(dev_t dev, ino_t ino);
+void migrated_del(dev_t dev, ino_t ino);
+int migrated_check(dev_t dev, ino_t ino);
+void migrated_report(void);
+
+#endif /* _MIGRATED_H */
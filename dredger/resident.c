@@ -0,0 +1,224 @@
+/*
+ * resident.c
+ *
+ * Resident extents of partially recalled files.
+ *
+ * With range recall only the parts of a file which are accessed
+ * are copied back from the backend. For each such file a sorted
+ * list of non-overlapping extents records which byte ranges are
+ * resident already. The list is kept until the file is migrated
+ * again.
+ *
+ * Chunks are copied with the file's stripe lock held, so that a
+ * chunk is never copied twice; otherwise a late copy might
+ * overwrite data written after the first one completed. The
+ * stripe lock is not owned by a thread, so a recall running on
+ * the I/O engine releases it from its completion.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "logging.h"
+#include "resident.h"
+
+#define LOG_AREA "resident"
+
+#define RESIDENT_HASH_SIZE 1024
+#define RESIDENT_STRIPES 64
+
+struct resident_extent {
+	unsigned long long start;
+	unsigned long long end;
+};
+
+struct resident_file {
+	struct resident_file *next;
+	dev_t dev;
+	ino_t ino;
+	int num;
+	int size;
+	int done;
+	struct resident_extent *ext;
+};
+
+static struct resident_file *resident_hash[RESIDENT_HASH_SIZE];
+static pthread_mutex_t resident_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char resident_stripe[RESIDENT_STRIPES];
+static pthread_cond_t resident_stripe_free = PTHREAD_COND_INITIALIZER;
+
+static unsigned int resident_hashfn(dev_t dev, ino_t ino)
+{
+	unsigned long long key = ino ^ ((unsigned long long)dev << 32);
+
+	return (key * 0x9e3779b97f4a7c15ULL >> 32) % RESIDENT_HASH_SIZE;
+}
+
+static struct resident_file *resident_lookup(dev_t dev, ino_t ino)
+{
+	struct resident_file *rf;
+
+	rf = resident_hash[resident_hashfn(dev, ino)];
+	while (rf && (rf->dev != dev || rf->ino != ino))
+		rf = rf->next;
+	return rf;
+}
+
+/*
+ * Check whether [@start,@end) of the file is resident.
+ * An empty range is always resident.
+ */
+int resident_check(dev_t dev, ino_t ino,
+		   unsigned long long start, unsigned long long end)
+{
+	struct resident_file *rf;
+	int i, ret = 0;
+
+	if (start >= end)
+		return 1;
+	pthread_mutex_lock(&resident_lock);
+	rf = resident_lookup(dev, ino);
+	for (i = 0; rf && i < rf->num; i++) {
+		if (rf->ext[i].start > start)
+			break;
+		if (rf->ext[i].end >= end) {
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&resident_lock);
+	return ret;
+}
+
+/*
+ * Record [@start,@end) of the file as resident, merging it
+ * with the adjacent extents.
+ */
+int resident_add(dev_t dev, ino_t ino,
+		 unsigned long long start, unsigned long long end)
+{
+	struct resident_file *rf;
+	struct resident_extent *ext;
+	unsigned int h;
+	int i, j;
+
+	if (start >= end)
+		return 0;
+	pthread_mutex_lock(&resident_lock);
+	rf = resident_lookup(dev, ino);
+	if (!rf) {
+		rf = malloc(sizeof(struct resident_file));
+		if (!rf) {
+			pthread_mutex_unlock(&resident_lock);
+			return ENOMEM;
+		}
+		memset(rf, 0, sizeof(struct resident_file));
+		rf->dev = dev;
+		rf->ino = ino;
+		h = resident_hashfn(dev, ino);
+		rf->next = resident_hash[h];
+		resident_hash[h] = rf;
+	}
+	if (rf->num == rf->size) {
+		ext = realloc(rf->ext, (rf->size ? rf->size * 2 : 4) *
+			      sizeof(struct resident_extent));
+		if (!ext) {
+			pthread_mutex_unlock(&resident_lock);
+			return ENOMEM;
+		}
+		rf->ext = ext;
+		rf->size = rf->size ? rf->size * 2 : 4;
+	}
+	/* Find the first extent touching or following the new one */
+	for (i = 0; i < rf->num; i++) {
+		if (rf->ext[i].end >= start)
+			break;
+	}
+	/* And the first one following it without touching */
+	for (j = i; j < rf->num; j++) {
+		if (rf->ext[j].start > end)
+			break;
+	}
+	if (i < j) {
+		if (rf->ext[i].start < start)
+			start = rf->ext[i].start;
+		if (rf->ext[j - 1].end > end)
+			end = rf->ext[j - 1].end;
+	}
+	memmove(&rf->ext[i + 1], &rf->ext[j],
+		(rf->num - j) * sizeof(struct resident_extent));
+	rf->ext[i].start = start;
+	rf->ext[i].end = end;
+	rf->num += 1 - (j - i);
+	dbg("%lx:%lu: %d resident extents", (unsigned long)dev,
+	    (unsigned long)ino, rf->num);
+	pthread_mutex_unlock(&resident_lock);
+	return 0;
+}
+
+/*
+ * Check whether the whole file is resident now. Returns 1
+ * only for the first caller, so that exactly one of them
+ * finishes the recall.
+ */
+int resident_done(dev_t dev, ino_t ino, unsigned long long size)
+{
+	struct resident_file *rf;
+	int ret = 0;
+
+	pthread_mutex_lock(&resident_lock);
+	rf = resident_lookup(dev, ino);
+	if (rf && !rf->done && rf->num == 1 &&
+	    rf->ext[0].start == 0 && rf->ext[0].end >= size) {
+		rf->done = 1;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&resident_lock);
+	return ret;
+}
+
+/* Serialize copying chunks of the file */
+void resident_lock_file(dev_t dev, ino_t ino)
+{
+	unsigned int s = resident_hashfn(dev, ino) % RESIDENT_STRIPES;
+
+	pthread_mutex_lock(&resident_lock);
+	while (resident_stripe[s])
+		pthread_cond_wait(&resident_stripe_free, &resident_lock);
+	resident_stripe[s] = 1;
+	pthread_mutex_unlock(&resident_lock);
+}
+
+void resident_unlock_file(dev_t dev, ino_t ino)
+{
+	unsigned int s = resident_hashfn(dev, ino) % RESIDENT_STRIPES;
+
+	pthread_mutex_lock(&resident_lock);
+	resident_stripe[s] = 0;
+	pthread_cond_broadcast(&resident_stripe_free);
+	pthread_mutex_unlock(&resident_lock);
+}
+
+/* Drop the resident extents of the file */
+void resident_forget(dev_t dev, ino_t ino)
+{
+	struct resident_file **pp, *rf;
+
+	pthread_mutex_lock(&resident_lock);
+	pp = &resident_hash[resident_hashfn(dev, ino)];
+	while ((rf = *pp)) {
+		if (rf->dev == dev && rf->ino == ino) {
+			*pp = rf->next;
+			free(rf->ext);
+			free(rf);
+			break;
+		}
+		pp = &rf->next;
+	}
+	pthread_mutex_unlock(&resident_lock);
+}
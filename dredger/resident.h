@@ -0,0 +1,13 @@
+#ifndef _RESIDENT_H
+#define _RESIDENT_H
+
+int resident_check(dev_t dev, ino_t ino,
+		   unsigned long long start, unsigned long long end);
+int resident_add(dev_t dev, ino_t ino,
+		 unsigned long long start, unsigned long long end);
+int resident_done(dev_t dev, ino_t ino, unsigned long long size);
+void resident_lock_file(dev_t dev, ino_t ino);
+void resident_unlock_file(dev_t dev, ino_t ino);
+void resident_forget(dev_t dev, ino_t ino);
+
+#endif /* _RESIDENT_H */
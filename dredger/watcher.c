@@ -13,8 +13,12 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <sys/sendfile.h>
 #include <sys/syslog.h>
 #include <stdarg.h>
@@ -24,16 +28,94 @@
 #include "dredger.h"
 #include "backend.h"
 #include "migrate.h"
+#include "resident.h"
+#include "fhcache.h"
+#include "migrated.h"
+#include "iosched.h"
+#include "ioengine.h"
+#include "watcher.h"
 
 #define LOG_AREA "watcher"
 
+/*
+ * Permission events are handled by a fixed number of worker
+ * threads. Events come from a preallocated pool; the reader
+ * waits for a free event once all of them are queued or in
+ * progress, which in turn makes the kernel hold back further
+ * accesses. So the number of threads and the memory used are
+ * bounded no matter how many files are accessed at once.
+ */
+#define WATCHER_WORKERS 4
+#define WATCHER_QUEUE_SIZE 256
+#define WATCHER_STATS_INTERVAL 5
+
+/*
+ * Events are read from fanotify in batches, and the responses
+ * are collected and written with a single writev(). fanotify
+ * handles one response per write, but writev() on it loops over
+ * the iovecs, so a batch still costs only one system call.
+ */
+#define WATCHER_BUF_SIZE 65536
+
+/* Latency histogram, 8 buckets per power of two microseconds */
+#define RECALL_SUB_BITS 3
+#define RECALL_BUCKETS (40 << RECALL_SUB_BITS)
+
+int watcher_workers = WATCHER_WORKERS;
+int watcher_queue_size = WATCHER_QUEUE_SIZE;
+int watcher_fill;
+int watcher_ignore = 1;
+
+struct watcher_context;
+
 struct migrate_event {
-	pthread_t thr;
-	struct backend *be;
+	struct watcher_context *ctx;
 	int fanotify_fd;
 	char pathname[FILENAME_MAX];
 	int error;
+	struct timespec start;
 	struct fanotify_event_metadata fa;
+	struct fanotify_response resp;
+	/* Range accessed for pre-content events, or 0 */
+	unsigned long long offset;
+	unsigned long long count;
+	/* File being recalled, and the events waiting for it */
+	dev_t dev;
+	ino_t ino;
+	unsigned long long size;
+	struct fh_key key;
+	struct migrate_event *hash_next;
+	struct list_head waiters;
+	struct list_head wait_list;
+};
+
+/* A partially recalled file to be completed in the background */
+struct fill_job {
+	struct list_head list;
+	int fd;
+	int fanotify_fd;
+	dev_t dev;
+	ino_t ino;
+	unsigned long long size;
+	char pathname[FILENAME_MAX];
+};
+
+struct watcher_worker {
+	pthread_t thr;
+	struct watcher_context *ctx;
+	struct backend *be;
+};
+
+struct recall_stats {
+	unsigned long long hist[RECALL_BUCKETS];
+	unsigned long long num;
+	unsigned long long max;
+	unsigned long long recalls;
+	unsigned long long reads;
+	unsigned long long writes;
+	unsigned long long ignored;
+	struct timespec start;
+	double cpu;
 };
 
 struct watcher_context {
@@ -41,6 +123,44 @@ struct watcher_context {
 	int fanotify_fd;
 	struct backend *be;
 	struct migrate_event *event;
+	struct migrate_event *events;
+	struct migrate_event **free_events;
+	int num_free;
+	/* Queue of events waiting for a worker */
+	struct migrate_event **queue;
+	int queue_size;
+	int head;
+	int queued;
+	/* Recalls in progress, hashed by inode */
+	struct migrate_event **inflight;
+	unsigned int inflight_mask;
+	int stopped;
+	/* Events waiting for their response to be written */
+	struct migrate_event **resp;
+	struct migrate_event **resp_flush;
+	struct iovec *resp_iov;
+	int num_resp;
+	int flushing;
+	/* Read buffer, and the events in it not yet handled */
+	char *buf;
+	struct fanotify_event_metadata *buf_next;
+	int buf_len;
+	pthread_mutex_t lock;
+	pthread_cond_t event_avail;
+	pthread_cond_t event_free;
+	struct watcher_worker *workers;
+	int num_workers;
+	/* Background recall */
+	struct list_head fill_list;
+	struct fill_job *fill_cur;
+	pthread_cond_t fill_avail;
+	pthread_t fill_thr;
+	struct backend *fill_be;
+	int fill_stopped;
+	/* Recalls running on the I/O engine */
+	int num_async;
+	pthread_cond_t async_done;
+	struct recall_stats stats;
 };
 
 static int get_fname(int fd, char *fname)
@@ -59,83 +179,866 @@ static int get_fname(int fd, char *fname)
 	return len;
 }
 
-struct migrate_event *malloc_migrate_event(struct backend *be, int fd)
+static void reset_migrate_event(struct migrate_event *event)
+{
+	if (event->fa.fd >= 0) {
+		close(event->fa.fd);
+		event->fa.fd = -1;
+	}
+	memset(event->pathname, 0, sizeof(event->pathname));
+	event->error = 0;
+	event->offset = 0;
+	event->count = 0;
+	event->dev = 0;
+	event->ino = 0;
+	event->size = 0;
+	event->key.len = 0;
+}
+
+static unsigned int recall_bucket(unsigned long long usecs)
+{
+	unsigned int msb;
+
+	if (usecs < (1 << RECALL_SUB_BITS))
+		return usecs;
+	msb = 63 - __builtin_clzll(usecs);
+	if (msb >= 40)
+		return RECALL_BUCKETS - 1;
+	return ((msb - RECALL_SUB_BITS + 1) << RECALL_SUB_BITS) +
+		((usecs >> (msb - RECALL_SUB_BITS)) &
+		 ((1 << RECALL_SUB_BITS) - 1));
+}
+
+/* Return the lower bound of bucket @b in microseconds */
+static unsigned long long recall_bucket_usecs(unsigned int b)
+{
+	unsigned int msb, sub;
+
+	if (b < (1 << RECALL_SUB_BITS))
+		return b;
+	msb = (b >> RECALL_SUB_BITS) + RECALL_SUB_BITS - 1;
+	sub = b & ((1 << RECALL_SUB_BITS) - 1);
+	return ((1ULL << RECALL_SUB_BITS) + sub) << (msb - RECALL_SUB_BITS);
+}
+
+static unsigned long long recall_percentile(struct recall_stats *st,
+					    unsigned int pct)
+{
+	unsigned long long limit, sum = 0;
+	unsigned int b;
+
+	limit = (st->num * pct + 99) / 100;
+	for (b = 0; b < RECALL_BUCKETS; b++) {
+		sum += st->hist[b];
+		if (sum >= limit)
+			return recall_bucket_usecs(b);
+	}
+	return st->max;
+}
+
+/* CPU time used by the daemon in seconds */
+static double daemon_cpu(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/* Log and reset the recall statistics */
+static void recall_stats_report(struct watcher_context *ctx)
+{
+	struct recall_stats st;
+	struct timespec now;
+	double elapsed, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	cpu = daemon_cpu();
+	/* Log from a copy, as logging might be a cancellation point */
+	pthread_mutex_lock(&ctx->lock);
+	memcpy(&st, &ctx->stats, sizeof(struct recall_stats));
+	memset(&ctx->stats, 0, sizeof(struct recall_stats));
+	ctx->stats.start = now;
+	ctx->stats.cpu = cpu;
+	pthread_mutex_unlock(&ctx->lock);
+	sched_report();
+	fhcache_report();
+	migrated_report();
+	if (!st.num)
+		return;
+	elapsed = (now.tv_sec - st.start.tv_sec) +
+		(now.tv_nsec - st.start.tv_nsec) / 1e9;
+	info("Handled %llu events in %f seconds (%.1f events/sec), "
+	     "latency p50 %llu us, p99 %llu us, max %llu us, "
+	     "%llu recalls, %llu reads, %llu writes, %llu ignore marks, "
+	     "cpu %.3f s", st.num, elapsed,
+	     elapsed > 0 ? st.num / elapsed : 0,
+	     recall_percentile(&st, 50), recall_percentile(&st, 99),
+	     st.max, st.recalls, st.reads, st.writes, st.ignored,
+	     cpu - st.cpu);
+}
+
+static void recall_stats_add(struct recall_stats *st,
+			     struct migrate_event *event)
+{
+	struct timespec now;
+	unsigned long long usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = (now.tv_sec - event->start.tv_sec) * 1000000ULL +
+		(now.tv_nsec - event->start.tv_nsec) / 1000;
+	st->hist[recall_bucket(usecs)]++;
+	st->num++;
+	if (usecs > st->max)
+		st->max = usecs;
+}
+
+/*
+ * Queue the permission response for @event. The event fd has
+ * to stay open until the response is written, so the event is
+ * only returned to the pool by flush_responses().
+ */
+static void __respond_migrate_event(struct watcher_context *ctx,
+				    struct migrate_event *event)
+{
+	event->resp.fd = event->fa.fd;
+	event->resp.response = event->error ? FAN_DENY : FAN_ALLOW;
+	ctx->resp[ctx->num_resp++] = event;
+}
+
+static void respond_migrate_event(struct watcher_context *ctx,
+				  struct migrate_event *event)
+{
+	pthread_mutex_lock(&ctx->lock);
+	__respond_migrate_event(ctx, event);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Write the responses for @num events, returning the number
+ * of system calls needed. A failed response stops writev(),
+ * so it is skipped and the remaining ones are written again.
+ */
+static int write_responses(struct watcher_context *ctx,
+			   struct migrate_event **events, int num)
+{
+	struct iovec *iov = ctx->resp_iov;
+	int i, n, done = 0, writes = 0;
+	ssize_t ret;
+
+	for (i = 0; i < num; i++) {
+		iov[i].iov_base = &events[i]->resp;
+		iov[i].iov_len = sizeof(struct fanotify_response);
+	}
+	while (done < num) {
+		n = num - done;
+		if (n > IOV_MAX)
+			n = IOV_MAX;
+		ret = writev(ctx->fanotify_fd, iov + done, n);
+		writes++;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err("Failed to write fanotify response for fd %d, "
+			    "error %d", events[done]->resp.fd, errno);
+			done++;
+			continue;
+		}
+		n = ret / sizeof(struct fanotify_response);
+		dbg("Wrote %d of %d responses", n, num - done);
+		done += n ? n : 1;
+	}
+	return writes;
+}
+
+/*
+ * Write all queued responses and return the events to the pool.
+ * Only one thread writes at a time; responses queued meanwhile
+ * are picked up by that thread before it returns, so the others
+ * do not need to wait for it.
+ */
+static void flush_responses(struct watcher_context *ctx)
+{
+	struct migrate_event **events;
+	int i, num, writes, oldstate;
+
+	/* Events must not be lost half-way through */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->flushing)
+		goto out_unlock;
+	ctx->flushing = 1;
+	while (ctx->num_resp) {
+		events = ctx->resp;
+		num = ctx->num_resp;
+		ctx->resp = ctx->resp_flush;
+		ctx->resp_flush = events;
+		ctx->num_resp = 0;
+		pthread_mutex_unlock(&ctx->lock);
+
+		writes = write_responses(ctx, events, num);
+		for (i = 0; i < num; i++)
+			reset_migrate_event(events[i]);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->stats.writes += writes;
+		for (i = 0; i < num; i++) {
+			recall_stats_add(&ctx->stats, events[i]);
+			ctx->free_events[ctx->num_free++] = events[i];
+		}
+		pthread_cond_broadcast(&ctx->event_free);
+	}
+	ctx->flushing = 0;
+out_unlock:
+	pthread_mutex_unlock(&ctx->lock);
+	pthread_setcancelstate(oldstate, NULL);
+}
+
+static void unlock_context(void *arg)
+{
+	struct watcher_context *ctx = arg;
+
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/* Take an event from the pool, waiting for one to become free */
+static struct migrate_event *get_migrate_event(struct watcher_context *ctx)
 {
 	struct migrate_event *event;
 
-	event = malloc(sizeof(struct migrate_event));
-	if (!event) {
-		err("watcher: cannot allocate event, error %d\n", errno);
-		return NULL;
+	/* Free the events still waiting for their response */
+	if (!ctx->num_free)
+		flush_responses(ctx);
+	pthread_mutex_lock(&ctx->lock);
+	pthread_cleanup_push(unlock_context, ctx);
+	while (!ctx->num_free)
+		pthread_cond_wait(&ctx->event_free, &ctx->lock);
+	event = ctx->free_events[--ctx->num_free];
+	pthread_cleanup_pop(1);
+	return event;
+}
+
+static unsigned int inflight_hash(struct watcher_context *ctx,
+				  dev_t dev, ino_t ino)
+{
+	unsigned long long key = ino ^ ((unsigned long long)dev << 32);
+
+	return (key * 0x9e3779b97f4a7c15ULL >> 32) & ctx->inflight_mask;
+}
+
+/*
+ * Queue @event for the workers. If the same file is already
+ * being recalled, the event waits for that recall instead, so
+ * the data is copied only once however many readers arrive.
+ * The queue holds as many entries as there are events, so it
+ * never overflows. Called with ctx->lock held.
+ */
+static void __queue_migrate_event(struct watcher_context *ctx,
+				  struct migrate_event *event)
+{
+	struct migrate_event *recall = NULL;
+	unsigned int h = 0;
+
+	if (event->ino) {
+		h = inflight_hash(ctx, event->dev, event->ino);
+		for (recall = ctx->inflight[h]; recall;
+		     recall = recall->hash_next) {
+			if (recall->dev == event->dev &&
+			    recall->ino == event->ino)
+				break;
+		}
+	}
+	if (recall) {
+		dbg("%s: waiting for recall in progress", event->pathname);
+		list_add_tail(&event->wait_list, &recall->waiters);
+	} else {
+		if (event->ino) {
+			event->hash_next = ctx->inflight[h];
+			ctx->inflight[h] = event;
+		}
+		ctx->queue[(ctx->head + ctx->queued) % ctx->queue_size] =
+			event;
+		ctx->queued++;
+		pthread_cond_signal(&ctx->event_avail);
+	}
+}
+
+/*
+ * Check whether the range accessed by @event is resident,
+ * or the whole file if the event has no range.
+ */
+static int range_resident(struct migrate_event *event)
+{
+	unsigned long long end = event->offset + event->count;
+
+	if (!event->count || end > event->size)
+		end = event->size;
+	return resident_check(event->dev, event->ino, event->offset, end);
+}
+
+/*
+ * Stop receiving events for the file of @fd now that all of it
+ * is resident, returning 1 if an ignore mark has been set.
+ */
+static int release_file(int fanotify_fd, int fd, char *pathname,
+			dev_t dev, ino_t ino)
+{
+	if (monitor_fs)
+		migrated_del(dev, ino);
+	if (!watcher_ignore) {
+		if (!monitor_fs)
+			unmonitor_file(fanotify_fd, pathname);
+		return 0;
+	}
+	return ignore_file(fanotify_fd, fd, pathname) ? 0 : 1;
+}
+
+static void queue_migrate_event(struct watcher_context *ctx,
+				struct migrate_event *event)
+{
+	int ignored = 0;
+
+	/*
+	 * Most accesses to a partially recalled file hit resident
+	 * data. Accesses to a file which is resident altogether
+	 * only get here once its ignore mark has been evicted.
+	 */
+	if (event->ino && watcher_ignore &&
+	    resident_check(event->dev, event->ino, 0, event->size))
+		ignored = release_file(event->fanotify_fd, event->fa.fd,
+				       event->pathname, event->dev,
+				       event->ino);
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stats.ignored += ignored;
+	if (event->ino && range_resident(event))
+		__respond_migrate_event(ctx, event);
+	else
+		__queue_migrate_event(ctx, event);
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Queue the response for @event and for all events which
+ * arrived for the same file while it was being recalled.
+ * Events for a range which is still not resident are queued
+ * again to recall that range.
+ */
+static void complete_migrate_event(struct watcher_context *ctx,
+				   struct migrate_event *event)
+{
+	struct migrate_event **pp, *waiter, *tmp;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (event->ino) {
+		pp = &ctx->inflight[inflight_hash(ctx, event->dev,
+						  event->ino)];
+		while (*pp != event)
+			pp = &(*pp)->hash_next;
+		*pp = event->hash_next;
+		event->hash_next = NULL;
+	}
+	list_for_each_entry_safe(waiter, tmp, &event->waiters, wait_list) {
+		list_del_init(&waiter->wait_list);
+		if (waiter->count && !event->error &&
+		    !range_resident(waiter)) {
+			__queue_migrate_event(ctx, waiter);
+			continue;
+		}
+		waiter->error = event->error;
+		__respond_migrate_event(ctx, waiter);
+	}
+	__respond_migrate_event(ctx, event);
+	ctx->stats.recalls++;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static struct migrate_event *dequeue_migrate_event(struct watcher_context *ctx)
+{
+	struct migrate_event *event = NULL;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->queued && !ctx->stopped)
+		pthread_cond_wait(&ctx->event_avail, &ctx->lock);
+	/* Pending events are still handled when stopping */
+	if (ctx->queued) {
+		event = ctx->queue[ctx->head];
+		ctx->head = (ctx->head + 1) % ctx->queue_size;
+		ctx->queued--;
 	}
-	memset(event, 0, sizeof(struct migrate_event));
-	event->fanotify_fd = fd;
-	event->be = be;
+	pthread_mutex_unlock(&ctx->lock);
 	return event;
 }
 
-void cleanup_migrate_event(struct migrate_event *event)
+/*
+ * Schedule the rest of the file accessed by @event to be
+ * recalled in the background, unless it is already.
+ */
+static void queue_fill_job(struct watcher_context *ctx,
+			   struct migrate_event *event)
 {
-	if (event->fa.mask & FAN_ACCESS_PERM) {
-		struct fanotify_response resp;
+	struct fill_job *job;
+
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->fill_cur && ctx->fill_cur->dev == event->dev &&
+	    ctx->fill_cur->ino == event->ino)
+		goto out_unlock;
+	list_for_each_entry(job, &ctx->fill_list, list) {
+		if (job->dev == event->dev && job->ino == event->ino)
+			goto out_unlock;
+	}
+	job = malloc(sizeof(struct fill_job));
+	if (!job) {
+		err("%s: cannot allocate background recall",
+		    event->pathname);
+		goto out_unlock;
+	}
+	/* The event fd is closed once the event has been answered */
+	job->fd = dup(event->fa.fd);
+	if (job->fd < 0) {
+		err("%s: cannot duplicate fd, error %d",
+		    event->pathname, errno);
+		free(job);
+		goto out_unlock;
+	}
+	job->fanotify_fd = event->fanotify_fd;
+	job->dev = event->dev;
+	job->ino = event->ino;
+	job->size = event->size;
+	strcpy(job->pathname, event->pathname);
+	list_add_tail(&job->list, &ctx->fill_list);
+	pthread_cond_signal(&ctx->fill_avail);
+out_unlock:
+	pthread_mutex_unlock(&ctx->lock);
+}
 
-		resp.fd = event->fa.fd;
-		if (event->error)
-			resp.response = FAN_DENY;
-		else
-			resp.response = FAN_ALLOW;
-		if (write(event->fanotify_fd, &resp, sizeof(resp)) < 0) {
-			err("watcher: Failed to write fanotify "
-			    "response: error %d", errno);
-		} else {
-			dbg("watcher: Wrote response '%s'",
-			       (resp.response == FAN_ALLOW) ?
-			       "FAN_ALLOW" : "FAN_DENY");
+static void *fill_thread(void *arg)
+{
+	struct watcher_context *ctx = arg;
+	struct fill_job *job;
+	int ret, ignored;
+
+	pthread_mutex_lock(&ctx->lock);
+	while (!ctx->fill_stopped) {
+		if (list_empty(&ctx->fill_list)) {
+			pthread_cond_wait(&ctx->fill_avail, &ctx->lock);
+			continue;
+		}
+		job = list_first_entry(&ctx->fill_list, struct fill_job, list);
+		list_del_init(&job->list);
+		ctx->fill_cur = job;
+		pthread_mutex_unlock(&ctx->lock);
+
+		ret = unmigrate_file_fill(ctx->fill_be, job->fd, job->pathname,
+					  &ctx->fill_stopped);
+		ignored = 0;
+		if (!ret && resident_done(job->dev, job->ino, job->size)) {
+			info("%s: all data resident", job->pathname);
+			ignored = release_file(job->fanotify_fd, job->fd,
+					       job->pathname, job->dev,
+					       job->ino);
 		}
+		close(job->fd);
+		free(job);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->stats.ignored += ignored;
+		ctx->fill_cur = NULL;
 	}
-	if (event->fa.fd >= 0) {
-		close(event->fa.fd);
-		event->fa.fd = -1;
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+/* Answer @event once its recall is finished with @ret */
+static void finish_recall(struct watcher_context *ctx,
+			  struct migrate_event *event, int ret)
+{
+	int ignored = 0;
+
+	if (event->count) {
+		/* Stop watching once all data is resident */
+		if (!ret && event->ino &&
+		    resident_done(event->dev, event->ino, event->size)) {
+			info("%s: all data resident", event->pathname);
+			ignored = release_file(event->fanotify_fd,
+					       event->fa.fd, event->pathname,
+					       event->dev, event->ino);
+		} else if (!ret && event->ino && ctx->fill_be)
+			queue_fill_job(ctx, event);
+	} else if (!ret)
+		ignored = release_file(event->fanotify_fd, event->fa.fd,
+				       event->pathname, event->dev,
+				       event->ino);
+	if (ignored) {
+		pthread_mutex_lock(&ctx->lock);
+		ctx->stats.ignored++;
+		pthread_mutex_unlock(&ctx->lock);
 	}
-	memset(event->pathname, 0, sizeof(event->pathname));
-	event->error = 0;
+	/* Do not let the access see the holes of the stub */
+	event->error = ret;
+	complete_migrate_event(ctx, event);
+	flush_responses(ctx);
 }
 
-void cleanup_unmigrate_thread(void *arg)
+/* Called from the I/O engine once a recall is finished */
+static void recall_done(void *arg, int error)
 {
 	struct migrate_event *event = arg;
+	struct watcher_context *ctx = event->ctx;
 
-	event->thr = (pthread_t)0;
-	cleanup_migrate_event(event);
-	free(event);
+	finish_recall(ctx, event, error);
+	pthread_mutex_lock(&ctx->lock);
+	if (!--ctx->num_async)
+		pthread_cond_broadcast(&ctx->async_done);
+	pthread_mutex_unlock(&ctx->lock);
 }
 
 void * unmigrate_thread(void *arg)
 {
-	struct migrate_event *event = arg;
+	struct watcher_worker *worker = arg;
+	struct watcher_context *ctx = worker->ctx;
+	struct migrate_event *event;
 	int ret;
 
-	if (event->thr != (pthread_t)0)
-		pthread_cleanup_push(cleanup_unmigrate_thread, (void *)event);
-
-	ret = unmigrate_file(event->be, event->fa.fd, event->pathname);
-	if (!ret) {
-		ret = unmonitor_file(event->fanotify_fd, event->pathname);
+	while ((event = dequeue_migrate_event(ctx))) {
+		/*
+		 * Leave the copy to the I/O engine, so that the worker
+		 * can pick up the next event in the meantime.
+		 */
+		ret = EOPNOTSUPP;
+		if (ioengine_enabled()) {
+			pthread_mutex_lock(&ctx->lock);
+			ctx->num_async++;
+			pthread_mutex_unlock(&ctx->lock);
+			if (event->count)
+				ret = unmigrate_file_range_async(worker->be,
+								 event->fa.fd,
+								 event->pathname,
+								 event->offset,
+								 event->count,
+								 recall_done,
+								 event);
+			else
+				ret = unmigrate_file_async(worker->be,
+							   event->fa.fd,
+							   event->pathname,
+							   recall_done, event);
+			if (ret == EINPROGRESS)
+				continue;
+			pthread_mutex_lock(&ctx->lock);
+			if (!--ctx->num_async)
+				pthread_cond_broadcast(&ctx->async_done);
+			pthread_mutex_unlock(&ctx->lock);
+		}
+		if (ret == EOPNOTSUPP && event->count)
+			ret = unmigrate_file_range(worker->be, event->fa.fd,
+						   event->pathname,
+						   event->offset,
+						   event->count);
+		else if (ret == EOPNOTSUPP)
+			ret = unmigrate_file(worker->be, event->fa.fd,
+					     event->pathname);
+		finish_recall(ctx, event, ret);
 	}
-	pthread_cleanup_pop(1);
 	return NULL;
 }
 
+static void stop_workers(struct watcher_context *ctx)
+{
+	int i;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stopped = 1;
+	pthread_cond_broadcast(&ctx->event_avail);
+	pthread_mutex_unlock(&ctx->lock);
+	for (i = 0; i < ctx->num_workers; i++) {
+		pthread_join(ctx->workers[i].thr, NULL);
+		free_backend(ctx->workers[i].be);
+	}
+	ctx->num_workers = 0;
+
+	/* The engine still answers the events of running recalls */
+	pthread_mutex_lock(&ctx->lock);
+	while (ctx->num_async)
+		pthread_cond_wait(&ctx->async_done, &ctx->lock);
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!ctx->fill_be)
+		return;
+	/* Files not completed yet stay partially recalled */
+	pthread_mutex_lock(&ctx->lock);
+	__atomic_store_n(&ctx->fill_stopped, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&ctx->fill_avail);
+	pthread_mutex_unlock(&ctx->lock);
+	pthread_join(ctx->fill_thr, NULL);
+	while (!list_empty(&ctx->fill_list)) {
+		struct fill_job *job;
+
+		job = list_first_entry(&ctx->fill_list, struct fill_job, list);
+		list_del(&job->list);
+		close(job->fd);
+		free(job);
+	}
+	free_backend(ctx->fill_be);
+	ctx->fill_be = NULL;
+}
+
+static int start_workers(struct watcher_context *ctx, int num)
+{
+	struct watcher_worker *worker;
+	int ret;
+
+	ctx->workers = malloc(num * sizeof(struct watcher_worker));
+	if (!ctx->workers)
+		return ENOMEM;
+	if (watcher_fill) {
+		ctx->fill_be = clone_backend(ctx->be);
+		if (!ctx->fill_be) {
+			err("Failed to allocate backend for background recall");
+			return ENOMEM;
+		}
+		ret = pthread_create(&ctx->fill_thr, NULL, fill_thread, ctx);
+		if (ret) {
+			err("Failed to start background recall, error %d",
+			    ret);
+			free_backend(ctx->fill_be);
+			ctx->fill_be = NULL;
+			return ret;
+		}
+	}
+	for (ctx->num_workers = 0; ctx->num_workers < num;
+	     ctx->num_workers++) {
+		worker = &ctx->workers[ctx->num_workers];
+		worker->ctx = ctx;
+		/* Each worker needs its own backend state */
+		worker->be = clone_backend(ctx->be);
+		if (!worker->be) {
+			err("Failed to allocate backend for worker %d",
+			    ctx->num_workers);
+			ret = ENOMEM;
+			goto out_stop;
+		}
+		ret = pthread_create(&worker->thr, NULL,
+				     unmigrate_thread, worker);
+		if (ret) {
+			err("Failed to start worker %d, error %d",
+			    ctx->num_workers, ret);
+			free_backend(worker->be);
+			goto out_stop;
+		}
+	}
+	return 0;
+out_stop:
+	stop_workers(ctx);
+	return ret;
+}
+
+static void free_context(struct watcher_context *ctx)
+{
+	free(ctx->inflight);
+	free(ctx->buf);
+	free(ctx->resp_iov);
+	free(ctx->resp_flush);
+	free(ctx->resp);
+	free(ctx->workers);
+	free(ctx->queue);
+	free(ctx->free_events);
+	free(ctx->events);
+	free(ctx);
+}
+
+/* Allow access for @fa without going through the event pool */
+static void allow_fanotify_event(struct watcher_context *ctx,
+				 struct fanotify_event_metadata *fa)
+{
+	struct fanotify_response resp;
+
+	resp.fd = fa->fd;
+	resp.response = FAN_ALLOW;
+	if (write(ctx->fanotify_fd, &resp, sizeof(resp)) < 0)
+		err("Failed to write fanotify response: error %d", errno);
+	close(fa->fd);
+}
+
+/* Allow access for the events left in the read buffer */
+static void allow_buffered_events(struct watcher_context *ctx)
+{
+	struct fanotify_event_metadata *fa = ctx->buf_next;
+
+	while (fa && FAN_EVENT_OK(fa, ctx->buf_len)) {
+		if (fa->fd >= 0) {
+			if (fa->mask & (FAN_ACCESS_PERM|FAN_PRE_ACCESS))
+				allow_fanotify_event(ctx, fa);
+			else
+				close(fa->fd);
+		}
+		fa = FAN_EVENT_NEXT(fa, ctx->buf_len);
+	}
+	ctx->buf_next = NULL;
+}
+
 void cleanup_context(void * arg)
 {
 	struct watcher_context *ctx = arg;
 
 	if (ctx->event) {
-		cleanup_migrate_event(ctx->event);
-		free(ctx->event);
+		respond_migrate_event(ctx, ctx->event);
 		ctx->event = NULL;
 	}
-	free(ctx);
+	allow_buffered_events(ctx);
+	stop_workers(ctx);
+	flush_responses(ctx);
+	recall_stats_report(ctx);
+	free_context(ctx);
+}
+
+/*
+ * Pick the accessed range and the file handle from the
+ * information records of the event. Without a range the whole
+ * file is recalled.
+ */
+static void get_event_info(struct fanotify_event_metadata *fa,
+			   struct migrate_event *event)
+{
+	struct fanotify_event_info_header *hdr;
+	struct fanotify_event_info_range *range;
+	struct fanotify_event_info_fid *fid;
+	struct file_handle *fh;
+	char *p = (char *)fa + fa->metadata_len;
+	char *end = (char *)fa + fa->event_len;
+
+	while (p + sizeof(struct fanotify_event_info_header) <= end) {
+		hdr = (struct fanotify_event_info_header *)p;
+		if (hdr->len < sizeof(struct fanotify_event_info_header) ||
+		    p + hdr->len > end)
+			break;
+		if (hdr->info_type == FAN_EVENT_INFO_TYPE_RANGE &&
+		    (fa->mask & FAN_PRE_ACCESS) &&
+		    hdr->len >= sizeof(struct fanotify_event_info_range)) {
+			range = (struct fanotify_event_info_range *)p;
+			event->offset = range->offset;
+			event->count = range->count;
+		} else if (hdr->info_type == FAN_EVENT_INFO_TYPE_FID &&
+			   hdr->len >= sizeof(struct fanotify_event_info_fid) +
+			   sizeof(struct file_handle)) {
+			fid = (struct fanotify_event_info_fid *)p;
+			fh = (struct file_handle *)fid->handle;
+			if (fh->handle_bytes <= MAX_HANDLE_SZ &&
+			    sizeof(struct fanotify_event_info_fid) +
+			    sizeof(struct file_handle) +
+			    fh->handle_bytes <= hdr->len) {
+				memset(&event->key, 0, sizeof(struct fh_key));
+				memcpy(&event->key.fsid, &fid->fsid,
+				       sizeof(event->key.fsid));
+				event->key.type = fh->handle_type;
+				event->key.len = fh->handle_bytes;
+				memcpy(event->key.handle, fh->f_handle,
+				       fh->handle_bytes);
+			}
+		}
+		p += hdr->len;
+	}
+}
+
+static void get_event_stat(struct migrate_event *event)
+{
+	struct stat st;
+
+	if (fstat(event->fa.fd, &st) == 0) {
+		event->dev = st.st_dev;
+		event->ino = st.st_ino;
+		event->size = st.st_size;
+	}
+}
+
+/*
+ * Find the backend key of the file accessed by @event. The
+ * event fd is resolved only for files not in the handle cache.
+ */
+static int get_event_name(struct migrate_event *event)
+{
+	int len;
+
+	if (!event->key.len && event->ino)
+		fh_key_ino(&event->key, event->dev, event->ino);
+	if (event->key.len &&
+	    !fhcache_lookup(&event->key, event->pathname))
+		return strlen(event->pathname);
+	/* Evicted, or monitored before a restart */
+	len = read_file_key(event->fa.fd, event->pathname);
+	if (len < 0)
+		len = get_fname(event->fa.fd, event->pathname);
+	if (len > 0 && event->key.len)
+		fhcache_insert(&event->key, event->pathname);
+	return len;
+}
+
+/*
+ * Handle the next event in the read buffer. The event is taken
+ * off the buffer only once it is owned by a migrate event, so
+ * the cleanup handler answers each event exactly once.
+ */
+static void handle_fanotify_event(struct watcher_context *ctx, int num)
+{
+	struct fanotify_event_metadata *fa = ctx->buf_next;
+	struct migrate_event *event;
+	struct stat st;
+
+	if (fa->fd < 0 || !(fa->mask & (FAN_ACCESS_PERM|FAN_PRE_ACCESS))) {
+		if (fa->mask & FAN_Q_OVERFLOW)
+			err("fanotify event queue overflow");
+		if (fa->fd >= 0)
+			close(fa->fd);
+		ctx->buf_next = FAN_EVENT_NEXT(fa, ctx->buf_len);
+		return;
+	}
+	if (fa->pid == getpid()) {
+		/*
+		 * Our own accesses during a recall. The worker doing
+		 * the recall is waiting for this, so answer right away
+		 * instead of waiting for a free event.
+		 */
+		dbg("fanotify event %d: identical PID, allowing access", num);
+		allow_fanotify_event(ctx, fa);
+		ctx->buf_next = FAN_EVENT_NEXT(fa, ctx->buf_len);
+		return;
+	}
+	/*
+	 * With a filesystem mark most files are not migrated at all;
+	 * answer those without waiting for a free event, and have
+	 * further accesses not reported.
+	 */
+	if (monitor_fs && fstat(fa->fd, &st) == 0 &&
+	    !migrated_check(st.st_dev, st.st_ino)) {
+		if (watcher_ignore)
+			ignore_unmigrated(ctx->fanotify_fd, fa->fd,
+					  st.st_dev, st.st_ino);
+		allow_fanotify_event(ctx, fa);
+		ctx->buf_next = FAN_EVENT_NEXT(fa, ctx->buf_len);
+		return;
+	}
+	event = get_migrate_event(ctx);
+	ctx->event = event;
+	memcpy(&event->fa, fa, sizeof(struct fanotify_event_metadata));
+	get_event_info(fa, event);
+	event->fanotify_fd = ctx->fanotify_fd;
+	clock_gettime(CLOCK_MONOTONIC, &event->start);
+	ctx->buf_next = FAN_EVENT_NEXT(fa, ctx->buf_len);
+	get_event_stat(event);
+
+	if (get_event_name(event) < 0) {
+		err("cannot retrieve filename, allow access");
+		ctx->event = NULL;
+		respond_migrate_event(ctx, event);
+		return;
+	}
+
+	dbg("fanotify event %d: mask 0x%02lX, fd %d (%s), pid %d",
+	    num, (unsigned long) event->fa.mask, event->fa.fd,
+	    event->pathname, event->fa.pid);
+	ctx->event = NULL;
+	queue_migrate_event(ctx, event);
 }
 
 void * watch_fanotify(void * arg)
@@ -144,17 +1047,15 @@ void * watch_fanotify(void * arg)
 	fd_set rfd;
 	struct timeval tmo;
 	int i = 0;
-	struct migrate_event *event;
 
 	pthread_cleanup_push(cleanup_context, ctx);
-	ctx->event = malloc_migrate_event(ctx->be, ctx->fanotify_fd);
 
 	while (!daemon_stopped) {
 		int rlen, ret;
 
 		FD_ZERO(&rfd);
 		FD_SET(ctx->fanotify_fd, &rfd);
-		tmo.tv_sec = 5;
+		tmo.tv_sec = WATCHER_STATS_INTERVAL;
 		tmo.tv_usec = 0;
 		ret = select(ctx->fanotify_fd + 1, &rfd, NULL, NULL, &tmo);
 		if (ret < 0) {
@@ -165,51 +1066,28 @@ void * watch_fanotify(void * arg)
 		}
 		if (ret == 0) {
 			dbg("watcher: select timeout");
+			recall_stats_report(ctx);
 			continue;
 		}
 		if (!FD_ISSET(ctx->fanotify_fd, &rfd)) {
 			err("select returned for invalid fd");
 			continue;
 		}
-		event = ctx->event;
-		rlen = read(ctx->fanotify_fd, &event->fa,
-			    sizeof(struct fanotify_event_metadata));
+		rlen = read(ctx->fanotify_fd, ctx->buf, WATCHER_BUF_SIZE);
 		if (rlen < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
 			err("error %d on reading fanotify event", errno);
 			continue;
 		}
-		if (!(event->fa.mask & FAN_ACCESS_PERM)) {
-			continue;
-		}
-
-		if (get_fname(event->fa.fd, event->pathname) < 0) {
-			err("cannot retrieve filename, allow access");
-			cleanup_migrate_event(event);
-			ctx->event = event;
-			continue;
-		}
-
-		dbg("fanotify event %d: mask 0x%02lX, fd %d (%s), pid %d",
-		    i, (unsigned long) event->fa.mask, event->fa.fd,
-		    event->pathname, event->fa.pid);
-		if (event->fa.pid == getpid()) {
-			/* Avoid deadlocking */
-			info("Identical PID, allowing access");
-			cleanup_migrate_event(event);
-			ctx->event = event;
-			continue;
-		}
-		ctx->event = NULL;
-		ret = pthread_create(&event->thr, NULL, unmigrate_thread,
-				     event);
-		if (ret < 0) {
-			err("Failed to start thread, error %d", errno);
-			cleanup_migrate_event(event);
-			ctx->event = event;
-		} else
-			ctx->event = malloc_migrate_event(ctx->be,
-							  ctx->fanotify_fd);
-		i++;
+		/* Only this thread updates the read count */
+		ctx->stats.reads++;
+		ctx->buf_len = rlen;
+		ctx->buf_next = (struct fanotify_event_metadata *)ctx->buf;
+		while (FAN_EVENT_OK(ctx->buf_next, ctx->buf_len))
+			handle_fanotify_event(ctx, i++);
+		ctx->buf_next = NULL;
+		flush_responses(ctx);
 	}
 	pthread_cleanup_pop(1);
 	return NULL;
@@ -217,7 +1095,7 @@ void * watch_fanotify(void * arg)
 
 pthread_t start_watcher(struct backend *be, int fanotify_fd)
 {
-	int retval;
+	int retval, i, num_events;
 	struct watcher_context *ctx;
 
 	ctx = malloc(sizeof(struct watcher_context));
@@ -225,18 +1103,69 @@ pthread_t start_watcher(struct backend *be, int fanotify_fd)
 		err("Failed to allocate watcher context");
 		return (pthread_t)0;
 	}
+	memset(ctx, 0, sizeof(struct watcher_context));
 	ctx->be = be;
 	ctx->fanotify_fd = fanotify_fd;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->event_avail, NULL);
+	pthread_cond_init(&ctx->event_free, NULL);
+	pthread_cond_init(&ctx->fill_avail, NULL);
+	pthread_cond_init(&ctx->async_done, NULL);
+	INIT_LIST_HEAD(&ctx->fill_list);
+	clock_gettime(CLOCK_MONOTONIC, &ctx->stats.start);
+	ctx->stats.cpu = daemon_cpu();
 
+	/* One event for each queue slot and each worker */
+	num_events = watcher_queue_size + watcher_workers;
+	ctx->events = malloc(num_events * sizeof(struct migrate_event));
+	ctx->free_events = malloc(num_events * sizeof(struct migrate_event *));
+	ctx->queue = malloc(num_events * sizeof(struct migrate_event *));
+	ctx->resp = malloc(num_events * sizeof(struct migrate_event *));
+	ctx->resp_flush = malloc(num_events * sizeof(struct migrate_event *));
+	ctx->resp_iov = malloc(num_events * sizeof(struct iovec));
+	ctx->buf = malloc(WATCHER_BUF_SIZE);
+	for (i = 1; i < num_events; i <<= 1)
+		;
+	ctx->inflight = malloc(i * sizeof(struct migrate_event *));
+	ctx->inflight_mask = i - 1;
+	if (!ctx->events || !ctx->free_events || !ctx->queue ||
+	    !ctx->resp || !ctx->resp_flush || !ctx->resp_iov || !ctx->buf ||
+	    !ctx->inflight) {
+		err("Failed to allocate watcher events");
+		free_context(ctx);
+		errno = ENOMEM;
+		return (pthread_t)0;
+	}
+	memset(ctx->inflight, 0,
+	       (ctx->inflight_mask + 1) * sizeof(struct migrate_event *));
+	memset(ctx->events, 0, num_events * sizeof(struct migrate_event));
+	for (i = 0; i < num_events; i++) {
+		ctx->events[i].ctx = ctx;
+		ctx->events[i].fa.fd = -1;
+		INIT_LIST_HEAD(&ctx->events[i].waiters);
+		INIT_LIST_HEAD(&ctx->events[i].wait_list);
+		ctx->free_events[i] = &ctx->events[i];
+	}
+	ctx->num_free = num_events;
+	ctx->queue_size = num_events;
+
+	retval = start_workers(ctx, watcher_workers);
+	if (retval) {
+		free_context(ctx);
+		errno = retval;
+		return (pthread_t)0;
+	}
 	retval = pthread_create(&ctx->thread, NULL,
 				watch_fanotify, ctx);
 	if (retval) {
 		err("Failed to start fanotify watcher, error %d", retval);
-		free(ctx);
+		stop_workers(ctx);
+		free_context(ctx);
 		errno = retval;
 		return (pthread_t)0;
 	}
-	info("Started fanotify watcher");
+	info("Started fanotify watcher with %d workers, %d queued events",
+	     watcher_workers, watcher_queue_size);
 
 	return ctx->thread;
 }
@@ -1,8 +1,13 @@
 #ifndef _WATCHER_H
 #define _WATCHER_H
 
+extern int watcher_workers;
+extern int watcher_queue_size;
+extern int watcher_fill;
+extern int watcher_ignore;
+
 pthread_t start_watcher(struct backend *be, int fanotify_fd);
-void stop_watcher(pthread_t thr);
+int stop_watcher(pthread_t thr);
 int check_watcher(char *pathname);
 
 #endif /* _WATCHER_H */
@@ -0,0 +1,44 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring wrapper; we're doing the syscalls ourselves
+ * as liburing is not available everywhere.
+ */
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sqe_head;
+	unsigned int sqe_tail;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+int uring_init(struct uring *ring, unsigned int entries);
+void uring_exit(struct uring *ring);
+int uring_register_buffers(struct uring *ring, struct iovec *iov,
+			   unsigned int nr);
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+unsigned int uring_sq_space(struct uring *ring);
+int uring_submit(struct uring *ring, unsigned int wait_nr);
+struct io_uring_sqe *uring_unqueue_sqe(struct uring *ring);
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+#endif /* _URING_H */
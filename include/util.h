@@ -0,0 +1,6 @@
+#ifndef _UTIL_H
+#define _UTIL_H
+
+unsigned long long parse_size(char *optarg);
+
+#endif /* _UTIL_H */
@@ -18,6 +18,7 @@
 #include <sys/socket.h>
 #include <sys/signal.h>
 #include <sys/un.h>
+#include <sys/syscall.h>
 #include <linux/netlink.h>
 
 #include "logging.h"
@@ -25,6 +26,12 @@
 
 #define LOG_AREA "cli"
 
+/*
+ * Send @cli_cmd for @filename to dredger and wait for the reply.
+ * Returns the status sent by dredger, or a negative error number
+ * if dredger could not be reached, so that callers can tell a
+ * failed connection apart from a command which failed.
+ */
 int cli_send_command(int cli_cmd, char *filename, int src_fd)
 {
 	struct sockaddr_un sun, local;
@@ -38,22 +45,26 @@ int cli_send_command(int cli_cmd, char *filename, int src_fd)
 	int cli_sock, feature_on = 1;
 	char buf[1024];
 	char cmd[1024];
-	int buflen;
-	char status;
+	int buflen, ret;
 
 	cli_sock = socket(AF_LOCAL, SOCK_DGRAM, 0);
 	if (cli_sock < 0) {
-		err("cannot open cli socket");
-		return 3;
+		ret = -errno;
+		err("cannot open cli socket, error %d", -ret);
+		return ret;
 	}
 	memset(&local, 0x00, sizeof(struct sockaddr_un));
 	local.sun_family = AF_LOCAL;
-	sprintf(&local.sun_path[1], "/org/kernel/trawler/dredger/%d", getpid());
+	/* Use the thread id, too, to allow for parallel commands */
+	sprintf(&local.sun_path[1], "/org/kernel/trawler/dredger/%d/%ld",
+		getpid(), (long)syscall(SYS_gettid));
 	addrlen = offsetof(struct sockaddr_un, sun_path) +
 		strlen(local.sun_path + 1) + 1;
 	if (bind(cli_sock, (struct sockaddr *) &local, addrlen) < 0) {
-		err("bind to local cli address failed, error %d", errno);
-		return 4;
+		ret = -errno;
+		err("bind to local cli address failed, error %d", -ret);
+		close(cli_sock);
+		return ret;
 	}
 	setsockopt(cli_sock, SOL_SOCKET, SO_PASSCRED,
 		   &feature_on, sizeof(feature_on));
@@ -96,7 +107,8 @@ int cli_send_command(int cli_cmd, char *filename, int src_fd)
 		if (!cmsg) {
 			err("sendmsg failed, not enough message headers");
 			free(cred_msg);
-			return 6;
+			close(cli_sock);
+			return -ENOBUFS;
 		}
 		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
 		cmsg->cmsg_level = SOL_SOCKET;
@@ -106,13 +118,15 @@ int cli_send_command(int cli_cmd, char *filename, int src_fd)
 	err("send msg '%d' fd '%d' filename '%s'",
 	     cli_cmd, src_fd, filename);
 	if (sendmsg(cli_sock, &smsg, 0) < 0) {
-		if (errno == ECONNREFUSED) {
-			err("sendmsg failed, md_monitor is not running");
+		ret = -errno;
+		if (ret == -ECONNREFUSED) {
+			err("sendmsg failed, dredger is not running");
 		} else {
-			err("sendmsg failed, error %d", errno);
+			err("sendmsg failed, error %d", -ret);
 		}
 		free(cred_msg);
-		return 5;
+		close(cli_sock);
+		return ret;
 	}
 
 	memset(buf, 0x00, sizeof(buf));
@@ -120,22 +134,22 @@ int cli_send_command(int cli_cmd, char *filename, int src_fd)
 	iov.iov_len = 1024;
 	buflen = recvmsg(cli_sock, &smsg, 0);
 	if (buflen < 0) {
-		err("recvmsg failed, error %d", errno);
-		status = errno;
+		ret = -errno;
+		err("recvmsg failed, error %d", -ret);
 	} else if (buflen < 1) {
 		/* command ok */
-		status = 0;
+		ret = 0;
 	} else if (buflen < 2) {
 		/* Status message */
-		status = buf[0];
-		err("CLI message failed: %s", strerror(status));
+		ret = (unsigned char)buf[0];
+		err("CLI message failed: %s", strerror(ret));
 	} else {
 		printf("%s\n", buf);
-		status = 0;
+		ret = 0;
 	}
 	free(cred_msg);
 	close(cli_sock);
-	return status;
+	return ret;
 }
 
 int cli_command(enum cli_commands cli_cmd, char *filename)
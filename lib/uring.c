@@ -0,0 +1,224 @@
+/*
+ * uring.c
+ *
+ * Minimal io_uring support functions
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "logging.h"
+#include "uring.h"
+
+#define LOG_AREA "uring"
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int uring_init(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(ring, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		err("io_uring_setup failed, error %d", errno);
+		return -errno;
+	}
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+	ptr = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		err("cannot map submission ring, error %d", errno);
+		goto out_close;
+	}
+	ring->sq_ring = ptr;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ptr = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) {
+			err("cannot map completion ring, error %d", errno);
+			goto out_unmap_sq;
+		}
+		ring->cq_ring = ptr;
+	}
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		err("cannot map submission entries, error %d", errno);
+		goto out_unmap_cq;
+	}
+	ring->sqes = ptr;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+out_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+out_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return -ENOMEM;
+}
+
+void uring_exit(struct uring *ring)
+{
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* Register @nr buffers for use with the fixed read and write ops */
+int uring_register_buffers(struct uring *ring, struct iovec *iov,
+			   unsigned int nr)
+{
+	if (syscall(__NR_io_uring_register, ring->fd,
+		    IORING_REGISTER_BUFFERS, iov, nr) < 0)
+		return -errno;
+	return 0;
+}
+
+/*
+ * Return the next free submission entry, or NULL if the
+ * submission ring is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	unsigned int head;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sqe_tail - head >= ring->sq_entries)
+		return NULL;
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+/* Return the number of submission entries which can be queued */
+unsigned int uring_sq_space(struct uring *ring)
+{
+	unsigned int head;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return ring->sq_entries - (ring->sqe_tail - head);
+}
+
+/*
+ * Submit all pending entries and wait for at least
+ * @wait_nr completions. Entries the kernel did not take,
+ * e.g. on -EAGAIN or -EBUSY, are submitted again with the
+ * next call.
+ */
+int uring_submit(struct uring *ring, unsigned int wait_nr)
+{
+	unsigned int tail, to_submit;
+	unsigned int flags = 0;
+	int ret;
+
+	tail = *ring->sq_tail;
+	while (ring->sqe_head != ring->sqe_tail) {
+		ring->sq_array[tail & *ring->sq_mask] =
+			ring->sqe_head & *ring->sq_mask;
+		tail++;
+		ring->sqe_head++;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	/* The kernel advances the head for each entry it consumes */
+	to_submit = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (!to_submit && !wait_nr)
+		return 0;
+	if (wait_nr)
+		flags |= IORING_ENTER_GETEVENTS;
+	do {
+		ret = io_uring_enter(ring->fd, to_submit, wait_nr, flags);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	return ret;
+}
+
+/*
+ * Take back the most recently queued entry which the kernel
+ * has not consumed yet, or return NULL if there is none.
+ * Only valid after uring_submit(), once all entries have
+ * been queued.
+ */
+struct io_uring_sqe *uring_unqueue_sqe(struct uring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_head != ring->sqe_tail ||
+	    tail == __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE))
+		return NULL;
+	tail--;
+	sqe = &ring->sqes[ring->sq_array[tail & *ring->sq_mask]];
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+	ring->sqe_head--;
+	ring->sqe_tail--;
+	return sqe;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	unsigned int head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return NULL;
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1,
+			 __ATOMIC_RELEASE);
+}
@@ -0,0 +1,49 @@
+/*
+ * util.c
+ *
+ * Common helper functions
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "logging.h"
+#include "util.h"
+
+#define LOG_AREA "util"
+
+/*
+ * Parse a size with an optional K, M, G or T suffix.
+ * Returns (unsigned long long)-1 if @optarg is not a valid size.
+ */
+unsigned long long parse_size(char *optarg)
+{
+	unsigned long long size;
+	char *e;
+
+	size = strtoull(optarg, &e, 10);
+	switch (*e) {
+	case 'T':
+	case 't':
+		size <<= 10;
+		/* fallthrough */
+	case 'G':
+	case 'g':
+		size <<= 10;
+		/* fallthrough */
+	case 'M':
+	case 'm':
+		size <<= 10;
+		/* fallthrough */
+	case 'K':
+	case 'k':
+		size <<= 10;
+		e++;
+		break;
+	}
+	if (e == optarg || *e != '\0') {
+		err("Invalid size specifier '%s'", optarg);
+		return (unsigned long long)-1;
+	}
+	return size;
+}
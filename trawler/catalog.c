@@ -0,0 +1,645 @@
+/*
+ * catalog.c
+ *
+ * Persistent file catalog for trawler.
+ *
+ * The catalog holds one record per file or directory with inode
+ * number, device, size and timestamps. Records are indexed by the
+ * interned path id, and both the records and the path table are
+ * memory-mapped files in the catalog directory, so the catalog
+ * is updated in place by the scanner and the watcher and is
+ * available immediately after a restart.
+ *
+ * Every record carries the scan generation in which it has been
+ * seen last. Once a directory has been read completely, all
+ * entries which have not been seen in that generation are gone
+ * and their records are invalidated, together with everything
+ * below them.
+ *
+ * Accesses reported by the watcher are counted in a per-file
+ * heat score, which halves every CATALOG_HEAT_HALF_LIFE hours.
+ * The score is kept in the record itself and survives updates
+ * from the scanner, so the migration policy can tell files
+ * which are still in use apart from files which have merely
+ * old timestamps, e.g. on 'noatime' or 'relatime' mounts.
+ *
+ * After an unclean shutdown the records are kept, but checked
+ * against the path table first: a record has to be stored under
+ * its own path id, and that path has to be intact. Directories
+ * are read again on the next scan, as their entries might not
+ * have been written out.
+ *
+ * Failed migrations are counted in the record as well. The file
+ * is deferred in the index for an exponentially growing time,
+ * until it is migrated successfully or changes.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "catalog.h"
+#include "paths.h"
+#include "mapfile.h"
+#include "index.h"
+#include "logging.h"
+
+#define LOG_AREA "catalog"
+
+#define CATALOG_MAGIC 0x74434154
+#define CATALOG_MIN_RECORDS 4096
+
+/* Heat scores are 8.8 fixed point, decaying with a half-life in hours */
+#define CATALOG_HEAT_ONE 256
+#define CATALOG_HEAT_MAX 0xffff
+#define CATALOG_HEAT_HALF_LIFE 24
+
+/* Retry failed migrations after 5 minutes, backing off up to a day */
+#define CATALOG_RETRY_MIN 300
+#define CATALOG_RETRY_MAX 86400
+
+static struct mapfile catalog_map;
+static struct catalog_record *catalog_records;
+static unsigned int catalog_max_records;
+static pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long catalog_time(struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int catalog_init(void)
+{
+	if (catalog_records)
+		return 0;
+	return catalog_open(NULL);
+}
+
+static void catalog_compact(void);
+
+/*
+ * Drop the records which do not match the path table after an
+ * unclean shutdown, and have directories read again.
+ */
+static void catalog_recover(void)
+{
+	struct catalog_record *rec;
+	unsigned long long generation = catalog_map.hdr->aux;
+	unsigned int i, kept = 0, dropped = 0;
+
+	for (i = 0; i < catalog_map.hdr->count; i++) {
+		rec = &catalog_records[i];
+		if (!(rec->flags & CATALOG_VALID))
+			continue;
+		if (rec->path != i ||
+		    (rec->flags & ~(CATALOG_VALID | CATALOG_DIR |
+				    CATALOG_MIGRATED)) ||
+		    (i != PATH_ID_ROOT &&
+		     path_parent(i) == PATH_ID_INVALID)) {
+			rec->flags = 0;
+			dropped++;
+			continue;
+		}
+		if (rec->generation > generation)
+			generation = rec->generation;
+		if (rec->flags & CATALOG_DIR)
+			rec->mtime = rec->ctime = 0;
+		kept++;
+	}
+	catalog_map.hdr->aux = generation;
+	info("Recovered %u catalog records, dropped %u", kept, dropped);
+	/* Drop the paths cut off by the path table check */
+	catalog_compact();
+}
+
+/*
+ * Open the catalog in directory @dir, or an in-memory catalog
+ * if @dir is NULL. Returns 1 if an existing catalog has been
+ * restored, 2 if it has been recovered after an unclean shutdown,
+ * 0 if a new catalog has been created, or a negative error number.
+ */
+int catalog_open(const char *dir)
+{
+	int ret, restored;
+
+	if (catalog_records)
+		return -EBUSY;
+	restored = path_open(dir);
+	if (restored < 0)
+		return restored;
+	ret = mapfile_open(&catalog_map, dir, "catalog", CATALOG_MAGIC,
+			   sizeof(struct catalog_record),
+			   CATALOG_MIN_RECORDS);
+	if (ret < 0) {
+		path_close(0);
+		return ret;
+	}
+	if (!ret || !restored) {
+		mapfile_reset(&catalog_map);
+		restored = 0;
+	}
+	catalog_records = catalog_map.data;
+	catalog_max_records = (catalog_map.size -
+			       sizeof(struct mapfile_header)) /
+		sizeof(struct catalog_record);
+	if (restored && (restored == 2 || catalog_map.unclean)) {
+		catalog_recover();
+		restored = 2;
+	}
+	if (restored)
+		info("Restored catalog with %llu records, generation %llu",
+		     catalog_map.hdr->count, catalog_map.hdr->aux);
+	return restored;
+}
+
+static int catalog_keep(unsigned int path, void *arg)
+{
+	return path < catalog_map.hdr->count &&
+		(catalog_records[path].flags & CATALOG_VALID);
+}
+
+/*
+ * Drop the paths of records which have been invalidated, and
+ * move the records to the new path ids. Called on close, once
+ * no one else holds any path ids.
+ */
+static void catalog_compact(void)
+{
+	unsigned int *map, num, i, count;
+
+	if (!catalog_records)
+		return;
+	map = path_compact(catalog_keep, NULL, &num);
+	if (!map)
+		return;
+	count = catalog_map.hdr->count;
+	/* Records only move down, so each is read before it is overwritten */
+	for (i = 0; i < count; i++) {
+		if (map[i] == PATH_ID_INVALID)
+			continue;
+		if (map[i] != i)
+			memcpy(&catalog_records[map[i]], &catalog_records[i],
+			       sizeof(struct catalog_record));
+		if (catalog_records[map[i]].flags & CATALOG_VALID)
+			catalog_records[map[i]].path = map[i];
+	}
+	if (num < count) {
+		memset(&catalog_records[num], 0,
+		       (count - num) * sizeof(struct catalog_record));
+		catalog_map.hdr->count = num;
+	}
+	free(map);
+}
+
+void catalog_close(void)
+{
+	pthread_mutex_lock(&catalog_lock);
+	catalog_compact();
+	mapfile_close(&catalog_map, 1);
+	catalog_records = NULL;
+	catalog_max_records = 0;
+	pthread_mutex_unlock(&catalog_lock);
+	path_close(1);
+}
+
+/*
+ * Start a new scan generation. The generation is stored
+ * in the catalog, so it keeps increasing across restarts.
+ */
+unsigned int catalog_next_generation(void)
+{
+	unsigned int generation;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_init() < 0) {
+		pthread_mutex_unlock(&catalog_lock);
+		return 1;
+	}
+	generation = ++catalog_map.hdr->aux;
+	pthread_mutex_unlock(&catalog_lock);
+	return generation;
+}
+
+/* Return the current scan generation */
+unsigned int catalog_generation(void)
+{
+	return catalog_map.hdr ? catalog_map.hdr->aux : 0;
+}
+
+static struct catalog_record *catalog_get(unsigned int path)
+{
+	unsigned int num = catalog_max_records;
+
+	if (path < catalog_max_records)
+		return &catalog_records[path];
+	while (num <= path)
+		num *= 2;
+	if (mapfile_grow(&catalog_map, num) < 0)
+		return NULL;
+	catalog_records = catalog_map.data;
+	catalog_max_records = num;
+	return &catalog_records[path];
+}
+
+/*
+ * Record attributes @st for @path, as seen during scan @generation.
+ * Directories should only be recorded once they have been read
+ * completely.
+ */
+int catalog_update(unsigned int path, struct stat *st,
+		   unsigned int generation)
+{
+	struct catalog_record *rec;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_init() < 0 || !(rec = catalog_get(path))) {
+		pthread_mutex_unlock(&catalog_lock);
+		err("path %u: cannot allocate catalog record", path);
+		return -ENOMEM;
+	}
+	if (!(rec->flags & CATALOG_VALID)) {
+		/* Do not inherit anything from a previous user of the slot */
+		rec->heat = 0;
+		rec->failures = 0;
+		rec->retry = 0;
+	} else if (rec->failures &&
+		   (rec->size != (unsigned long long)st->st_size ||
+		    rec->mtime != catalog_time(&st->st_mtim))) {
+		/* Changed since the last failure, try again */
+		rec->failures = 0;
+		rec->retry = 0;
+		index_defer(path, 0);
+	}
+	rec->ino = st->st_ino;
+	rec->dev = st->st_dev;
+	rec->size = st->st_size;
+	rec->atime = catalog_time(&st->st_atim);
+	rec->mtime = catalog_time(&st->st_mtim);
+	rec->ctime = catalog_time(&st->st_ctim);
+	rec->path = path;
+	rec->generation = generation;
+	rec->flags = CATALOG_VALID;
+	if (S_ISDIR(st->st_mode))
+		rec->flags |= CATALOG_DIR;
+	else if (st->st_size > 0 && !st->st_blocks)
+		/* No data on the frontend, has been migrated already */
+		rec->flags |= CATALOG_MIGRATED;
+	if (path >= catalog_map.hdr->count)
+		catalog_map.hdr->count = path + 1;
+	pthread_mutex_unlock(&catalog_lock);
+	return 0;
+}
+
+/*
+ * Mark @path as seen during scan @generation.
+ */
+void catalog_touch(unsigned int path, unsigned int generation)
+{
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_records && path < catalog_map.hdr->count &&
+	    (catalog_records[path].flags & CATALOG_VALID))
+		catalog_records[path].generation = generation;
+	pthread_mutex_unlock(&catalog_lock);
+}
+
+struct catalog_ids {
+	unsigned int *ids;
+	unsigned int num;
+	unsigned int max;
+	unsigned int generation;
+	unsigned int pruned;
+};
+
+static int catalog_add_id(struct catalog_ids *ci, unsigned int id)
+{
+	if (ci->num == ci->max) {
+		unsigned int max = ci->max ? ci->max * 2 : 64;
+		unsigned int *ids;
+
+		ids = realloc(ci->ids, max * sizeof(unsigned int));
+		if (!ids)
+			return -ENOMEM;
+		ci->ids = ids;
+		ci->max = max;
+	}
+	ci->ids[ci->num++] = id;
+	return 0;
+}
+
+static int catalog_prune_entry(unsigned int id, void *arg)
+{
+	struct catalog_ids *ci = arg;
+	struct catalog_record *rec;
+
+	if (id >= catalog_map.hdr->count)
+		return 0;
+	rec = &catalog_records[id];
+	if (!(rec->flags & CATALOG_VALID) ||
+	    rec->generation >= ci->generation)
+		return 0;
+	rec->flags &= ~CATALOG_VALID;
+	index_remove(id);
+	ci->pruned++;
+	if (rec->flags & CATALOG_DIR)
+		return catalog_add_id(ci, id);
+	return 0;
+}
+
+/* Invalidate everything below the directories in @ci */
+static int catalog_prune_tree(struct catalog_ids *ci)
+{
+	int ret = 0;
+
+	ci->generation = UINT_MAX;
+	while (!ret && ci->num)
+		ret = path_for_each_child(ci->ids[--ci->num],
+					  catalog_prune_entry, ci);
+	return ret;
+}
+
+/*
+ * Invalidate all entries in directory @dir which have not been
+ * seen during scan @generation, and everything below them.
+ * Must be called after @dir has been read completely.
+ */
+int catalog_prune(unsigned int dir, unsigned int generation)
+{
+	struct catalog_ids ci = { .generation = generation };
+	int ret;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_records) {
+		pthread_mutex_unlock(&catalog_lock);
+		return 0;
+	}
+	ret = path_for_each_child(dir, catalog_prune_entry, &ci);
+	if (!ret)
+		ret = catalog_prune_tree(&ci);
+	pthread_mutex_unlock(&catalog_lock);
+	free(ci.ids);
+	if (ret < 0)
+		err("dir %u: cannot prune catalog, error %d", dir, -ret);
+	else if (ci.pruned)
+		dbg("dir %u: pruned %u catalog records", dir, ci.pruned);
+	return ret < 0 ? ret : (int)ci.pruned;
+}
+
+/*
+ * Invalidate the record for @path and, if it is a
+ * directory, everything below it.
+ */
+int catalog_remove(unsigned int path)
+{
+	struct catalog_ids ci = { .num = 0 };
+	struct catalog_record *rec;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_records && path < catalog_map.hdr->count &&
+	    (catalog_records[path].flags & CATALOG_VALID)) {
+		rec = &catalog_records[path];
+		rec->flags &= ~CATALOG_VALID;
+		index_remove(path);
+		ret = 0;
+		if (rec->flags & CATALOG_DIR) {
+			ret = catalog_add_id(&ci, path);
+			if (!ret)
+				ret = catalog_prune_tree(&ci);
+		}
+	}
+	pthread_mutex_unlock(&catalog_lock);
+	free(ci.ids);
+	return ret;
+}
+
+/*
+ * Mark @path as migrated, and drop it from the list
+ * of migration candidates until it is changed again.
+ */
+int catalog_set_migrated(unsigned int path)
+{
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_records && path < catalog_map.hdr->count &&
+	    (catalog_records[path].flags & CATALOG_VALID)) {
+		catalog_records[path].flags |= CATALOG_MIGRATED;
+		catalog_records[path].failures = 0;
+		catalog_records[path].retry = 0;
+		ret = 0;
+	}
+	index_remove(path);
+	pthread_mutex_unlock(&catalog_lock);
+	return ret;
+}
+
+/*
+ * Count a failed migration of @path, and defer it as a
+ * migration candidate for twice as long as the last time.
+ * Returns the number of failures so far.
+ */
+int catalog_set_failed(unsigned int path)
+{
+	struct catalog_record *rec;
+	unsigned int delay = CATALOG_RETRY_MIN;
+	int ret;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_records || path >= catalog_map.hdr->count ||
+	    !(catalog_records[path].flags & CATALOG_VALID)) {
+		pthread_mutex_unlock(&catalog_lock);
+		return -ENOENT;
+	}
+	rec = &catalog_records[path];
+	ret = ++rec->failures;
+	while (--ret && delay < CATALOG_RETRY_MAX)
+		delay *= 2;
+	if (delay > CATALOG_RETRY_MAX)
+		delay = CATALOG_RETRY_MAX;
+	rec->retry = time(NULL) + delay;
+	index_defer(path, rec->retry);
+	ret = rec->failures;
+	pthread_mutex_unlock(&catalog_lock);
+	return ret;
+}
+
+static unsigned int catalog_heat_now(void)
+{
+	return (time(NULL) / 3600) & 0xffff;
+}
+
+/* Return the score of @heat decayed to hour @now */
+static unsigned int catalog_heat_decay(unsigned int heat, unsigned int now)
+{
+	unsigned int score = heat >> 16;
+	unsigned int age = (now - heat) & 0xffff;
+
+	if (age >= 16 * CATALOG_HEAT_HALF_LIFE)
+		return 0;
+	score >>= age / CATALOG_HEAT_HALF_LIFE;
+	/* Approximate 2^-x by 1 - x/2 within one half-life */
+	score -= score * (age % CATALOG_HEAT_HALF_LIFE) /
+		(2 * CATALOG_HEAT_HALF_LIFE);
+	return score;
+}
+
+/*
+ * Count an access to @path. A file being written generates
+ * a stream of modify events, so for @modify the access is
+ * only counted once per hour.
+ */
+int catalog_access(unsigned int path, int modify)
+{
+	struct catalog_record *rec;
+	unsigned int now = catalog_heat_now(), score;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_records || path >= catalog_map.hdr->count ||
+	    !(catalog_records[path].flags & CATALOG_VALID)) {
+		pthread_mutex_unlock(&catalog_lock);
+		return -ENOENT;
+	}
+	rec = &catalog_records[path];
+	if (!modify || !rec->heat || (rec->heat & 0xffff) != now) {
+		score = catalog_heat_decay(rec->heat, now) + CATALOG_HEAT_ONE;
+		if (score > CATALOG_HEAT_MAX)
+			score = CATALOG_HEAT_MAX;
+		rec->heat = (score << 16) | now;
+	}
+	pthread_mutex_unlock(&catalog_lock);
+	return 0;
+}
+
+/*
+ * Return the current heat score of @path, in 1/256 accesses.
+ */
+unsigned int catalog_heat(unsigned int path)
+{
+	unsigned int score = 0;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_records && path < catalog_map.hdr->count &&
+	    (catalog_records[path].flags & CATALOG_VALID))
+		score = catalog_heat_decay(catalog_records[path].heat,
+					   catalog_heat_now());
+	pthread_mutex_unlock(&catalog_lock);
+	return score;
+}
+
+/*
+ * Copy the record for @path into @rec.
+ */
+int catalog_lookup(unsigned int path, struct catalog_record *rec)
+{
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (catalog_records && path < catalog_map.hdr->count &&
+	    (catalog_records[path].flags & CATALOG_VALID)) {
+		memcpy(rec, &catalog_records[path],
+		       sizeof(struct catalog_record));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&catalog_lock);
+	return ret;
+}
+
+int catalog_remove_path(const char *pathname)
+{
+	unsigned int path = path_lookup(pathname);
+
+	if (path == PATH_ID_INVALID)
+		return -ENOENT;
+	return catalog_remove(path);
+}
+
+static int catalog_add_subdir(unsigned int id, void *arg)
+{
+	struct catalog_ids *ci = arg;
+	struct catalog_record *rec;
+
+	if (id >= catalog_map.hdr->count)
+		return 0;
+	rec = &catalog_records[id];
+	if (!(rec->flags & CATALOG_VALID) || !(rec->flags & CATALOG_DIR))
+		return 0;
+	return catalog_add_id(ci, id);
+}
+
+/*
+ * Check whether the catalog record of directory @dir matches
+ * the attributes @st. If so, call @fn for every subdirectory
+ * recorded in the catalog and return 1, otherwise return 0.
+ * This allows incremental scans to skip unchanged directories
+ * after a restart.
+ */
+int catalog_unchanged(unsigned int dir, struct stat *st,
+		      void (*fn)(void *, const char *), void *arg)
+{
+	struct catalog_ids ci = { .num = 0 };
+	struct catalog_record *rec;
+	char name[NAME_MAX + 1];
+	unsigned int i;
+	int ret;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_records || dir >= catalog_map.hdr->count) {
+		pthread_mutex_unlock(&catalog_lock);
+		return 0;
+	}
+	rec = &catalog_records[dir];
+	if (!(rec->flags & CATALOG_VALID) || !(rec->flags & CATALOG_DIR) ||
+	    rec->dev != (unsigned long long)st->st_dev ||
+	    rec->ino != st->st_ino ||
+	    rec->mtime != catalog_time(&st->st_mtim) ||
+	    rec->ctime != catalog_time(&st->st_ctim)) {
+		pthread_mutex_unlock(&catalog_lock);
+		return 0;
+	}
+	ret = path_for_each_child(dir, catalog_add_subdir, &ci);
+	pthread_mutex_unlock(&catalog_lock);
+	if (ret < 0) {
+		free(ci.ids);
+		return 0;
+	}
+	for (i = 0; i < ci.num; i++) {
+		if (path_basename(ci.ids[i], name, sizeof(name)) == 0)
+			fn(arg, name);
+	}
+	free(ci.ids);
+	return 1;
+}
+
+/*
+ * Call @fn for every valid record until @fn returns non-zero.
+ * @fn is called with the catalog locked and must not call
+ * back into the catalog.
+ */
+int catalog_walk(int (*fn)(struct catalog_record *, void *), void *arg)
+{
+	unsigned int i;
+	int ret = 0;
+
+	pthread_mutex_lock(&catalog_lock);
+	if (!catalog_records)
+		goto out;
+	for (i = 0; i < catalog_map.hdr->count; i++) {
+		struct catalog_record *rec = &catalog_records[i];
+
+		if (!(rec->flags & CATALOG_VALID))
+			continue;
+		ret = fn(rec, arg);
+		if (ret)
+			break;
+	}
+out:
+	pthread_mutex_unlock(&catalog_lock);
+	return ret;
+}
@@ -0,0 +1,53 @@
+#ifndef _CATALOG_H
+#define _CATALOG_H
+
+#define CATALOG_VALID 0x1
+#define CATALOG_DIR 0x2
+#define CATALOG_MIGRATED 0x4
+
+/*
+ * On-disk catalog record, indexed by path id.
+ * Timestamps are in nanoseconds. @heat holds the
+ * decaying access score in the upper 16 bits and
+ * the hour of the last update in the lower 16 bits.
+ * @failures counts failed migrations since the file
+ * last changed, and @retry is the time in seconds
+ * before which no further migration is attempted.
+ */
+struct catalog_record {
+	unsigned long long ino;
+	unsigned long long dev;
+	unsigned long long size;
+	long long atime;
+	long long mtime;
+	long long ctime;
+	unsigned int path;
+	unsigned int generation;
+	unsigned int flags;
+	unsigned int heat;
+	unsigned int failures;
+	unsigned int retry;
+};
+
+struct stat;
+
+int catalog_open(const char *dir);
+void catalog_close(void);
+unsigned int catalog_next_generation(void);
+unsigned int catalog_generation(void);
+int catalog_update(unsigned int path, struct stat *st,
+		   unsigned int generation);
+int catalog_remove(unsigned int path);
+int catalog_set_migrated(unsigned int path);
+int catalog_set_failed(unsigned int path);
+void catalog_touch(unsigned int path, unsigned int generation);
+int catalog_prune(unsigned int dir, unsigned int generation);
+int catalog_lookup(unsigned int path, struct catalog_record *rec);
+int catalog_remove_path(const char *pathname);
+int catalog_unchanged(unsigned int dir, struct stat *st,
+		      void (*fn)(void *, const char *), void *arg);
+int catalog_access(unsigned int path, int modify);
+unsigned int catalog_heat(unsigned int path);
+int catalog_walk(int (*fn)(struct catalog_record *, void *), void *arg);
+
+#endif /* _CATALOG_H */
@@ -0,0 +1,227 @@
+/*
+ * dircache.c
+ *
+ * Directory metadata cache for incremental rescans.
+ *
+ * For every directory, identified by its interned path id,
+ * we remember device and inode number, mtime and ctime
+ * together with the names of its subdirectories. If none of these
+ * changed on a rescan the directory contents are unchanged, so
+ * the directory doesn't need to be read again; only the cached
+ * subdirectories have to be visited.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "dircache.h"
+#include "logging.h"
+
+#define LOG_AREA "dircache"
+
+#define DIRCACHE_MIN_BUCKETS 1024
+
+struct dir_cache_entry {
+	struct dir_cache_entry *next;
+	unsigned int dir;
+	unsigned int generation;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct timespec ctime;
+	char *subdirs;
+	size_t subdirs_len;
+};
+
+static struct dir_cache_entry **dircache;
+static unsigned int dircache_buckets;
+static unsigned int dircache_entries;
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int dircache_hash(unsigned int dir)
+{
+	return dir * 2654435761u;
+}
+
+static int dircache_resize(unsigned int buckets)
+{
+	struct dir_cache_entry **table, *de, *next;
+	unsigned int i;
+
+	table = malloc(buckets * sizeof(struct dir_cache_entry *));
+	if (!table)
+		return -ENOMEM;
+	memset(table, 0, buckets * sizeof(struct dir_cache_entry *));
+	for (i = 0; i < dircache_buckets; i++) {
+		for (de = dircache[i]; de; de = next) {
+			unsigned int b = dircache_hash(de->dir) & (buckets - 1);
+
+			next = de->next;
+			de->next = table[b];
+			table[b] = de;
+		}
+	}
+	free(dircache);
+	dircache = table;
+	dircache_buckets = buckets;
+	return 0;
+}
+
+static struct dir_cache_entry *dircache_find(unsigned int dir)
+{
+	struct dir_cache_entry *de;
+
+	if (!dircache_buckets)
+		return NULL;
+	for (de = dircache[dircache_hash(dir) & (dircache_buckets - 1)];
+	     de; de = de->next)
+		if (de->dir == dir)
+			return de;
+	return NULL;
+}
+
+static int dircache_same(struct dir_cache_entry *de, struct stat *st)
+{
+	return de->dev == st->st_dev &&
+		de->ino == st->st_ino &&
+		de->mtime.tv_sec == st->st_mtim.tv_sec &&
+		de->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+		de->ctime.tv_sec == st->st_ctim.tv_sec &&
+		de->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/*
+ * Check whether directory @dir with attributes @st is unchanged
+ * since the last scan. If so, call @fn for every cached
+ * subdirectory and return 1, otherwise return 0.
+ */
+int dircache_unchanged(unsigned int dir, struct stat *st,
+		       unsigned int generation,
+		       void (*fn)(void *, const char *), void *arg)
+{
+	struct dir_cache_entry *de;
+	char *names = NULL, *name;
+	size_t names_len;
+
+	pthread_mutex_lock(&dircache_lock);
+	de = dircache_find(dir);
+	if (!de || !dircache_same(de, st)) {
+		pthread_mutex_unlock(&dircache_lock);
+		return 0;
+	}
+	/* The entry might be updated once the lock is dropped */
+	names_len = de->subdirs_len;
+	if (names_len) {
+		names = malloc(names_len);
+		if (!names) {
+			pthread_mutex_unlock(&dircache_lock);
+			return 0;
+		}
+		memcpy(names, de->subdirs, names_len);
+	}
+	de->generation = generation;
+	pthread_mutex_unlock(&dircache_lock);
+
+	for (name = names; name < names + names_len;
+	     name += strlen(name) + 1)
+		fn(arg, name);
+	free(names);
+	return 1;
+}
+
+/*
+ * Record attributes @st and the '\0'-separated list of
+ * subdirectories @subdirs for directory @dir.
+ */
+int dircache_update(unsigned int dir, struct stat *st,
+		    unsigned int generation,
+		    const char *subdirs, size_t subdirs_len)
+{
+	struct dir_cache_entry *de;
+	char *names = NULL;
+	unsigned int b;
+
+	if (subdirs_len) {
+		names = malloc(subdirs_len);
+		if (!names) {
+			err("dir %u: cannot allocate cache entry", dir);
+			return -ENOMEM;
+		}
+		memcpy(names, subdirs, subdirs_len);
+	}
+	pthread_mutex_lock(&dircache_lock);
+	de = dircache_find(dir);
+	if (!de) {
+		if (dircache_entries >= dircache_buckets) {
+			unsigned int buckets = dircache_buckets ?
+				dircache_buckets * 2 : DIRCACHE_MIN_BUCKETS;
+
+			/* Continue with the old table if resizing fails */
+			if (dircache_resize(buckets) < 0 &&
+			    !dircache_buckets) {
+				pthread_mutex_unlock(&dircache_lock);
+				err("dir %u: cannot allocate cache table", dir);
+				free(names);
+				return -ENOMEM;
+			}
+		}
+		de = malloc(sizeof(struct dir_cache_entry));
+		if (!de) {
+			pthread_mutex_unlock(&dircache_lock);
+			err("dir %u: cannot allocate cache entry", dir);
+			free(names);
+			return -ENOMEM;
+		}
+		de->dir = dir;
+		de->subdirs = NULL;
+		b = dircache_hash(dir) & (dircache_buckets - 1);
+		de->next = dircache[b];
+		dircache[b] = de;
+		dircache_entries++;
+	}
+	free(de->subdirs);
+	de->subdirs = names;
+	de->subdirs_len = subdirs_len;
+	de->generation = generation;
+	de->dev = st->st_dev;
+	de->ino = st->st_ino;
+	de->mtime = st->st_mtim;
+	de->ctime = st->st_ctim;
+	pthread_mutex_unlock(&dircache_lock);
+	return 0;
+}
+
+/*
+ * Drop all directories which have not been seen
+ * during the scan @generation.
+ */
+void dircache_prune(unsigned int generation)
+{
+	struct dir_cache_entry **pde, *de;
+	unsigned int i, pruned = 0;
+
+	pthread_mutex_lock(&dircache_lock);
+	for (i = 0; i < dircache_buckets; i++) {
+		pde = &dircache[i];
+		while ((de = *pde)) {
+			if (de->generation == generation) {
+				pde = &de->next;
+				continue;
+			}
+			*pde = de->next;
+			free(de->subdirs);
+			free(de);
+			dircache_entries--;
+			pruned++;
+		}
+	}
+	pthread_mutex_unlock(&dircache_lock);
+	if (pruned)
+		info("Pruned %u stale directories", pruned);
+}
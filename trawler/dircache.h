@@ -0,0 +1,12 @@
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+int dircache_unchanged(unsigned int dir, struct stat *st,
+		       unsigned int generation,
+		       void (*fn)(void *, const char *), void *arg);
+int dircache_update(unsigned int dir, struct stat *st,
+		    unsigned int generation,
+		    const char *subdirs, size_t subdirs_len);
+void dircache_prune(unsigned int generation);
+
+#endif /* _DIRCACHE_H */
@@ -2,6 +2,13 @@
  * events.c
  *
  * event handling for trawler.
+ *
+ * Event entries are kept in a skip list ordered by timestamp,
+ * so inserting a new timestamp is O(log n) and the events can
+ * be iterated oldest-first. Each directory is recorded only once
+ * by its interned path id; a hash table of path ids is used to
+ * find the existing entry.
+ *
  * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
  */
 #include <stdio.h>
@@ -11,102 +18,444 @@
 #include <limits.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "list.h"
 #include "events.h"
+#include "paths.h"
+#include "catalog.h"
+#include "index.h"
 #include "logging.h"
 
 #define LOG_AREA "events"
 
+#define EVENT_MAX_LEVEL 24
+#define EVENT_MIN_BUCKETS 1024
+
+struct event_entry;
+
 struct event_file {
 	struct list_head ef_next;
-	char ef_path[PATH_MAX];
+	struct event_file *ef_hash_next;
+	struct event_entry *ef_entry;
+	unsigned int ef_path;
 };
 
 struct event_entry {
-	struct list_head ee_next;
 	struct list_head ee_entries;
 	time_t ee_time;
+	int ee_level;
+	struct event_entry *ee_next[];
 };
 
-LIST_HEAD(event_list);
+static struct event_entry *event_head;
+static int event_level = 1;
+static unsigned int event_seed = 1;
+
+static struct event_file **event_hash;
+static unsigned int event_buckets;
+static unsigned int event_files;
 
-int insert_event(char *dirname, time_t dtime)
+pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int event_hash_path(unsigned int path)
 {
-	struct event_file *tmp_ef, *d_ef = NULL, *new_ef;
-	struct event_entry *tmp_ev, *d_ev = NULL, *last_ev = NULL;
-	char *ptr;
+	return path * 2654435761u;
+}
 
-	new_ef = malloc(sizeof(struct event_file));
-	if (!new_ef) {
-		err("%s: Cannot allocate memory, error %d", dirname, errno);
-		return -errno;
-	}
-	strcpy(new_ef->ef_path, dirname);
-	ptr = strrchr(new_ef->ef_path, '/');
-	if (ptr)
-		*ptr = '\0';
-
-	list_for_each_entry(tmp_ev, &event_list, ee_next) {
-		if (difftime(tmp_ev->ee_time, dtime) > 0)
-			continue;
-		if (tmp_ev->ee_time == dtime) {
-			d_ev = tmp_ev;
-			break;
+static int event_hash_resize(unsigned int buckets)
+{
+	struct event_file **table, *ef, *next;
+	unsigned int i;
+
+	table = malloc(buckets * sizeof(struct event_file *));
+	if (!table)
+		return -ENOMEM;
+	memset(table, 0, buckets * sizeof(struct event_file *));
+	for (i = 0; i < event_buckets; i++) {
+		for (ef = event_hash[i]; ef; ef = next) {
+			unsigned int b;
+
+			next = ef->ef_hash_next;
+			b = event_hash_path(ef->ef_path) & (buckets - 1);
+			ef->ef_hash_next = table[b];
+			table[b] = ef;
 		}
-		last_ev = tmp_ev;
 	}
-	if (!d_ev) {
-		d_ev = malloc(sizeof(struct event_entry));
+	free(event_hash);
+	event_hash = table;
+	event_buckets = buckets;
+	return 0;
+}
+
+static struct event_file *event_hash_find(unsigned int path)
+{
+	struct event_file *ef;
+
+	if (!event_buckets)
+		return NULL;
+	for (ef = event_hash[event_hash_path(path) & (event_buckets - 1)];
+	     ef; ef = ef->ef_hash_next)
+		if (ef->ef_path == path)
+			return ef;
+	return NULL;
+}
+
+static void event_hash_del(struct event_file *ef)
+{
+	struct event_file **pef;
+
+	pef = &event_hash[event_hash_path(ef->ef_path) & (event_buckets - 1)];
+	while (*pef != ef)
+		pef = &(*pef)->ef_hash_next;
+	*pef = ef->ef_hash_next;
+	event_files--;
+}
+
+static struct event_entry *event_entry_alloc(time_t dtime, int level)
+{
+	struct event_entry *ee;
+
+	ee = malloc(sizeof(struct event_entry) +
+		    level * sizeof(struct event_entry *));
+	if (!ee)
+		return NULL;
+	memset(ee->ee_next, 0, level * sizeof(struct event_entry *));
+	INIT_LIST_HEAD(&ee->ee_entries);
+	ee->ee_time = dtime;
+	ee->ee_level = level;
+	return ee;
+}
+
+static int event_init(void)
+{
+	if (event_head)
+		return 0;
+	event_head = event_entry_alloc(0, EVENT_MAX_LEVEL);
+	if (!event_head)
+		return -ENOMEM;
+	if (event_hash_resize(EVENT_MIN_BUCKETS) < 0) {
+		free(event_head);
+		event_head = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int event_random_level(void)
+{
+	int level = 1;
+
+	while (level < EVENT_MAX_LEVEL && (rand_r(&event_seed) & 3) == 0)
+		level++;
+	return level;
+}
+
+/*
+ * Find the entry for @dtime, and fill @update with the
+ * rightmost entry before @dtime on every level.
+ */
+static struct event_entry *event_find(time_t dtime,
+				      struct event_entry **update)
+{
+	struct event_entry *ee = event_head;
+	int i;
+
+	for (i = event_level - 1; i >= 0; i--) {
+		while (ee->ee_next[i] &&
+		       difftime(ee->ee_next[i]->ee_time, dtime) < 0)
+			ee = ee->ee_next[i];
+		update[i] = ee;
+	}
+	ee = ee->ee_next[0];
+	if (ee && ee->ee_time == dtime)
+		return ee;
+	return NULL;
+}
+
+static struct event_entry *event_get(time_t dtime)
+{
+	struct event_entry *update[EVENT_MAX_LEVEL], *ee;
+	int i, level;
+
+	ee = event_find(dtime, update);
+	if (ee)
+		return ee;
+	level = event_random_level();
+	if (level > event_level) {
+		for (i = event_level; i < level; i++)
+			update[i] = event_head;
+		event_level = level;
+	}
+	ee = event_entry_alloc(dtime, level);
+	if (!ee)
+		return NULL;
+	for (i = 0; i < level; i++) {
+		ee->ee_next[i] = update[i]->ee_next[i];
+		update[i]->ee_next[i] = ee;
+	}
+	return ee;
+}
+
+static void event_put(struct event_entry *ee)
+{
+	struct event_entry *update[EVENT_MAX_LEVEL];
+	int i;
+
+	if (!list_empty(&ee->ee_entries))
+		return;
+	if (event_find(ee->ee_time, update) != ee)
+		return;
+	for (i = 0; i < ee->ee_level; i++)
+		update[i]->ee_next[i] = ee->ee_next[i];
+	while (event_level > 1 && !event_head->ee_next[event_level - 1])
+		event_level--;
+	free(ee);
+}
+
+/*
+ * Record the directory @dir with timestamp @dtime.
+ * Each directory is recorded with the most recent
+ * timestamp of the files within.
+ */
+static int insert_dir_event(unsigned int dir, time_t dtime)
+{
+	struct event_file *ef;
+	struct event_entry *d_ev;
+	unsigned int b;
+
+	pthread_mutex_lock(&event_lock);
+	if (event_init() < 0) {
+		pthread_mutex_unlock(&event_lock);
+		err("path %u: Cannot allocate memory", dir);
+		return -ENOMEM;
+	}
+	ef = event_hash_find(dir);
+	if (ef) {
+		struct event_entry *old_ev = ef->ef_entry;
+
+		if (difftime(dtime, old_ev->ee_time) <= 0) {
+			pthread_mutex_unlock(&event_lock);
+			return 0;
+		}
+		d_ev = event_get(dtime);
 		if (!d_ev) {
-			err("%s: failed to allocate event entry", dirname);
+			pthread_mutex_unlock(&event_lock);
+			err("path %u: failed to allocate event entry", dir);
 			return -ENOMEM;
 		}
-		INIT_LIST_HEAD(&d_ev->ee_next);
-		INIT_LIST_HEAD(&d_ev->ee_entries);
-		d_ev->ee_time = dtime;
-		if (last_ev)
-			list_add(&d_ev->ee_next, &last_ev->ee_next);
-		else
-			list_add(&d_ev->ee_next, &event_list);
+		list_move(&ef->ef_next, &d_ev->ee_entries);
+		ef->ef_entry = d_ev;
+		event_put(old_ev);
+		pthread_mutex_unlock(&event_lock);
+		return 0;
+	}
+
+	ef = malloc(sizeof(struct event_file));
+	if (!ef) {
+		pthread_mutex_unlock(&event_lock);
+		err("path %u: Cannot allocate memory, error %d", dir, errno);
+		return -ENOMEM;
+	}
+	d_ev = event_get(dtime);
+	if (!d_ev) {
+		pthread_mutex_unlock(&event_lock);
+		err("path %u: failed to allocate event entry", dir);
+		free(ef);
+		return -ENOMEM;
+	}
+	ef->ef_path = dir;
+	ef->ef_entry = d_ev;
+	list_add(&ef->ef_next, &d_ev->ee_entries);
+	if (event_files >= event_buckets)
+		/* Continue with the old table if resizing fails */
+		event_hash_resize(event_buckets * 2);
+	b = event_hash_path(dir) & (event_buckets - 1);
+	ef->ef_hash_next = event_hash[b];
+	event_hash[b] = ef;
+	event_files++;
+	pthread_mutex_unlock(&event_lock);
+	return 0;
+}
+
+/*
+ * Record file @file in directory @dir with attributes @st,
+ * and update the age and size index. The index uses the
+ * later of atime and mtime, as atime is not updated on
+ * every access with 'relatime'. Files without any blocks
+ * on the frontend have been migrated already and are
+ * removed from the index.
+ */
+int insert_event_at(unsigned int dir, unsigned int file, struct stat *st)
+{
+	time_t dtime, atime;
+	int ret;
+
+	if (difftime(st->st_atime, st->st_mtime) < 0) {
+		dtime = st->st_atime;
+		atime = st->st_mtime;
 	} else {
-		list_for_each_entry(tmp_ef, &d_ev->ee_entries, ef_next) {
-			if (!strcmp(tmp_ef->ef_path, new_ef->ef_path)) {
-				d_ef = tmp_ef;
-				break;
-			}
-		}
-		if (d_ef) {
-			free(new_ef);
-			return 0;
-		}
+		dtime = st->st_mtime;
+		atime = st->st_atime;
 	}
-	list_add(&new_ef->ef_next, &d_ev->ee_entries);
+	ret = insert_dir_event(dir, dtime);
+	if (ret < 0)
+		return ret;
+	if (st->st_size > 0 && !st->st_blocks) {
+		index_remove(file);
+		return 0;
+	}
+	return index_update(file, st->st_size, atime);
+}
+
+/*
+ * Record file @filename with attributes @st.
+ */
+int insert_event(char *filename, struct stat *st)
+{
+	unsigned int file;
+
+	file = path_intern(filename);
+	if (file == PATH_ID_INVALID)
+		return -ENOMEM;
+	return insert_event_at(path_parent(file), file, st);
+}
+
+/*
+ * Update catalog and events for file @filename,
+ * e.g. after a watcher event.
+ */
+int update_event(char *filename)
+{
+	struct stat st;
+	unsigned int file;
+	int ret;
+
+	if (lstat(filename, &st) < 0) {
+		if (errno == ENOENT)
+			return catalog_remove_path(filename);
+		return -errno;
+	}
+	/* Directories are recorded once they have been scanned */
+	if (!S_ISREG(st.st_mode))
+		return 0;
+	file = path_intern(filename);
+	if (file == PATH_ID_INVALID)
+		return -ENOMEM;
+	ret = catalog_update(file, &st, catalog_generation());
+	if (ret < 0)
+		return ret;
+	return insert_event_at(path_parent(file), file, &st);
+}
+
+/*
+ * Count an open or modification of file @filename
+ * in its heat score.
+ */
+int access_event(char *filename, int modify)
+{
+	unsigned int file = path_lookup(filename);
+
+	if (file == PATH_ID_INVALID)
+		return -ENOENT;
+	return catalog_access(file, modify);
+}
+
+/*
+ * Remove the directory @dirname from the event list.
+ */
+int remove_event(char *dirname)
+{
+	struct event_file *ef;
+	struct event_entry *d_ev;
+	unsigned int dir = path_lookup(dirname);
+
+	if (dir == PATH_ID_INVALID)
+		return -ENOENT;
+	pthread_mutex_lock(&event_lock);
+	ef = event_hash_find(dir);
+	if (!ef) {
+		pthread_mutex_unlock(&event_lock);
+		return -ENOENT;
+	}
+	d_ev = ef->ef_entry;
+	event_hash_del(ef);
+	list_del(&ef->ef_next);
+	event_put(d_ev);
+	pthread_mutex_unlock(&event_lock);
+	free(ef);
 	return 0;
 }
 
-void list_events(void)
+/*
+ * Call @fn for every recorded directory, oldest first,
+ * until @fn returns non-zero. Must not call back into
+ * the event functions.
+ */
+int walk_events(int (*fn)(const char *, time_t, void *), void *arg)
 {
-	struct event_file *tmp_ef;
-	struct event_entry *tmp_ee;
-	struct tm dtm;
-	int num_files;
+	struct event_entry *ee;
+	struct event_file *ef;
+	char path[PATH_MAX];
+	int ret = 0;
 
-	list_for_each_entry(tmp_ee, &event_list, ee_next) {
-		if (!gmtime_r(&tmp_ee->ee_time, &dtm)) {
-			err("%s: Cannot convert time, error %d",
-			    tmp_ef->ef_path, errno);
-			continue;
-		}
-		dbg("%04d%02d%02d-%02d%02d%02d:",
-		    dtm.tm_year + 1900, dtm.tm_mon, dtm.tm_mday,
-		    dtm.tm_hour, dtm.tm_min, dtm.tm_sec);
-		num_files = 0;
-		list_for_each_entry(tmp_ef, &tmp_ee->ee_entries, ef_next) {
-			num_files++;
-			dbg("\t%s", tmp_ef->ef_path);
+	/* Files restored from the catalog are recorded with the index */
+	index_load();
+	pthread_mutex_lock(&event_lock);
+	if (!event_head)
+		goto out;
+	for (ee = event_head->ee_next[0]; ee; ee = ee->ee_next[0]) {
+		list_for_each_entry(ef, &ee->ee_entries, ef_next) {
+			if (path_name(ef->ef_path, path, sizeof(path)) < 0)
+				continue;
+			ret = fn(path, ee->ee_time, arg);
+			if (ret)
+				goto out;
 		}
-		dbg("%04d%02d%02d-%02d%02d%02d: %d entries",
-		    dtm.tm_year + 1900, dtm.tm_mon, dtm.tm_mday,
-		    dtm.tm_hour, dtm.tm_min, dtm.tm_sec, num_files);
 	}
+out:
+	pthread_mutex_unlock(&event_lock);
+	return ret;
+}
+
+struct event_list_ctx {
+	time_t last_time;
+	int num_files;
+};
+
+static void list_event_time(time_t dtime, int num_files)
+{
+	struct tm dtm;
+
+	if (!gmtime_r(&dtime, &dtm)) {
+		err("Cannot convert time, error %d", errno);
+		return;
+	}
+	dbg("%04d%02d%02d-%02d%02d%02d: %d entries",
+	    dtm.tm_year + 1900, dtm.tm_mon, dtm.tm_mday,
+	    dtm.tm_hour, dtm.tm_min, dtm.tm_sec, num_files);
+}
+
+static int list_event(const char *path, time_t dtime, void *arg)
+{
+	struct event_list_ctx *ctx = arg;
+
+	if (ctx->num_files && dtime != ctx->last_time) {
+		list_event_time(ctx->last_time, ctx->num_files);
+		ctx->num_files = 0;
+	}
+	ctx->last_time = dtime;
+	ctx->num_files++;
+	dbg("\t%s", path);
+	return 0;
+}
+
+void list_events(void)
+{
+	struct event_list_ctx ctx = { .num_files = 0 };
+
+	walk_events(list_event, &ctx);
+	if (ctx.num_files)
+		list_event_time(ctx.last_time, ctx.num_files);
 }
@@ -1,7 +1,14 @@
 #ifndef _EVENTS_H
 #define _EVENTS_H
 
-int insert_event(char *dirname, time_t dtime);
+struct stat;
+
+int insert_event(char *filename, struct stat *st);
+int insert_event_at(unsigned int dir, unsigned int file, struct stat *st);
+int update_event(char *filename);
+int remove_event(char *dirname);
+int access_event(char *filename, int modify);
+int walk_events(int (*fn)(const char *, time_t, void *), void *arg);
 void list_events(void);
 
 #endif /* _EVENTS_H */
@@ -0,0 +1,569 @@
+/*
+ * index.c
+ *
+ * Age and size index over the catalog.
+ *
+ * Files are sorted into size classes by the logarithm of their
+ * size. Each size class keeps a skip list of time slots ordered
+ * by last access time, and every time slot holds the ids of the
+ * files accessed within it. The coldest files of at least a given
+ * size are found by merging the slot lists of the matching size
+ * classes, so only the files returned (and those rejected by the
+ * path prefix) are looked at.
+ *
+ * Files for which migration failed are deferred until a retry
+ * time, and are passed over by the coldest files query until
+ * then, so they do not crowd out the remaining candidates.
+ *
+ * The number of files and bytes per time slot are kept in Fenwick
+ * trees, so the byte histogram by age is built from a handful of
+ * prefix sums.
+ *
+ * The index lives in memory only; it is rebuilt from the catalog
+ * after a restart. That is left to a loader, which is only run
+ * once the index is queried, so a restart does not have to go
+ * through every file before the scanner and watcher can start.
+ *
+ * The index is updated by the catalog with the path table locked
+ * for reading, so the path lock is always taken before the index
+ * lock, also for the path prefix check of the coldest files query.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "index.h"
+#include "paths.h"
+#include "logging.h"
+
+#define LOG_AREA "index"
+
+#define INDEX_CLASSES 64
+#define INDEX_MAX_LEVEL 20
+/* Time slots of about one hour */
+#define INDEX_SLOT_SHIFT 12
+#define INDEX_MAX_SLOTS (1 << 20)
+#define INDEX_NO_CLASS 0xff
+
+struct index_slot {
+	long long slot;
+	unsigned int num;
+	unsigned int max;
+	unsigned int *ids;
+	int level;
+	struct index_slot *next[];
+};
+
+struct index_entry {
+	struct index_slot *slot;
+	unsigned long long size;
+	time_t atime;
+	time_t retry;
+	unsigned int pos;
+	unsigned char class;
+};
+
+static struct index_slot *index_head[INDEX_CLASSES];
+static int index_level[INDEX_CLASSES];
+static unsigned int index_seed = 1;
+
+static struct index_entry *index_entries;
+static unsigned int index_max_entries;
+static unsigned int index_num_files;
+
+static unsigned long long *index_bytes_tree;
+static unsigned long long *index_files_tree;
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void (*index_loader)(void);
+static pthread_mutex_t index_load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int index_class(unsigned long long size)
+{
+	int class = 0;
+
+	while (size > 1) {
+		size >>= 1;
+		class++;
+	}
+	return class;
+}
+
+static long long index_time_slot(time_t atime)
+{
+	long long slot = (long long)atime >> INDEX_SLOT_SHIFT;
+
+	if (slot < 0)
+		return 0;
+	if (slot >= INDEX_MAX_SLOTS)
+		return INDEX_MAX_SLOTS - 1;
+	return slot;
+}
+
+static void index_tree_add(unsigned long long *tree, long long slot,
+			   long long val)
+{
+	for (slot++; slot <= INDEX_MAX_SLOTS; slot += slot & -slot)
+		tree[slot - 1] += val;
+}
+
+/* Sum of all values in slots up to and including @slot */
+static unsigned long long index_tree_sum(unsigned long long *tree,
+					 long long slot)
+{
+	unsigned long long sum = 0;
+
+	if (slot >= INDEX_MAX_SLOTS)
+		slot = INDEX_MAX_SLOTS - 1;
+	for (slot++; slot > 0; slot -= slot & -slot)
+		sum += tree[slot - 1];
+	return sum;
+}
+
+static struct index_slot *index_slot_alloc(long long slot, int level)
+{
+	struct index_slot *is;
+
+	is = malloc(sizeof(struct index_slot) +
+		    level * sizeof(struct index_slot *));
+	if (!is)
+		return NULL;
+	memset(is->next, 0, level * sizeof(struct index_slot *));
+	is->slot = slot;
+	is->num = 0;
+	is->max = 0;
+	is->ids = NULL;
+	is->level = level;
+	return is;
+}
+
+static int index_init(void)
+{
+	int i;
+
+	if (index_bytes_tree)
+		return 0;
+	for (i = 0; i < INDEX_CLASSES; i++) {
+		if (index_head[i])
+			continue;
+		index_head[i] = index_slot_alloc(-1, INDEX_MAX_LEVEL);
+		if (!index_head[i])
+			return -ENOMEM;
+		index_level[i] = 1;
+	}
+	index_files_tree = calloc(INDEX_MAX_SLOTS,
+				  sizeof(unsigned long long));
+	if (!index_files_tree)
+		return -ENOMEM;
+	index_bytes_tree = calloc(INDEX_MAX_SLOTS,
+				  sizeof(unsigned long long));
+	if (!index_bytes_tree) {
+		free(index_files_tree);
+		index_files_tree = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static int index_random_level(void)
+{
+	int level = 1;
+
+	while (level < INDEX_MAX_LEVEL && (rand_r(&index_seed) & 3) == 0)
+		level++;
+	return level;
+}
+
+static struct index_slot *index_find(int class, long long slot,
+				     struct index_slot **update)
+{
+	struct index_slot *is = index_head[class];
+	int i;
+
+	for (i = index_level[class] - 1; i >= 0; i--) {
+		while (is->next[i] && is->next[i]->slot < slot)
+			is = is->next[i];
+		update[i] = is;
+	}
+	is = is->next[0];
+	if (is && is->slot == slot)
+		return is;
+	return NULL;
+}
+
+static struct index_slot *index_get(int class, long long slot)
+{
+	struct index_slot *update[INDEX_MAX_LEVEL], *is;
+	int i, level;
+
+	is = index_find(class, slot, update);
+	if (is)
+		return is;
+	level = index_random_level();
+	if (level > index_level[class]) {
+		for (i = index_level[class]; i < level; i++)
+			update[i] = index_head[class];
+		index_level[class] = level;
+	}
+	is = index_slot_alloc(slot, level);
+	if (!is)
+		return NULL;
+	for (i = 0; i < level; i++) {
+		is->next[i] = update[i]->next[i];
+		update[i]->next[i] = is;
+	}
+	return is;
+}
+
+static void index_put(int class, struct index_slot *is)
+{
+	struct index_slot *update[INDEX_MAX_LEVEL];
+	int i;
+
+	if (is->num)
+		return;
+	if (index_find(class, is->slot, update) != is)
+		return;
+	for (i = 0; i < is->level; i++)
+		update[i]->next[i] = is->next[i];
+	while (index_level[class] > 1 &&
+	       !index_head[class]->next[index_level[class] - 1])
+		index_level[class]--;
+	free(is->ids);
+	free(is);
+}
+
+static void index_unlink(unsigned int id)
+{
+	struct index_entry *ie = &index_entries[id];
+	struct index_slot *is = ie->slot;
+	unsigned int last;
+
+	last = is->ids[--is->num];
+	if (last != id) {
+		is->ids[ie->pos] = last;
+		index_entries[last].pos = ie->pos;
+	}
+	index_tree_add(index_files_tree, is->slot, -1);
+	index_tree_add(index_bytes_tree, is->slot, -(long long)ie->size);
+	index_put(ie->class, is);
+	ie->slot = NULL;
+	ie->class = INDEX_NO_CLASS;
+	index_num_files--;
+}
+
+static int index_grow(unsigned int id)
+{
+	struct index_entry *entries;
+	unsigned int num = index_max_entries ? index_max_entries : 4096;
+
+	while (num <= id)
+		num *= 2;
+	entries = realloc(index_entries, num * sizeof(struct index_entry));
+	if (!entries)
+		return -ENOMEM;
+	memset(entries + index_max_entries, 0,
+	       (num - index_max_entries) * sizeof(struct index_entry));
+	index_entries = entries;
+	index_max_entries = num;
+	return 0;
+}
+
+/*
+ * Record file @id with @size bytes, last accessed at @atime.
+ */
+int index_update(unsigned int id, unsigned long long size, time_t atime)
+{
+	struct index_entry *ie;
+	struct index_slot *is;
+	long long slot = index_time_slot(atime);
+	int class = index_class(size);
+
+	pthread_mutex_lock(&index_lock);
+	if (index_init() < 0 ||
+	    (id >= index_max_entries && index_grow(id) < 0)) {
+		pthread_mutex_unlock(&index_lock);
+		err("path %u: cannot allocate index entry", id);
+		return -ENOMEM;
+	}
+	ie = &index_entries[id];
+	if (ie->slot) {
+		if (ie->class == class && ie->slot->slot == slot) {
+			index_tree_add(index_bytes_tree, slot,
+				       (long long)size - (long long)ie->size);
+			ie->size = size;
+			ie->atime = atime;
+			pthread_mutex_unlock(&index_lock);
+			return 0;
+		}
+		index_unlink(id);
+	}
+	is = index_get(class, slot);
+	if (!is)
+		goto out_nomem;
+	if (is->num == is->max) {
+		unsigned int max = is->max ? is->max * 2 : 4;
+		unsigned int *ids;
+
+		ids = realloc(is->ids, max * sizeof(unsigned int));
+		if (!ids) {
+			index_put(class, is);
+			goto out_nomem;
+		}
+		is->ids = ids;
+		is->max = max;
+	}
+	ie->slot = is;
+	ie->pos = is->num;
+	ie->class = class;
+	ie->size = size;
+	ie->atime = atime;
+	is->ids[is->num++] = id;
+	index_tree_add(index_files_tree, slot, 1);
+	index_tree_add(index_bytes_tree, slot, size);
+	index_num_files++;
+	pthread_mutex_unlock(&index_lock);
+	return 0;
+
+out_nomem:
+	pthread_mutex_unlock(&index_lock);
+	err("path %u: cannot allocate index slot", id);
+	return -ENOMEM;
+}
+
+void index_remove(unsigned int id)
+{
+	pthread_mutex_lock(&index_lock);
+	if (id < index_max_entries) {
+		if (index_entries[id].slot)
+			index_unlink(id);
+		index_entries[id].retry = 0;
+	}
+	pthread_mutex_unlock(&index_lock);
+}
+
+/*
+ * Do not return file @id from index_coldest() before @retry;
+ * a @retry of 0 clears the deferral.
+ */
+void index_defer(unsigned int id, time_t retry)
+{
+	pthread_mutex_lock(&index_lock);
+	if (index_init() == 0 &&
+	    (id < index_max_entries || index_grow(id) == 0))
+		index_entries[id].retry = retry;
+	pthread_mutex_unlock(&index_lock);
+}
+
+/*
+ * Have @fn fill in the index the first time it is queried.
+ * Updates in the meantime go to the index as usual; @fn has to
+ * cope with files which have been recorded already.
+ */
+void index_set_loader(void (*fn)(void))
+{
+	__atomic_store_n(&index_loader, fn, __ATOMIC_RELEASE);
+}
+
+/* Run the loader if it has not been run yet */
+void index_load(void)
+{
+	void (*fn)(void);
+
+	if (!__atomic_load_n(&index_loader, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&index_load_lock);
+	fn = index_loader;
+	if (fn) {
+		fn();
+		__atomic_store_n(&index_loader, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&index_load_lock);
+}
+
+static int index_compare(const void *a, const void *b)
+{
+	const struct index_result *r1 = a, *r2 = b;
+
+	if (r1->atime < r2->atime)
+		return -1;
+	if (r1->atime > r2->atime)
+		return 1;
+	return 0;
+}
+
+/* Restore the max-heap on atime of @num results below @pos */
+static void index_heap_down(struct index_result *heap, int num, int pos)
+{
+	struct index_result tmp;
+	int child;
+
+	while ((child = 2 * pos + 1) < num) {
+		if (child + 1 < num &&
+		    heap[child + 1].atime > heap[child].atime)
+			child++;
+		if (heap[pos].atime >= heap[child].atime)
+			break;
+		tmp = heap[pos];
+		heap[pos] = heap[child];
+		heap[child] = tmp;
+		pos = child;
+	}
+}
+
+static void index_heap_up(struct index_result *heap, int pos)
+{
+	struct index_result tmp;
+	int parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (heap[parent].atime >= heap[pos].atime)
+			break;
+		tmp = heap[pos];
+		heap[pos] = heap[parent];
+		heap[parent] = tmp;
+		pos = parent;
+	}
+}
+
+/*
+ * Find the @num files with the oldest access time which are at
+ * least @min_size bytes large and located below @prefix,
+ * skipping files which have been deferred. The results are
+ * stored in @res, oldest first; returns the number of files
+ * found.
+ */
+int index_coldest(unsigned int prefix, unsigned long long min_size,
+		  struct index_result *res, int num)
+{
+	struct index_slot *cur[INDEX_CLASSES];
+	struct path_filter *pf = NULL;
+	int class, min_class = index_class(min_size), found = 0;
+	time_t now = time(NULL);
+
+	if (num <= 0)
+		return 0;
+	index_load();
+	if (prefix != PATH_ID_ROOT) {
+		pf = malloc(sizeof(struct path_filter));
+		if (!pf)
+			return 0;
+		path_filter_begin(pf, prefix);
+	}
+	pthread_mutex_lock(&index_lock);
+	if (!index_bytes_tree)
+		goto out_unlock;
+	for (class = min_class; class < INDEX_CLASSES; class++)
+		cur[class] = index_head[class]->next[0];
+	while (found < num) {
+		/*
+		 * Files within a time slot are unordered, so the
+		 * oldest ones of the slot are selected with a heap.
+		 */
+		struct index_result *heap = &res[found];
+		int need = num - found, cnt = 0;
+		long long slot = -1;
+
+		/* Next time slot across all matching size classes */
+		for (class = min_class; class < INDEX_CLASSES; class++) {
+			if (cur[class] && (slot < 0 || cur[class]->slot < slot))
+				slot = cur[class]->slot;
+		}
+		if (slot < 0)
+			break;
+		for (class = min_class; class < INDEX_CLASSES; class++) {
+			struct index_slot *is = cur[class];
+			unsigned int i;
+
+			if (!is || is->slot != slot)
+				continue;
+			for (i = 0; i < is->num; i++) {
+				unsigned int id = is->ids[i];
+				struct index_entry *ie = &index_entries[id];
+
+				if (ie->size < min_size || ie->retry > now)
+					continue;
+				if (cnt == need && ie->atime >= heap[0].atime)
+					continue;
+				if (pf && !path_filter_under(pf, id))
+					continue;
+				if (cnt < need) {
+					heap[cnt].path = id;
+					heap[cnt].size = ie->size;
+					heap[cnt].atime = ie->atime;
+					index_heap_up(heap, cnt++);
+				} else {
+					heap[0].path = id;
+					heap[0].size = ie->size;
+					heap[0].atime = ie->atime;
+					index_heap_down(heap, cnt, 0);
+				}
+			}
+			cur[class] = is->next[0];
+		}
+		qsort(heap, cnt, sizeof(struct index_result), index_compare);
+		found += cnt;
+	}
+out_unlock:
+	pthread_mutex_unlock(&index_lock);
+	if (pf) {
+		path_filter_end(pf);
+		free(pf);
+	}
+	return found;
+}
+
+/*
+ * Fill in the number of files and bytes by age. @ages holds
+ * @num ascending ages in seconds; bucket i counts files last
+ * accessed between ages[i - 1] and ages[i] ago, and bucket
+ * @num everything older. Ages are rounded to the index time
+ * slot granularity.
+ */
+int index_histogram(const time_t *ages, int num,
+		    unsigned long long *files, unsigned long long *bytes)
+{
+	unsigned long long prev_files, prev_bytes;
+	time_t now = time(NULL);
+	int i;
+
+	index_load();
+	pthread_mutex_lock(&index_lock);
+	if (!index_bytes_tree) {
+		pthread_mutex_unlock(&index_lock);
+		memset(files, 0, (num + 1) * sizeof(unsigned long long));
+		memset(bytes, 0, (num + 1) * sizeof(unsigned long long));
+		return 0;
+	}
+	/* Walk from the newest bucket to the oldest */
+	prev_files = index_tree_sum(index_files_tree, INDEX_MAX_SLOTS);
+	prev_bytes = index_tree_sum(index_bytes_tree, INDEX_MAX_SLOTS);
+	for (i = 0; i < num; i++) {
+		long long slot = index_time_slot(now - ages[i]);
+		unsigned long long f, b;
+
+		f = index_tree_sum(index_files_tree, slot);
+		b = index_tree_sum(index_bytes_tree, slot);
+		files[i] = prev_files - f;
+		bytes[i] = prev_bytes - b;
+		prev_files = f;
+		prev_bytes = b;
+	}
+	files[num] = prev_files;
+	bytes[num] = prev_bytes;
+	pthread_mutex_unlock(&index_lock);
+	return 0;
+}
+
+unsigned int index_files(void)
+{
+	index_load();
+	return index_num_files;
+}
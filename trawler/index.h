@@ -0,0 +1,21 @@
+#ifndef _INDEX_H
+#define _INDEX_H
+
+struct index_result {
+	unsigned int path;
+	unsigned long long size;
+	time_t atime;
+};
+
+int index_update(unsigned int id, unsigned long long size, time_t atime);
+void index_remove(unsigned int id);
+void index_defer(unsigned int id, time_t retry);
+int index_coldest(unsigned int prefix, unsigned long long min_size,
+		  struct index_result *res, int num);
+int index_histogram(const time_t *ages, int num,
+		    unsigned long long *files, unsigned long long *bytes);
+unsigned int index_files(void);
+void index_set_loader(void (*fn)(void));
+void index_load(void);
+
+#endif /* _INDEX_H */
@@ -0,0 +1,197 @@
+/*
+ * mapfile.c
+ *
+ * Growable memory-mapped arrays for trawler.
+ *
+ * Each array is a file starting with a small header holding
+ * a magic number, a version, the element size and the number
+ * of elements in use, followed by the elements themselves.
+ * The file is mapped shared, so updates go to the page cache
+ * directly and the array is available again immediately
+ * after reopening. Without a directory the array is backed
+ * by anonymous memory instead.
+ *
+ * A file with an unexpected header is discarded and started
+ * afresh. The contents of a file which has not been closed
+ * cleanly are kept, but flagged, so that the caller can check
+ * them before use.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mapfile.h"
+#include "logging.h"
+
+#define LOG_AREA "mapfile"
+
+static size_t mapfile_size(struct mapfile *mf, size_t nelem)
+{
+	size_t pgsize = sysconf(_SC_PAGESIZE);
+	size_t size;
+
+	size = sizeof(struct mapfile_header) + nelem * mf->elem_size;
+	return (size + pgsize - 1) & ~(pgsize - 1);
+}
+
+static void mapfile_init_header(struct mapfile *mf, unsigned int magic)
+{
+	memset(mf->hdr, 0, sizeof(struct mapfile_header));
+	mf->hdr->magic = magic;
+	mf->hdr->version = MAPFILE_VERSION;
+	mf->hdr->elem_size = mf->elem_size;
+}
+
+/*
+ * Map the array @name in directory @dir with room for at least
+ * @nelem elements of @elem_size bytes. Returns 1 if existing
+ * contents have been found, 0 for a new array, or a negative
+ * error number.
+ */
+int mapfile_open(struct mapfile *mf, const char *dir, const char *name,
+		 unsigned int magic, unsigned int elem_size, size_t nelem)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	size_t size;
+	int ret, valid = 0;
+
+	mf->fd = -1;
+	mf->unclean = 0;
+	mf->elem_size = elem_size;
+	size = mapfile_size(mf, nelem);
+	if (!dir) {
+		mf->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mf->hdr == MAP_FAILED) {
+			mf->hdr = NULL;
+			err("%s: cannot allocate %zu bytes", name, size);
+			return -ENOMEM;
+		}
+		mf->size = size;
+		mf->data = mf->hdr + 1;
+		mapfile_init_header(mf, magic);
+		return 0;
+	}
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX) {
+		err("%s/%s: pathname overflow", dir, name);
+		return -ENAMETOOLONG;
+	}
+	mf->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (mf->fd < 0) {
+		ret = -errno;
+		err("%s: cannot open, error %d", path, -ret);
+		return ret;
+	}
+	if (fstat(mf->fd, &st) < 0) {
+		ret = -errno;
+		err("%s: cannot stat, error %d", path, -ret);
+		goto out_close;
+	}
+	if ((size_t)st.st_size > size)
+		size = st.st_size;
+	if (ftruncate(mf->fd, size) < 0) {
+		ret = -errno;
+		err("%s: cannot resize to %zu bytes, error %d",
+		    path, size, -ret);
+		goto out_close;
+	}
+	mf->hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       mf->fd, 0);
+	if (mf->hdr == MAP_FAILED) {
+		ret = -errno;
+		mf->hdr = NULL;
+		err("%s: cannot map, error %d", path, -ret);
+		goto out_close;
+	}
+	mf->size = size;
+	mf->data = mf->hdr + 1;
+	if (mf->hdr->magic == magic &&
+	    mf->hdr->version == MAPFILE_VERSION &&
+	    mf->hdr->elem_size == elem_size &&
+	    mf->hdr->count <= (size - sizeof(struct mapfile_header)) /
+	    elem_size) {
+		valid = 1;
+		if (!(mf->hdr->flags & MAPFILE_CLEAN)) {
+			info("%s: not closed cleanly", path);
+			mf->unclean = 1;
+		}
+	} else if (st.st_size)
+		info("%s: discarding stale contents", path);
+	if (!valid)
+		mapfile_init_header(mf, magic);
+	/* Contents are unreliable until closed cleanly */
+	mf->hdr->flags &= ~MAPFILE_CLEAN;
+	msync(mf->hdr, sizeof(struct mapfile_header), MS_SYNC);
+	return valid;
+
+out_close:
+	close(mf->fd);
+	mf->fd = -1;
+	return ret;
+}
+
+/*
+ * Make room for at least @nelem elements. The mapping might
+ * move, so callers must not keep pointers into the array.
+ */
+int mapfile_grow(struct mapfile *mf, size_t nelem)
+{
+	size_t size = mapfile_size(mf, nelem);
+	void *addr;
+
+	if (size <= mf->size)
+		return 0;
+	if (mf->fd >= 0 && ftruncate(mf->fd, size) < 0) {
+		err("cannot resize mapping to %zu bytes, error %d",
+		    size, errno);
+		return -errno;
+	}
+	addr = mremap(mf->hdr, mf->size, size, MREMAP_MAYMOVE);
+	if (addr == MAP_FAILED) {
+		err("cannot remap %zu bytes, error %d", size, errno);
+		return -ENOMEM;
+	}
+	mf->hdr = addr;
+	mf->data = mf->hdr + 1;
+	mf->size = size;
+	return 0;
+}
+
+/*
+ * Drop all elements, e.g. when related arrays turned
+ * out to be inconsistent.
+ */
+void mapfile_reset(struct mapfile *mf)
+{
+	mf->hdr->count = 0;
+	mf->hdr->aux = 0;
+}
+
+void mapfile_close(struct mapfile *mf, int clean)
+{
+	if (!mf->hdr)
+		return;
+	if (mf->fd >= 0) {
+		msync(mf->hdr, mf->size, MS_SYNC);
+		if (clean) {
+			mf->hdr->flags |= MAPFILE_CLEAN;
+			msync(mf->hdr, sizeof(struct mapfile_header),
+			      MS_SYNC);
+		}
+	}
+	munmap(mf->hdr, mf->size);
+	mf->hdr = NULL;
+	mf->data = NULL;
+	if (mf->fd >= 0)
+		close(mf->fd);
+	mf->fd = -1;
+}
@@ -0,0 +1,34 @@
+#ifndef _MAPFILE_H
+#define _MAPFILE_H
+
+#define MAPFILE_VERSION 1
+
+#define MAPFILE_CLEAN 0x1
+
+struct mapfile_header {
+	unsigned int magic;
+	unsigned short version;
+	unsigned short flags;
+	unsigned int elem_size;
+	unsigned int reserved;
+	unsigned long long count;
+	unsigned long long aux;
+};
+
+struct mapfile {
+	int fd;
+	/* Restored from a file which has not been closed cleanly */
+	int unclean;
+	unsigned int elem_size;
+	size_t size;
+	struct mapfile_header *hdr;
+	void *data;
+};
+
+int mapfile_open(struct mapfile *mf, const char *dir, const char *name,
+		 unsigned int magic, unsigned int elem_size, size_t nelem);
+int mapfile_grow(struct mapfile *mf, size_t nelem);
+void mapfile_reset(struct mapfile *mf);
+void mapfile_close(struct mapfile *mf, int clean);
+
+#endif /* _MAPFILE_H */
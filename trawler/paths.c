@@ -0,0 +1,629 @@
+/*
+ * paths.c
+ *
+ * Interned pathname storage for trawler.
+ *
+ * Every path component is stored once as a node holding the
+ * id of its parent directory and the offset of its name in a
+ * shared name arena. The children of each node are linked
+ * together, so directories can be enumerated from the table.
+ * Nodes are addressed by a 32-bit id and looked up by
+ * (parent, name) through a hash table; full pathnames are
+ * rebuilt on demand by walking the parent ids.
+ * Node 0 is the root directory '/'.
+ *
+ * Nodes are not freed while the table is in use, so ids stay
+ * valid for as long as anyone might hold them. When the table
+ * is saved, nodes which are no longer needed are dropped and
+ * the others renumbered in order, reclaiming the ids and names
+ * of deleted files. The node array, the name arena and the hash
+ * table are memory-mapped arrays, so the table can be stored
+ * alongside the catalog and ids remain valid across restarts.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include "paths.h"
+#include "mapfile.h"
+#include "logging.h"
+
+#define LOG_AREA "paths"
+
+#define PATH_MIN_NODES 4096
+#define PATH_MIN_NAMES 65536
+
+#define PATH_NODE_MAGIC 0x7041544e
+#define PATH_NAME_MAGIC 0x7041544d
+#define PATH_HASH_MAGIC 0x70415448
+
+struct path_node {
+	unsigned int parent;
+	unsigned int name;
+	unsigned int next;
+	unsigned int hash;
+	unsigned int child;
+	unsigned int sibling;
+};
+
+static struct mapfile path_node_map;
+static struct mapfile path_name_map;
+static struct mapfile path_hash_map;
+static struct path_node *path_nodes;
+static unsigned int path_num_nodes;
+static unsigned int path_max_nodes;
+static char *path_names;
+static size_t path_names_len;
+static size_t path_names_size;
+static unsigned int *path_buckets;
+static unsigned int path_num_buckets;
+static pthread_rwlock_t path_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static unsigned int path_hash(unsigned int parent, const char *name,
+			      size_t len)
+{
+	unsigned int hash = 2166136261u ^ parent;
+
+	while (len--) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static int path_resize(unsigned int buckets)
+{
+	unsigned int i, b;
+
+	if (mapfile_grow(&path_hash_map, buckets) < 0)
+		return -ENOMEM;
+	path_buckets = path_hash_map.data;
+	for (i = 0; i < buckets; i++)
+		path_buckets[i] = PATH_ID_INVALID;
+	/* Node 0 is the root and never hashed, nor are cut off nodes */
+	for (i = 1; i < path_num_nodes; i++) {
+		if (path_nodes[i].parent == PATH_ID_INVALID)
+			continue;
+		b = path_nodes[i].hash & (buckets - 1);
+		path_nodes[i].next = path_buckets[b];
+		path_buckets[b] = i;
+	}
+	path_num_buckets = buckets;
+	path_hash_map.hdr->count = buckets;
+	return 0;
+}
+
+static void path_sync(void)
+{
+	path_node_map.hdr->count = path_num_nodes;
+	path_name_map.hdr->count = path_names_len;
+}
+
+/*
+ * Check the table after an unclean shutdown. Damaged nodes, and
+ * the nodes below them, are cut off by setting their parent to
+ * PATH_ID_INVALID; path_compact() drops them later. The child
+ * lists and the hash table are rebuilt from the parent ids.
+ * Returns -EINVAL if the table cannot be used at all.
+ */
+static int path_check(void)
+{
+	struct path_node *pn;
+	unsigned int i, buckets = PATH_MIN_NODES, bad = 0;
+	const char *name;
+	size_t len;
+
+	if (!path_num_nodes || path_names_len < 1 ||
+	    path_names_len > path_names_size ||
+	    path_names[path_names_len - 1] != '\0' ||
+	    path_nodes[0].parent != PATH_ID_INVALID ||
+	    path_nodes[0].name != 0)
+		return -EINVAL;
+	path_nodes[0].child = PATH_ID_INVALID;
+	path_nodes[0].sibling = PATH_ID_INVALID;
+	/* Parents are created first, so are checked first */
+	for (i = 1; i < path_num_nodes; i++) {
+		pn = &path_nodes[i];
+		pn->child = PATH_ID_INVALID;
+		pn->sibling = PATH_ID_INVALID;
+		if (pn->parent >= i || pn->name >= path_names_len ||
+		    (pn->parent != PATH_ID_ROOT &&
+		     path_nodes[pn->parent].parent == PATH_ID_INVALID))
+			goto cut;
+		name = path_names + pn->name;
+		len = strlen(name);
+		if (!len || pn->hash != path_hash(pn->parent, name, len))
+			goto cut;
+		pn->sibling = path_nodes[pn->parent].child;
+		path_nodes[pn->parent].child = i;
+		continue;
+cut:
+		pn->parent = PATH_ID_INVALID;
+		bad++;
+	}
+	if (bad)
+		info("Cut off %u damaged path entries", bad);
+	while (buckets < path_num_nodes)
+		buckets *= 2;
+	return path_resize(buckets);
+}
+
+/*
+ * Open the path table stored in directory @dir, or an in-memory
+ * table if @dir is NULL. Returns 1 if an existing table has been
+ * restored, 2 if it has been restored after an unclean shutdown,
+ * 0 if a new table has been created, or a negative error number.
+ */
+int path_open(const char *dir)
+{
+	int ret, restored = 1;
+
+	if (path_nodes)
+		return dir ? -EBUSY : 0;
+	ret = mapfile_open(&path_node_map, dir, "paths", PATH_NODE_MAGIC,
+			   sizeof(struct path_node), PATH_MIN_NODES);
+	if (ret < 0)
+		return ret;
+	restored &= ret;
+	ret = mapfile_open(&path_name_map, dir, "names", PATH_NAME_MAGIC,
+			   1, PATH_MIN_NAMES);
+	if (ret < 0)
+		goto out_nodes;
+	restored &= ret;
+	ret = mapfile_open(&path_hash_map, dir, "hash", PATH_HASH_MAGIC,
+			   sizeof(unsigned int), PATH_MIN_NODES);
+	if (ret < 0)
+		goto out_names;
+	restored &= ret;
+
+	path_nodes = path_node_map.data;
+	path_max_nodes = (path_node_map.size -
+			  sizeof(struct mapfile_header)) /
+		sizeof(struct path_node);
+	path_names = path_name_map.data;
+	path_names_size = path_name_map.size - sizeof(struct mapfile_header);
+	path_buckets = path_hash_map.data;
+	if (restored && path_node_map.hdr->count &&
+	    path_hash_map.hdr->count) {
+		path_num_nodes = path_node_map.hdr->count;
+		path_names_len = path_name_map.hdr->count;
+		path_num_buckets = path_hash_map.hdr->count;
+		if (!path_node_map.unclean && !path_name_map.unclean &&
+		    !path_hash_map.unclean) {
+			info("Restored %u path entries", path_num_nodes);
+			return 1;
+		}
+		if (path_check() == 0) {
+			info("Recovered %u path entries", path_num_nodes);
+			return 2;
+		}
+		info("Discarding damaged path table");
+	}
+	mapfile_reset(&path_node_map);
+	mapfile_reset(&path_name_map);
+	mapfile_reset(&path_hash_map);
+	path_names[0] = '\0';
+	path_names_len = 1;
+	path_nodes[0].parent = PATH_ID_INVALID;
+	path_nodes[0].name = 0;
+	path_nodes[0].next = PATH_ID_INVALID;
+	path_nodes[0].hash = 0;
+	path_nodes[0].child = PATH_ID_INVALID;
+	path_nodes[0].sibling = PATH_ID_INVALID;
+	path_num_nodes = 1;
+	path_sync();
+	ret = path_resize(PATH_MIN_NODES);
+	if (ret < 0) {
+		path_close(0);
+		return ret;
+	}
+	return 0;
+
+out_names:
+	mapfile_close(&path_name_map, 0);
+out_nodes:
+	mapfile_close(&path_node_map, 0);
+	return ret;
+}
+
+void path_close(int clean)
+{
+	pthread_rwlock_wrlock(&path_lock);
+	mapfile_close(&path_hash_map, clean);
+	mapfile_close(&path_name_map, clean);
+	mapfile_close(&path_node_map, clean);
+	path_nodes = NULL;
+	path_names = NULL;
+	path_buckets = NULL;
+	path_num_nodes = 0;
+	path_num_buckets = 0;
+	pthread_rwlock_unlock(&path_lock);
+}
+
+static int path_init(void)
+{
+	if (path_nodes)
+		return 0;
+	return path_open(NULL);
+}
+
+static unsigned int path_find(unsigned int parent, const char *name,
+			      size_t len, unsigned int hash)
+{
+	unsigned int id;
+
+	if (!path_num_buckets)
+		return PATH_ID_INVALID;
+	for (id = path_buckets[hash & (path_num_buckets - 1)];
+	     id != PATH_ID_INVALID; id = path_nodes[id].next) {
+		struct path_node *pn = &path_nodes[id];
+
+		if (pn->hash == hash && pn->parent == parent &&
+		    !strncmp(path_names + pn->name, name, len) &&
+		    path_names[pn->name + len] == '\0')
+			return id;
+	}
+	return PATH_ID_INVALID;
+}
+
+static unsigned int path_add(unsigned int parent, const char *name,
+			     size_t len, unsigned int hash)
+{
+	struct path_node *pn;
+	unsigned int id, b;
+
+	if (path_init() < 0 || parent >= path_num_nodes)
+		return PATH_ID_INVALID;
+	id = path_find(parent, name, len, hash);
+	if (id != PATH_ID_INVALID)
+		return id;
+	if (path_num_nodes == PATH_ID_INVALID)
+		return PATH_ID_INVALID;
+	if (path_num_nodes == path_max_nodes) {
+		if (mapfile_grow(&path_node_map,
+				 (size_t)path_max_nodes * 2) < 0)
+			return PATH_ID_INVALID;
+		path_nodes = path_node_map.data;
+		path_max_nodes *= 2;
+	}
+	if (path_names_len + len + 1 > path_names_size) {
+		size_t size = path_names_size * 2;
+
+		while (path_names_len + len + 1 > size)
+			size *= 2;
+		if (path_names_len + len + 1 > UINT_MAX ||
+		    mapfile_grow(&path_name_map, size) < 0)
+			return PATH_ID_INVALID;
+		path_names = path_name_map.data;
+		path_names_size = size;
+	}
+	id = path_num_nodes++;
+	pn = &path_nodes[id];
+	pn->parent = parent;
+	pn->name = path_names_len;
+	pn->hash = hash;
+	pn->child = PATH_ID_INVALID;
+	pn->sibling = path_nodes[parent].child;
+	path_nodes[parent].child = id;
+	memcpy(path_names + path_names_len, name, len);
+	path_names[path_names_len + len] = '\0';
+	path_names_len += len + 1;
+	path_sync();
+	if (path_num_nodes > path_num_buckets &&
+	    path_resize(path_num_buckets * 2) == 0)
+		return id;
+	b = hash & (path_num_buckets - 1);
+	pn->next = path_buckets[b];
+	path_buckets[b] = id;
+	return id;
+}
+
+static unsigned int path_get(unsigned int parent, const char *name,
+			     size_t len, int create)
+{
+	unsigned int id, hash = path_hash(parent, name, len);
+
+	pthread_rwlock_rdlock(&path_lock);
+	id = path_find(parent, name, len, hash);
+	pthread_rwlock_unlock(&path_lock);
+	if (id != PATH_ID_INVALID || !create)
+		return id;
+	pthread_rwlock_wrlock(&path_lock);
+	id = path_add(parent, name, len, hash);
+	pthread_rwlock_unlock(&path_lock);
+	if (id == PATH_ID_INVALID)
+		err("%.*s: cannot allocate path entry", (int)len, name);
+	return id;
+}
+
+/*
+ * Return the id of entry @name in directory @parent,
+ * creating it if required.
+ */
+unsigned int path_intern_at(unsigned int parent, const char *name)
+{
+	return path_get(parent, name, strlen(name), 1);
+}
+
+static unsigned int path_walk(const char *path, int create)
+{
+	unsigned int id = PATH_ID_ROOT;
+	const char *p = path, *e;
+
+	if (*p != '/')
+		return PATH_ID_INVALID;
+	while (*p) {
+		while (*p == '/')
+			p++;
+		if (!*p)
+			break;
+		e = strchr(p, '/');
+		if (!e)
+			e = p + strlen(p);
+		id = path_get(id, p, e - p, create);
+		if (id == PATH_ID_INVALID)
+			break;
+		p = e;
+	}
+	return id;
+}
+
+/*
+ * Return the id of the absolute pathname @path,
+ * creating all components if required.
+ */
+unsigned int path_intern(const char *path)
+{
+	return path_walk(path, 1);
+}
+
+/*
+ * Return the id of the absolute pathname @path, or
+ * PATH_ID_INVALID if it has not been interned.
+ */
+unsigned int path_lookup(const char *path)
+{
+	return path_walk(path, 0);
+}
+
+unsigned int path_parent(unsigned int id)
+{
+	unsigned int parent = PATH_ID_INVALID;
+
+	pthread_rwlock_rdlock(&path_lock);
+	if (id < path_num_nodes)
+		parent = path_nodes[id].parent;
+	pthread_rwlock_unlock(&path_lock);
+	return parent;
+}
+
+/*
+ * Copy the last component of @id into @buf.
+ */
+int path_basename(unsigned int id, char *buf, size_t len)
+{
+	int ret = -EINVAL;
+
+	pthread_rwlock_rdlock(&path_lock);
+	if (id < path_num_nodes) {
+		const char *name = path_names + path_nodes[id].name;
+
+		if (strlen(name) < len) {
+			strcpy(buf, name);
+			ret = 0;
+		} else
+			ret = -ENAMETOOLONG;
+	}
+	pthread_rwlock_unlock(&path_lock);
+	return ret;
+}
+
+/*
+ * Rebuild the full pathname of @id into @buf.
+ * Returns the length of the pathname or a negative error.
+ */
+int path_name(unsigned int id, char *buf, size_t len)
+{
+	unsigned int ids[PATH_MAX / 2];
+	int depth = 0, pos = 0;
+
+	pthread_rwlock_rdlock(&path_lock);
+	if (id >= path_num_nodes) {
+		pthread_rwlock_unlock(&path_lock);
+		return -EINVAL;
+	}
+	while (id != PATH_ID_ROOT && depth < PATH_MAX / 2) {
+		ids[depth++] = id;
+		id = path_nodes[id].parent;
+	}
+	if (!depth) {
+		if (len < 2) {
+			pthread_rwlock_unlock(&path_lock);
+			return -ENAMETOOLONG;
+		}
+		buf[pos++] = '/';
+	}
+	while (depth--) {
+		const char *name = path_names + path_nodes[ids[depth]].name;
+		size_t nlen = strlen(name);
+
+		if (pos + nlen + 2 > len) {
+			pthread_rwlock_unlock(&path_lock);
+			return -ENAMETOOLONG;
+		}
+		buf[pos++] = '/';
+		memcpy(buf + pos, name, nlen);
+		pos += nlen;
+	}
+	buf[pos] = '\0';
+	pthread_rwlock_unlock(&path_lock);
+	return pos;
+}
+
+/*
+ * Call @fn for every entry in directory @id until @fn
+ * returns non-zero. @fn must not create new paths.
+ */
+int path_for_each_child(unsigned int id,
+			int (*fn)(unsigned int, void *), void *arg)
+{
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&path_lock);
+	if (id < path_num_nodes) {
+		for (id = path_nodes[id].child; id != PATH_ID_INVALID;
+		     id = path_nodes[id].sibling) {
+			ret = fn(id, arg);
+			if (ret)
+				break;
+		}
+	}
+	pthread_rwlock_unlock(&path_lock);
+	return ret;
+}
+
+/*
+ * Check whether @id is @ancestor or located below it.
+ */
+int path_is_under(unsigned int id, unsigned int ancestor)
+{
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&path_lock);
+	while (id < path_num_nodes) {
+		if (id == ancestor) {
+			ret = 1;
+			break;
+		}
+		id = path_nodes[id].parent;
+	}
+	pthread_rwlock_unlock(&path_lock);
+	return ret;
+}
+
+/*
+ * Start checking ids against @ancestor with path_filter_under().
+ * The table is locked for reading until path_filter_end(), so
+ * the caller may hold other locks taken below the path lock.
+ */
+void path_filter_begin(struct path_filter *pf, unsigned int ancestor)
+{
+	pthread_rwlock_rdlock(&path_lock);
+	pf->ancestor = ancestor;
+	memset(pf->ids, 0xff, sizeof(pf->ids));
+}
+
+/*
+ * Check whether @id is the ancestor of @pf or located below it.
+ * The result is remembered for the directories passed on the
+ * way up, so files in the same directories only take a lookup.
+ */
+int path_filter_under(struct path_filter *pf, unsigned int id)
+{
+	unsigned int dirs[PATH_FILTER_DEPTH], slot;
+	int i, n = 0, ret = 0;
+
+	while (id < path_num_nodes) {
+		if (id == pf->ancestor) {
+			ret = 1;
+			break;
+		}
+		slot = id % PATH_FILTER_SIZE;
+		if (pf->ids[slot] == id) {
+			ret = pf->under[slot];
+			break;
+		}
+		if (n < PATH_FILTER_DEPTH)
+			dirs[n++] = id;
+		id = path_nodes[id].parent;
+	}
+	/* The first one is the file itself */
+	for (i = 1; i < n; i++) {
+		slot = dirs[i] % PATH_FILTER_SIZE;
+		pf->ids[slot] = dirs[i];
+		pf->under[slot] = ret;
+	}
+	return ret;
+}
+
+void path_filter_end(struct path_filter *pf)
+{
+	pthread_rwlock_unlock(&path_lock);
+}
+
+/*
+ * Drop all nodes for which @keep returns 0 and which have no
+ * kept nodes below them, and renumber the remaining nodes in
+ * order. Returns an array with the new id of every previous
+ * node, or PATH_ID_INVALID for dropped nodes, to be freed by
+ * the caller, and the new number of nodes in @num. Nobody may
+ * hold any ids while this runs.
+ */
+unsigned int *path_compact(int (*keep)(unsigned int, void *), void *arg,
+			   unsigned int *num)
+{
+	struct path_node pn;
+	unsigned int *map, i, id = 0;
+	size_t len, names_len = 1;
+
+	pthread_rwlock_wrlock(&path_lock);
+	if (!path_nodes || !(map = calloc(path_num_nodes,
+					  sizeof(unsigned int)))) {
+		pthread_rwlock_unlock(&path_lock);
+		return NULL;
+	}
+	/* Parents are created first, so have lower ids */
+	map[PATH_ID_ROOT] = 1;
+	for (i = path_num_nodes - 1; i > PATH_ID_ROOT; i--) {
+		if (!map[i] && keep(i, arg))
+			map[i] = 1;
+		if (map[i])
+			map[path_nodes[i].parent] = 1;
+	}
+	/* Both nodes and names only ever move to lower offsets */
+	for (i = 0; i < path_num_nodes; i++) {
+		if (!map[i]) {
+			map[i] = PATH_ID_INVALID;
+			continue;
+		}
+		map[i] = id;
+		pn = path_nodes[i];
+		pn.child = PATH_ID_INVALID;
+		pn.sibling = PATH_ID_INVALID;
+		if (id != PATH_ID_ROOT) {
+			len = strlen(path_names + pn.name) + 1;
+			memmove(path_names + names_len,
+				path_names + pn.name, len);
+			pn.name = names_len;
+			names_len += len;
+			pn.parent = map[pn.parent];
+			pn.sibling = path_nodes[pn.parent].child;
+			path_nodes[pn.parent].child = id;
+		}
+		path_nodes[id++] = pn;
+	}
+	if (id < path_num_nodes)
+		info("Dropped %u of %u path entries",
+		     path_num_nodes - id, path_num_nodes);
+	path_num_nodes = id;
+	path_names_len = names_len;
+	path_sync();
+	path_resize(path_num_buckets);
+	pthread_rwlock_unlock(&path_lock);
+	*num = id;
+	return map;
+}
+
+void path_stats(void)
+{
+	pthread_rwlock_rdlock(&path_lock);
+	info("%u path entries, %zu bytes of names, %zu bytes total",
+	     path_num_nodes, path_names_len, path_node_map.size +
+	     path_name_map.size + path_hash_map.size);
+	pthread_rwlock_unlock(&path_lock);
+}
@@ -0,0 +1,35 @@
+#ifndef _PATHS_H
+#define _PATHS_H
+
+#define PATH_ID_ROOT 0
+#define PATH_ID_INVALID ((unsigned int)-1)
+
+#define PATH_FILTER_SIZE 1024
+#define PATH_FILTER_DEPTH 64
+
+/* Results of path_filter_under() for recently seen directories */
+struct path_filter {
+	unsigned int ancestor;
+	unsigned int ids[PATH_FILTER_SIZE];
+	unsigned char under[PATH_FILTER_SIZE];
+};
+
+int path_open(const char *dir);
+void path_close(int clean);
+unsigned int path_intern(const char *path);
+unsigned int path_intern_at(unsigned int parent, const char *name);
+unsigned int path_lookup(const char *path);
+unsigned int path_parent(unsigned int id);
+int path_basename(unsigned int id, char *buf, size_t len);
+int path_name(unsigned int id, char *buf, size_t len);
+int path_for_each_child(unsigned int id,
+			int (*fn)(unsigned int, void *), void *arg);
+int path_is_under(unsigned int id, unsigned int ancestor);
+void path_filter_begin(struct path_filter *pf, unsigned int ancestor);
+int path_filter_under(struct path_filter *pf, unsigned int id);
+void path_filter_end(struct path_filter *pf);
+unsigned int *path_compact(int (*keep)(unsigned int, void *), void *arg,
+			   unsigned int *num);
+void path_stats(void);
+
+#endif /* _PATHS_H */
@@ -0,0 +1,326 @@
+/*
+ * policy.c
+ *
+ * Watermark-driven migration policy for trawler.
+ *
+ * The policy thread polls the filesystem usage of the trawled
+ * directory. Once the usage reaches the high watermark, the
+ * coldest files are taken from the index in batches and handed
+ * to dredger by a number of worker threads, until the usage drops
+ * below the low watermark again. dredger runs the migrations on
+ * its own pool of workers, so they are processed in parallel.
+ *
+ * The index orders files by timestamps only, so more candidates
+ * than needed are fetched, and the batch is made up from those
+ * with the lowest heat score. Files which are still opened
+ * regularly are migrated last, as they would most likely be
+ * recalled right away. Files which failed to migrate are
+ * deferred in the index with an increasing backoff, so the
+ * next batches continue with the remaining candidates.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/statfs.h>
+#include "cli.h"
+#include "logging.h"
+#include "paths.h"
+#include "catalog.h"
+#include "index.h"
+#include "policy.h"
+
+#define LOG_AREA "policy"
+
+/* Number of candidates to choose each batch from, per file */
+#define POLICY_OVERFETCH 4
+
+struct policy_candidate {
+	unsigned int heat;
+	int pos;
+};
+
+struct policy_batch {
+	struct index_result *cand;
+	struct policy_candidate *order;
+	struct index_result *res;
+	int num;
+	int next;
+	int migrated;
+	int skipped;
+	int failed;
+	int offline;
+	unsigned long long bytes;
+};
+
+static struct policy_config policy_cfg;
+static pthread_t policy_thr;
+static int policy_stopped;
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t policy_cond = PTHREAD_COND_INITIALIZER;
+
+/* Return the usage of the filesystem containing @dirname in percent */
+static int policy_usage(const char *dirname)
+{
+	struct statfs stfs;
+	unsigned long long used;
+
+	if (statfs(dirname, &stfs) < 0) {
+		err("%s: statfs failed, error %d", dirname, errno);
+		return -errno;
+	}
+	used = stfs.f_blocks - stfs.f_bfree;
+	if (!(used + stfs.f_bavail))
+		return 0;
+	return used * 100 / (used + stfs.f_bavail);
+}
+
+/*
+ * Migrate a single file, following the same sequence
+ * as 'dredger -m'.
+ */
+static int policy_migrate(char *path)
+{
+	int ret;
+
+	ret = cli_command(CLI_CHECK, path);
+	if (ret)
+		return ret;
+	ret = cli_command(CLI_MIGRATE, path);
+	if (ret)
+		return ret;
+	/* The file has been moved already, so do not retry it */
+	ret = cli_command(CLI_MONITOR, path);
+	if (ret)
+		err("%s: migrated, but not monitored, error %d", path, ret);
+	return 0;
+}
+
+static void *policy_worker(void *arg)
+{
+	struct policy_batch *pb = arg;
+	char path[PATH_MAX];
+	int i, ret;
+
+	while (!__atomic_load_n(&pb->offline, __ATOMIC_SEQ_CST) &&
+	       (i = __atomic_fetch_add(&pb->next, 1,
+				       __ATOMIC_SEQ_CST)) < pb->num) {
+		struct index_result *r = &pb->res[i];
+
+		if (path_name(r->path, path, PATH_MAX) < 0)
+			continue;
+		ret = policy_migrate(path);
+		if (ret < 0) {
+			/* Leave the remaining candidates in the index */
+			__atomic_store_n(&pb->offline, 1, __ATOMIC_SEQ_CST);
+			break;
+		}
+		/* Do not pick the file again until it changes */
+		if (!ret || ret == EALREADY)
+			catalog_set_migrated(r->path);
+		if (ret == EALREADY) {
+			dbg("%s: already migrated", path);
+			__atomic_add_fetch(&pb->skipped, 1, __ATOMIC_SEQ_CST);
+		} else if (ret) {
+			/* Try other candidates first */
+			err("%s: migration failed, error %d, %d failures",
+			    path, ret, catalog_set_failed(r->path));
+			__atomic_add_fetch(&pb->failed, 1, __ATOMIC_SEQ_CST);
+		} else {
+			dbg("%s: migrated %llu bytes", path, r->size);
+			__atomic_add_fetch(&pb->migrated, 1,
+					   __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&pb->bytes, r->size,
+					   __ATOMIC_SEQ_CST);
+		}
+	}
+	return NULL;
+}
+
+static int policy_compare(const void *a, const void *b)
+{
+	const struct policy_candidate *pa = a, *pb = b;
+
+	if (pa->heat != pb->heat)
+		return pa->heat < pb->heat ? -1 : 1;
+	return pa->pos - pb->pos;
+}
+
+/*
+ * Select the coldest files for the next batch, ordered by
+ * heat score first and by age second.
+ */
+static int policy_select(struct policy_batch *pb, unsigned int root)
+{
+	int i, num;
+
+	num = index_coldest(root, policy_cfg.min_size, pb->cand,
+			    policy_cfg.batch * POLICY_OVERFETCH);
+	for (i = 0; i < num; i++) {
+		pb->order[i].heat = catalog_heat(pb->cand[i].path);
+		pb->order[i].pos = i;
+	}
+	qsort(pb->order, num, sizeof(struct policy_candidate),
+	      policy_compare);
+	if (num > policy_cfg.batch)
+		num = policy_cfg.batch;
+	for (i = 0; i < num; i++)
+		pb->res[i] = pb->cand[pb->order[i].pos];
+	return num;
+}
+
+/*
+ * Migrate one batch of the coldest files.
+ * Returns the number of files taken out of the index, ie
+ * which have been migrated or were migrated already.
+ */
+static int policy_run_batch(struct policy_batch *pb, unsigned int root)
+{
+	pthread_t *thr;
+	int i, jobs = policy_cfg.jobs;
+	int done = pb->migrated + pb->skipped;
+
+	pb->num = policy_select(pb, root);
+	pb->next = 0;
+	pb->offline = 0;
+	if (!pb->num)
+		return 0;
+	if (jobs > pb->num)
+		jobs = pb->num;
+	thr = malloc(jobs * sizeof(pthread_t));
+	if (!thr) {
+		err("Cannot allocate policy workers");
+		policy_worker(pb);
+		return pb->migrated + pb->skipped - done;
+	}
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&thr[i], NULL, policy_worker, pb)) {
+			err("Failed to create policy worker %d", i);
+			break;
+		}
+	}
+	/* Work on the batch ourselves if no worker could be started */
+	if (!i)
+		policy_worker(pb);
+	while (i--)
+		pthread_join(thr[i], NULL);
+	free(thr);
+	return pb->migrated + pb->skipped - done;
+}
+
+static void *policy_thread(void *arg)
+{
+	struct policy_batch pb;
+	struct timespec deadline, starttime, endtime;
+	int active = 0;
+
+	memset(&pb, 0, sizeof(struct policy_batch));
+	pb.cand = malloc(policy_cfg.batch * POLICY_OVERFETCH *
+			 sizeof(struct index_result));
+	pb.order = malloc(policy_cfg.batch * POLICY_OVERFETCH *
+			  sizeof(struct policy_candidate));
+	pb.res = malloc(policy_cfg.batch * sizeof(struct index_result));
+	if (!pb.cand || !pb.order || !pb.res) {
+		err("Cannot allocate policy batch");
+		goto out_free;
+	}
+	pthread_mutex_lock(&policy_lock);
+	while (!policy_stopped) {
+		int usage, num;
+		double elapsed;
+
+		pthread_mutex_unlock(&policy_lock);
+		usage = policy_usage(policy_cfg.dirname);
+		if (usage >= policy_cfg.high && !active) {
+			pb.migrated = pb.skipped = pb.failed = 0;
+			pb.bytes = 0;
+			clock_gettime(CLOCK_MONOTONIC, &starttime);
+		}
+		if ((active || usage >= policy_cfg.high) &&
+		    usage > policy_cfg.low) {
+			num = policy_run_batch(&pb,
+					       path_lookup(policy_cfg.dirname));
+			if (num) {
+				if (!active)
+					info("Usage %d%% above high watermark "
+					     "%d%%, starting migration",
+					     usage, policy_cfg.high);
+				active = 1;
+				pthread_mutex_lock(&policy_lock);
+				continue;
+			}
+			if (pb.offline)
+				warn("dredger not reachable, retrying "
+				     "in %d seconds", policy_cfg.interval);
+			else if (pb.num)
+				info("No migration progress, retrying "
+				     "in %d seconds", policy_cfg.interval);
+			else if (active)
+				info("No more migration candidates");
+		}
+		if (active) {
+			clock_gettime(CLOCK_MONOTONIC, &endtime);
+			elapsed = (endtime.tv_sec - starttime.tv_sec) +
+				(endtime.tv_nsec - starttime.tv_nsec) / 1e9;
+			info("Migrated %d files (%llu bytes) in %f seconds "
+			     "(%.1f files/sec, %.1f MB/sec), "
+			     "%d skipped, %d failed, usage now %d%%",
+			     pb.migrated, pb.bytes, elapsed,
+			     elapsed > 0 ? pb.migrated / elapsed : 0,
+			     elapsed > 0 ? pb.bytes / elapsed / 1048576 : 0,
+			     pb.skipped, pb.failed, usage);
+			active = 0;
+		}
+		pthread_mutex_lock(&policy_lock);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += policy_cfg.interval;
+		while (!policy_stopped) {
+			if (pthread_cond_timedwait(&policy_cond, &policy_lock,
+						   &deadline) == ETIMEDOUT)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&policy_lock);
+out_free:
+	free(pb.res);
+	free(pb.order);
+	free(pb.cand);
+	return NULL;
+}
+
+int start_policy(struct policy_config *cfg)
+{
+	int ret;
+
+	if (cfg->low > cfg->high || cfg->high > 100 || cfg->batch < 1 ||
+	    cfg->jobs < 1 || cfg->interval < 1) {
+		err("Invalid policy configuration");
+		return -EINVAL;
+	}
+	memcpy(&policy_cfg, cfg, sizeof(struct policy_config));
+	policy_stopped = 0;
+	ret = pthread_create(&policy_thr, NULL, policy_thread, NULL);
+	if (ret) {
+		err("Failed to start policy thread, error %d", ret);
+		return -ret;
+	}
+	info("Migrating at %d%% usage down to %d%%, "
+	     "%d files per batch with %d workers",
+	     cfg->high, cfg->low, cfg->batch, cfg->jobs);
+	return 0;
+}
+
+void stop_policy(void)
+{
+	pthread_mutex_lock(&policy_lock);
+	policy_stopped = 1;
+	pthread_cond_signal(&policy_cond);
+	pthread_mutex_unlock(&policy_lock);
+	pthread_join(policy_thr, NULL);
+}
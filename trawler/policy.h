@@ -0,0 +1,17 @@
+#ifndef _POLICY_H
+#define _POLICY_H
+
+struct policy_config {
+	char *dirname;
+	int high;
+	int low;
+	int batch;
+	int jobs;
+	int interval;
+	unsigned long long min_size;
+};
+
+int start_policy(struct policy_config *cfg);
+void stop_policy(void);
+
+#endif /* _POLICY_H */
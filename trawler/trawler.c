@@ -21,49 +21,91 @@
 #include "list.h"
 #include "watcher.h"
 #include "events.h"
+#include "walker.h"
+#include "paths.h"
+#include "catalog.h"
+#include "index.h"
+#include "policy.h"
+#include "trawler.h"
 #include "logging.h"
+#include "util.h"
 
 #define LOG_AREA "trawler"
 
+#define POLICY_INTERVAL 5
+#define RESCAN_MAX_DIRS 4096
+#define RESCAN_INTERVAL 5
+
 pthread_cond_t exit_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t exit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int trawler_stopped;
+
+/* Directories to be rescanned, protected by exit_mutex */
+static unsigned int *rescan_dirs;
+static int rescan_num;
+static int rescan_max;
+static int rescan_all;
+static time_t rescan_time;
 
 int log_priority = LOG_ERR;
 int use_syslog;
 FILE *logfd;
 
-static void *
-signal_set(int signo, void (*func) (int))
+/*
+ * SIGINT and SIGTERM are blocked in all threads and waited for
+ * here, as a signal handler cannot take exit_mutex; the thread
+ * it interrupts might be holding it.
+ */
+static void *signal_thread(void *arg)
 {
-	int r;
-	struct sigaction sig;
-	struct sigaction osig;
+	sigset_t *set = arg;
+	int sig;
 
-	sig.sa_handler = func;
-	sigemptyset(&sig.sa_mask);
-	sig.sa_flags = 0;
-
-	r = sigaction(signo, &sig, &osig);
-
-	if (r < 0)
-		return (SIG_ERR);
-	else
-		return (osig.sa_handler);
+	while (sigwait(set, &sig))
+		;
+	pthread_mutex_lock(&exit_mutex);
+	trawler_stopped = 1;
+	pthread_cond_signal(&exit_cond);
+	pthread_mutex_unlock(&exit_mutex);
+	return NULL;
 }
 
-static void sigend(int sig)
+/*
+ * Schedule a rescan of directory @dir, or an incremental
+ * rescan of the entire tree if @dir is PATH_ID_INVALID.
+ * Directories scheduled are read again even if the entire
+ * tree is rescanned, unless there are too many of them.
+ */
+void trawler_rescan(unsigned int dir)
 {
 	pthread_mutex_lock(&exit_mutex);
+	if (dir == PATH_ID_INVALID || rescan_num == RESCAN_MAX_DIRS)
+		rescan_all = 1;
+	if (dir != PATH_ID_INVALID && rescan_num < RESCAN_MAX_DIRS) {
+		if (rescan_num == rescan_max) {
+			int max = rescan_max ? rescan_max * 2 : 64;
+			unsigned int *dirs;
+
+			dirs = realloc(rescan_dirs, max * sizeof(unsigned int));
+			if (!dirs) {
+				rescan_all = 1;
+				goto out;
+			}
+			rescan_dirs = dirs;
+			rescan_max = max;
+		}
+		rescan_dirs[rescan_num++] = dir;
+	}
+out:
 	pthread_cond_signal(&exit_cond);
 	pthread_mutex_unlock(&exit_mutex);
 }
 
 int trawl_dir(char *dirname)
 {
-	int num_files = 0;
+	int num_files = 0, ret;
 	char fullpath[PATH_MAX];
 	struct stat dirst;
-	time_t dtime;
 	DIR *dirfd;
 	struct dirent *dirent;
 
@@ -71,22 +113,15 @@ int trawl_dir(char *dirname)
 		err("Cannot open %s: error %d", dirname, errno);
 		return 0;
 	}
-	if (difftime(dirst.st_atime, dirst.st_mtime) < 0) {
-		dtime = dirst.st_atime;
-	} else {
-		dtime = dirst.st_mtime;
-	}
-
 	if (!S_ISDIR(dirst.st_mode)) {
-#if 0
-		if (insert_event(dirname, dtime) < 0)
+		if (insert_event(dirname, &dirst) < 0)
 			return 0;
 		else
-#endif
 			return 1;
 	}
-	if (insert_inotify(dirname, 0) < 0)
-		return 0;
+	ret = insert_watch(dirname, &dirst);
+	if (ret < 0 && ret != -EEXIST)
+		warn("%s: not watched, error %d", dirname, -ret);
 
 	dirfd = opendir(dirname);
 	if (!dirfd) {
@@ -110,6 +145,213 @@ int trawl_dir(char *dirname)
 	return num_files;
 }
 
+static int trawl(char *dirname, int num_threads, int queue_depth,
+		 int incremental)
+{
+	struct timespec starttime, endtime;
+	double elapsed;
+	int num_files;
+
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+	info("Starting %s at '%s'", incremental ? "rescan" : "trawl",
+	     dirname);
+	/* '-t 0' selects the original recursive trawl for comparison */
+	if (num_threads)
+		num_files = walk_tree(dirname, num_threads,
+				      queue_depth, incremental);
+	else
+		num_files = trawl_dir(dirname);
+	clock_gettime(CLOCK_MONOTONIC, &endtime);
+	elapsed = (endtime.tv_sec - starttime.tv_sec) +
+		(endtime.tv_nsec - starttime.tv_nsec) / 1e9;
+	info("Checked %d files in %f seconds (%.0f files/sec)", num_files,
+	     elapsed, elapsed > 0 ? num_files / elapsed : 0);
+	path_stats();
+	return num_files;
+}
+
+static const time_t index_ages[] = {
+	86400, 7 * 86400, 30 * 86400, 90 * 86400, 365 * 86400,
+};
+static const char *index_age_names[] = {
+	"1 day", "1 week", "1 month", "3 months", "1 year",
+};
+#define NUM_INDEX_AGES (sizeof(index_ages) / sizeof(index_ages[0]))
+
+/*
+ * Show the byte histogram by age and the @num coldest
+ * files of at least @min_size bytes below @dirname.
+ */
+static void list_index(char *dirname, int num, unsigned long long min_size)
+{
+	unsigned long long files[NUM_INDEX_AGES + 1];
+	unsigned long long bytes[NUM_INDEX_AGES + 1];
+	struct index_result *res;
+	struct timespec starttime, endtime;
+	char path[PATH_MAX];
+	unsigned int i;
+	int found;
+
+	index_histogram(index_ages, NUM_INDEX_AGES, files, bytes);
+	for (i = 0; i < NUM_INDEX_AGES; i++)
+		info("accessed within %s: %llu files, %llu bytes",
+		     index_age_names[i], files[i], bytes[i]);
+	info("accessed before %s: %llu files, %llu bytes",
+	     index_age_names[NUM_INDEX_AGES - 1],
+	     files[NUM_INDEX_AGES], bytes[NUM_INDEX_AGES]);
+
+	if (num <= 0)
+		return;
+	res = malloc(num * sizeof(struct index_result));
+	if (!res) {
+		err("Cannot allocate index results");
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+	found = index_coldest(path_lookup(dirname), min_size, res, num);
+	clock_gettime(CLOCK_MONOTONIC, &endtime);
+	info("Found %d coldest files of at least %llu bytes in %f seconds",
+	     found, min_size, (endtime.tv_sec - starttime.tv_sec) +
+	     (endtime.tv_nsec - starttime.tv_nsec) / 1e9);
+	for (i = 0; i < (unsigned int)found; i++) {
+		struct tm atm;
+
+		if (path_name(res[i].path, path, PATH_MAX) < 0 ||
+		    !gmtime_r(&res[i].atime, &atm))
+			continue;
+		info("\t%04d%02d%02d-%02d%02d%02d %llu %s",
+		     atm.tm_year + 1900, atm.tm_mon + 1, atm.tm_mday,
+		     atm.tm_hour, atm.tm_min, atm.tm_sec,
+		     res[i].size, path);
+	}
+	free(res);
+}
+
+struct replay_ctx {
+	unsigned int root;
+	int num_files;
+	int num_dirs;
+};
+
+/* Root of the files still to be restored by replay_files() */
+static unsigned int replay_root;
+
+static void replay_stat(struct catalog_record *rec, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = (rec->flags & CATALOG_DIR) ? S_IFDIR : S_IFREG;
+	st->st_ino = rec->ino;
+	st->st_dev = rec->dev;
+	st->st_size = rec->size;
+	if (!(rec->flags & CATALOG_MIGRATED))
+		st->st_blocks = (rec->size + 511) / 512;
+	st->st_atim.tv_sec = rec->atime / 1000000000LL;
+	st->st_atim.tv_nsec = rec->atime % 1000000000LL;
+	st->st_mtim.tv_sec = rec->mtime / 1000000000LL;
+	st->st_mtim.tv_nsec = rec->mtime % 1000000000LL;
+	st->st_ctim.tv_sec = rec->ctime / 1000000000LL;
+	st->st_ctim.tv_nsec = rec->ctime % 1000000000LL;
+}
+
+static int replay_dir(struct catalog_record *rec, void *arg)
+{
+	struct replay_ctx *ctx = arg;
+	struct stat st;
+	char path[PATH_MAX];
+
+	if (!(rec->flags & CATALOG_DIR) ||
+	    !path_is_under(rec->path, ctx->root))
+		return 0;
+	if (path_name(rec->path, path, PATH_MAX) < 0)
+		return 0;
+	replay_stat(rec, &st);
+	insert_watch(path, &st);
+	ctx->num_dirs++;
+	return 0;
+}
+
+static int replay_file(struct catalog_record *rec, void *arg)
+{
+	struct replay_ctx *ctx = arg;
+	struct stat st;
+
+	if ((rec->flags & CATALOG_DIR) ||
+	    !path_is_under(rec->path, ctx->root))
+		return 0;
+	replay_stat(rec, &st);
+	if (insert_event_at(path_parent(rec->path), rec->path, &st) == 0)
+		ctx->num_files++;
+	if (rec->retry)
+		index_defer(rec->path, rec->retry);
+	return 0;
+}
+
+/*
+ * Restore events and the index for the files in the catalog.
+ * Run by the index when it is first queried; the records have
+ * been kept up to date by the scanner and the watcher since.
+ */
+static void replay_files(void)
+{
+	struct replay_ctx ctx = { .root = replay_root };
+	struct timespec starttime, endtime;
+
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+	catalog_walk(replay_file, &ctx);
+	clock_gettime(CLOCK_MONOTONIC, &endtime);
+	info("Restored %d files in %f seconds", ctx.num_files,
+	     (endtime.tv_sec - starttime.tv_sec) +
+	     (endtime.tv_nsec - starttime.tv_nsec) / 1e9);
+}
+
+/*
+ * Restore the watches for @dirname from the catalog instead of
+ * trawling the directory tree; the files are restored once the
+ * index is first needed. Returns the number of directories found.
+ */
+static int replay_catalog(char *dirname)
+{
+	struct replay_ctx ctx = { .num_files = 0 };
+	struct timespec starttime, endtime;
+
+	ctx.root = path_lookup(dirname);
+	if (ctx.root == PATH_ID_INVALID)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &starttime);
+	catalog_walk(replay_dir, &ctx);
+	clock_gettime(CLOCK_MONOTONIC, &endtime);
+	info("Restored %d directories in %f seconds", ctx.num_dirs,
+	     (endtime.tv_sec - starttime.tv_sec) +
+	     (endtime.tv_nsec - starttime.tv_nsec) / 1e9);
+	if (ctx.num_dirs) {
+		replay_root = ctx.root;
+		index_set_loader(replay_files);
+	}
+	return ctx.num_dirs;
+}
+
+/*
+ * Parse the watermarks '<high>[,<low>]' in percent.
+ * The low watermark defaults to 10 percent below
+ * the high watermark.
+ */
+static int parse_watermarks(char *optarg, struct policy_config *cfg)
+{
+	char *e;
+
+	cfg->high = strtoul(optarg, &e, 10);
+	if (*e == ',')
+		cfg->low = strtoul(e + 1, &e, 10);
+	else
+		cfg->low = cfg->high > 10 ? cfg->high - 10 : 0;
+	if (e == optarg || *e != '\0' || cfg->high < 1 || cfg->high > 100 ||
+	    cfg->low > cfg->high) {
+		err("Invalid watermarks '%s'", optarg);
+		return -EINVAL;
+	}
+	return 0;
+}
+
 unsigned long parse_time(char *optarg)
 {
 	struct tm c;
@@ -177,17 +419,36 @@ unsigned long parse_time(char *optarg)
 
 int main(int argc, char **argv)
 {
-	int i, num_files;
+	int i, num_threads, queue_depth = 0, restored = 0, num_coldest = 0;
+	unsigned long long min_size = 0;
+	char *watcher = NULL, *catalog_dir = NULL;
 	char init_dir[PATH_MAX];
-	unsigned long checkinterval;
-	time_t starttime, endtime;
-	double elapsed;
+	unsigned long checkinterval = 0;
+	struct timespec deadline;
+	static sigset_t exit_sigs;
+	pthread_t signal_thr;
+	struct policy_config policy = {
+		.batch = 64,
+		.jobs = 4,
+		.interval = POLICY_INTERVAL,
+	};
 
-	while ((i = getopt(argc, argv, "c:d:")) != -1) {
+	logfd = stdout;
+	num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1)
+		num_threads = 1;
+
+	while ((i = getopt(argc, argv, "C:b:c:d:e:j:k:m:p:s:t:u:w:")) != -1) {
 		switch (i) {
+		case 'C':
+			catalog_dir = optarg;
+			break;
+		case 'b':
+			policy.batch = strtoul(optarg, NULL, 10);
+			break;
 		case 'c':
 			checkinterval = parse_time(optarg);
-			if (checkinterval < 0) {
+			if ((long)checkinterval <= 0) {
 				err("Invalid time '%s'", optarg);
 				return 1;
 			}
@@ -195,13 +456,57 @@ int main(int argc, char **argv)
 		case 'd':
 			realpath(optarg, init_dir);
 			break;
+		case 'e':
+			watcher_window = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			policy.jobs = strtoul(optarg, NULL, 10);
+			break;
+		case 'k':
+			num_coldest = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			if (parse_watermarks(optarg, &policy) < 0)
+				return 1;
+			break;
+		case 'p':
+			log_priority = strtoul(optarg, NULL, 10);
+			if (log_priority > LOG_DEBUG) {
+				err("Invalid logging priority %d (max %d)",
+				    log_priority, LOG_DEBUG);
+				return 1;
+			}
+			break;
+		case 's':
+			min_size = parse_size(optarg);
+			if (min_size == (unsigned long long)-1)
+				return 1;
+			break;
+		case 't':
+			num_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			queue_depth = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			watcher = optarg;
+			break;
 		default:
-			err("usage: %s [-d <dir>]", argv[0]);
+			err("usage: %s [-C <catalog>] [-b <batch>] "
+			    "[-c <interval>] [-d <dir>] [-e <msecs>] "
+			    "[-j <jobs>] [-k <num>] [-m <high>[,<low>]] "
+			    "[-p <prio>] [-s <size>] "
+			    "[-t <threads>] [-u <depth>] [-w <watcher>]",
+			    argv[0]);
 			return 1;
 		}
 	}
 	if (optind < argc) {
-		err("usage: %s [-d <dir>]", argv[0]);
+		err("usage: %s [-C <catalog>] [-b <batch>] "
+		    "[-c <interval>] [-d <dir>] [-e <msecs>] "
+		    "[-j <jobs>] [-k <num>] [-m <high>[,<low>]] "
+		    "[-p <prio>] [-s <size>] "
+		    "[-t <threads>] [-u <depth>] [-w <watcher>]", argv[0]);
 		return EINVAL;
 	}
 	if ('\0' == init_dir[0]) {
@@ -221,22 +526,112 @@ int main(int argc, char **argv)
 		return errno;
 	}
 
-	signal_set(SIGINT, sigend);
-	signal_set(SIGTERM, sigend);
+	if (catalog_dir) {
+		restored = catalog_open(catalog_dir);
+		if (restored < 0) {
+			err("Failed to open catalog '%s'", catalog_dir);
+			return 1;
+		}
+	}
 
-	start_watcher();
+	/* Before any other thread is started, so all inherit the mask */
+	sigemptyset(&exit_sigs);
+	sigaddset(&exit_sigs, SIGINT);
+	sigaddset(&exit_sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &exit_sigs, NULL);
+	if (pthread_create(&signal_thr, NULL, signal_thread, &exit_sigs)) {
+		err("Failed to start signal thread");
+		catalog_close();
+		return 1;
+	}
+	pthread_detach(signal_thr);
 
-	starttime = time(NULL);
-	info("Starting at '%s'", init_dir);
-	num_files = trawl_dir(init_dir);
-	endtime = time(NULL);
-	elapsed = difftime(endtime, starttime);
-	info("Checked %d files in %f seconds", num_files, elapsed);
+	if (start_watcher(watcher, init_dir)) {
+		err("Failed to start watcher");
+		catalog_close();
+		return 1;
+	}
+
+	if (!restored || !replay_catalog(init_dir))
+		trawl(init_dir, num_threads, queue_depth, 0);
+	else if (!checkinterval || restored == 2)
+		/*
+		 * No periodic rescan to pick up offline changes, or
+		 * directories to be read again after a crash.
+		 */
+		trawl(init_dir, num_threads, queue_depth, 1);
 
-	list_events();
+	/* Only restore the files up front if they are listed */
+	if (log_priority >= LOG_DEBUG)
+		list_events();
+	if (log_priority >= LOG_INFO)
+		list_index(init_dir, num_coldest, min_size);
+
+	if (policy.high) {
+		policy.dirname = init_dir;
+		policy.min_size = min_size;
+		if (start_policy(&policy) < 0)
+			policy.high = 0;
+	}
 
-	pthread_cond_wait(&exit_cond, &exit_mutex);
+	pthread_mutex_lock(&exit_mutex);
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += checkinterval;
+	while (!trawler_stopped) {
+		if (rescan_all || rescan_num) {
+			unsigned int *dirs = rescan_dirs;
+			int num = rescan_num, all = rescan_all;
+			struct timespec now;
+
+			/*
+			 * Rescans cause events themselves, so do not
+			 * run them back to back if the event queue
+			 * keeps overflowing.
+			 */
+			clock_gettime(CLOCK_REALTIME, &now);
+			if (now.tv_sec < rescan_time) {
+				now.tv_sec = rescan_time;
+				now.tv_nsec = 0;
+				pthread_cond_timedwait(&exit_cond, &exit_mutex,
+						       &now);
+				continue;
+			}
+			rescan_dirs = NULL;
+			rescan_num = rescan_max = rescan_all = 0;
+			pthread_mutex_unlock(&exit_mutex);
+			if (num)
+				walk_rescan(dirs, num, num_threads,
+					    queue_depth);
+			if (all)
+				trawl(init_dir, num_threads, queue_depth, 1);
+			free(dirs);
+			pthread_mutex_lock(&exit_mutex);
+			rescan_time = time(NULL) + RESCAN_INTERVAL;
+			continue;
+		}
+		if (!checkinterval) {
+			pthread_cond_wait(&exit_cond, &exit_mutex);
+			continue;
+		}
+		if (pthread_cond_timedwait(&exit_cond, &exit_mutex,
+					   &deadline) != ETIMEDOUT)
+			continue;
+		pthread_mutex_unlock(&exit_mutex);
+		trawl(init_dir, num_threads, queue_depth, 1);
+		if (log_priority >= LOG_DEBUG)
+			list_events();
+		if (log_priority >= LOG_INFO)
+			list_index(init_dir, num_coldest, min_size);
+		pthread_mutex_lock(&exit_mutex);
+		/* Do not try to catch up if the rescan took too long */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += checkinterval;
+	}
+	pthread_mutex_unlock(&exit_mutex);
+	if (policy.high)
+		stop_policy();
 	stop_watcher();
+	catalog_close();
 
 	return 0;
 }
@@ -0,0 +1,6 @@
+#ifndef _TRAWLER_H
+#define _TRAWLER_H
+
+void trawler_rescan(unsigned int dir);
+
+#endif /* _TRAWLER_H */
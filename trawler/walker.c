@@ -0,0 +1,908 @@
+/*
+ * walker.c
+ *
+ * Parallel directory walker for trawler.
+ *
+ * Every directory is a single task. Each thread keeps its own
+ * deque of tasks; new subdirectories are pushed to the owner's
+ * end and popped from there again (depth-first), while idle
+ * threads steal from the opposite end of a random victim.
+ * Directories are opened relative to their parent directory
+ * file descriptor, so the kernel never has to resolve the
+ * full pathname again.
+ *
+ * Optionally each thread can use an io_uring to submit the
+ * statx() calls for files and openat() calls for subdirectories
+ * of a directory in batches, keeping up to 'queue_depth' metadata
+ * lookups in flight. The d_type returned by readdir() is used
+ * to skip statx() for directories.
+ *
+ * On incremental scans directories whose inode, mtime and ctime
+ * are unchanged since the previous scan are not read again; only
+ * their cached subdirectories are queued. After a restart the
+ * catalog provides the same information.
+ *
+ * Rescans of individual directories, e.g. after the watcher
+ * lost events, always read the given directories again, and
+ * continue incrementally below them.
+ *
+ * Every file and directory seen is recorded in the catalog.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "list.h"
+#include "uring.h"
+#include "watcher.h"
+#include "events.h"
+#include "walker.h"
+#include "dircache.h"
+#include "paths.h"
+#include "catalog.h"
+#include "logging.h"
+
+#define LOG_AREA "walker"
+
+#define WALK_QUEUE_SIZE 64
+
+struct walk_dir {
+	struct walk_dir *parent;
+	int refcnt;
+	int fd;
+	int force;
+	unsigned int id;
+	char *name;
+	char path[];
+};
+
+struct walk_queue {
+	pthread_mutex_t lock;
+	struct walk_dir **tasks;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int size;
+};
+
+struct walk_slot {
+	unsigned char d_type;
+	struct statx stx;
+	char name[NAME_MAX + 1];
+};
+
+struct walk_ctx;
+
+struct walk_thread {
+	pthread_t thr;
+	struct walk_ctx *ctx;
+	struct walk_queue queue;
+	struct uring ring;
+	struct walk_slot *slots;
+	int *free_slots;
+	int num_free;
+	char *subdirs;
+	size_t subdirs_len;
+	size_t subdirs_size;
+	int recording;
+	unsigned int seed;
+	int num_files;
+	int num_dirs;
+	int num_cached;
+	int num_steals;
+};
+
+struct walk_ctx {
+	int num_threads;
+	int queue_depth;
+	int incremental;
+	unsigned int generation;
+	/* Sorted ids of the directories to be read in any case */
+	unsigned int *force;
+	int num_force;
+	int pending;
+	int idle;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	struct walk_thread *threads;
+};
+
+/*
+ * Number of directory fds held open by the walker; subdirectories
+ * are only opened ahead of time if we stay below the limit.
+ */
+static int walk_open_fds;
+static int walk_max_fds;
+
+static struct walk_dir *walk_dir_alloc(struct walk_dir *parent,
+				       const char *name)
+{
+	struct walk_dir *wd;
+	size_t len, plen = 0;
+
+	len = strlen(name);
+	if (parent) {
+		plen = strlen(parent->path);
+		/* Avoid a double slash when starting at '/' */
+		if (plen == 1 && parent->path[0] == '/')
+			plen = 0;
+		if (plen + len + 2 > PATH_MAX) {
+			err("%s/%s: pathname overflow", parent->path, name);
+			return NULL;
+		}
+	}
+	wd = malloc(sizeof(struct walk_dir) + plen + len + 2);
+	if (!wd) {
+		err("%s: cannot allocate walk entry", name);
+		return NULL;
+	}
+	if (parent)
+		wd->id = path_intern_at(parent->id, name);
+	else
+		wd->id = path_intern(name);
+	if (wd->id == PATH_ID_INVALID) {
+		free(wd);
+		return NULL;
+	}
+	wd->refcnt = 1;
+	wd->fd = -1;
+	wd->force = 0;
+	wd->parent = parent;
+	if (parent) {
+		memcpy(wd->path, parent->path, plen);
+		wd->path[plen] = '/';
+		wd->name = wd->path + plen + 1;
+		__atomic_add_fetch(&parent->refcnt, 1, __ATOMIC_SEQ_CST);
+	} else {
+		wd->name = wd->path;
+	}
+	strcpy(wd->name, name);
+	return wd;
+}
+
+static void walk_dir_put(struct walk_dir *wd)
+{
+	struct walk_dir *parent;
+
+	while (wd) {
+		if (__atomic_sub_fetch(&wd->refcnt, 1, __ATOMIC_SEQ_CST))
+			return;
+		parent = wd->parent;
+		if (wd->fd >= 0) {
+			close(wd->fd);
+			__atomic_sub_fetch(&walk_open_fds, 1,
+					   __ATOMIC_SEQ_CST);
+		}
+		free(wd);
+		wd = parent;
+	}
+}
+
+/*
+ * Open the directory relative to its parent and release the
+ * reference on the parent; the parent fd is closed once all
+ * subdirectories have been opened.
+ */
+static int walk_dir_open(struct walk_dir *wd)
+{
+	struct walk_dir *parent = wd->parent;
+
+	/* Already opened by io_uring */
+	if (wd->fd >= 0)
+		return 0;
+	if (parent)
+		wd->fd = openat(parent->fd, wd->name,
+				O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+				O_CLOEXEC);
+	else
+		wd->fd = open(wd->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (wd->fd < 0)
+		err("Cannot open directory %s: error %d", wd->path, errno);
+	else
+		__atomic_add_fetch(&walk_open_fds, 1, __ATOMIC_SEQ_CST);
+	if (parent) {
+		wd->parent = NULL;
+		walk_dir_put(parent);
+	}
+	return wd->fd < 0 ? -1 : 0;
+}
+
+static int walk_queue_init(struct walk_queue *q)
+{
+	pthread_mutex_init(&q->lock, NULL);
+	q->head = q->tail = 0;
+	q->size = WALK_QUEUE_SIZE;
+	q->tasks = malloc(q->size * sizeof(struct walk_dir *));
+	if (!q->tasks)
+		return -ENOMEM;
+	return 0;
+}
+
+static int walk_queue_push(struct walk_queue *q, struct walk_dir *wd)
+{
+	pthread_mutex_lock(&q->lock);
+	if (q->tail - q->head == q->size) {
+		struct walk_dir **tasks;
+		unsigned int i, num = q->tail - q->head;
+
+		tasks = malloc(q->size * 2 * sizeof(struct walk_dir *));
+		if (!tasks) {
+			pthread_mutex_unlock(&q->lock);
+			return -ENOMEM;
+		}
+		for (i = 0; i < num; i++)
+			tasks[i] = q->tasks[(q->head + i) & (q->size - 1)];
+		free(q->tasks);
+		q->tasks = tasks;
+		q->head = 0;
+		q->tail = num;
+		q->size *= 2;
+	}
+	q->tasks[q->tail & (q->size - 1)] = wd;
+	q->tail++;
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/* Owner end: most recently pushed directory first */
+static struct walk_dir *walk_queue_pop(struct walk_queue *q)
+{
+	struct walk_dir *wd = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->tail != q->head) {
+		q->tail--;
+		wd = q->tasks[q->tail & (q->size - 1)];
+	}
+	pthread_mutex_unlock(&q->lock);
+	return wd;
+}
+
+/* Thief end: oldest directory, ie the largest remaining subtree */
+static struct walk_dir *walk_queue_steal(struct walk_queue *q)
+{
+	struct walk_dir *wd = NULL;
+
+	if (pthread_mutex_trylock(&q->lock))
+		return NULL;
+	if (q->tail != q->head) {
+		wd = q->tasks[q->head & (q->size - 1)];
+		q->head++;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return wd;
+}
+
+static struct walk_dir *walk_steal(struct walk_thread *wt)
+{
+	struct walk_ctx *ctx = wt->ctx;
+	struct walk_dir *wd;
+	int i, victim;
+
+	if (ctx->num_threads < 2)
+		return NULL;
+	victim = rand_r(&wt->seed) % ctx->num_threads;
+	for (i = 0; i < ctx->num_threads; i++) {
+		struct walk_thread *vt;
+
+		vt = &ctx->threads[(victim + i) % ctx->num_threads];
+		if (vt == wt)
+			continue;
+		wd = walk_queue_steal(&vt->queue);
+		if (wd) {
+			wt->num_steals++;
+			return wd;
+		}
+	}
+	return NULL;
+}
+
+static void walk_queue_add(struct walk_thread *wt, struct walk_dir *wd)
+{
+	struct walk_ctx *ctx = wt->ctx;
+
+	__atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+	if (walk_queue_push(&wt->queue, wd) < 0) {
+		err("%s: cannot queue directory", wd->path);
+		walk_dir_put(wd);
+		__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+	if (__atomic_load_n(&ctx->idle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ctx->idle_lock);
+		pthread_cond_signal(&ctx->idle_cond);
+		pthread_mutex_unlock(&ctx->idle_lock);
+	}
+}
+
+static void walk_file(struct walk_thread *wt, struct walk_dir *wd,
+		      const char *name, struct stat *st)
+{
+	unsigned int id;
+
+	id = path_intern_at(wd->id, name);
+	if (id == PATH_ID_INVALID ||
+	    catalog_update(id, st, wt->ctx->generation) < 0)
+		return;
+	if (insert_event_at(wd->id, id, st) < 0)
+		return;
+	wt->num_files++;
+}
+
+/* Remember subdirectory @name for the directory cache */
+static int walk_record_subdir(struct walk_thread *wt, const char *name)
+{
+	size_t len = strlen(name) + 1;
+
+	if (wt->subdirs_len + len > wt->subdirs_size) {
+		size_t size = wt->subdirs_size ? wt->subdirs_size : 4096;
+		char *subdirs;
+
+		while (wt->subdirs_len + len > size)
+			size *= 2;
+		subdirs = realloc(wt->subdirs, size);
+		if (!subdirs)
+			return -ENOMEM;
+		wt->subdirs = subdirs;
+		wt->subdirs_size = size;
+	}
+	memcpy(wt->subdirs + wt->subdirs_len, name, len);
+	wt->subdirs_len += len;
+	return 0;
+}
+
+static int walk_compare_id(const void *a, const void *b)
+{
+	unsigned int id_a = *(const unsigned int *)a;
+	unsigned int id_b = *(const unsigned int *)b;
+
+	return id_a < id_b ? -1 : id_a > id_b;
+}
+
+static int walk_forced(struct walk_ctx *ctx, unsigned int id)
+{
+	return ctx->num_force &&
+		bsearch(&id, ctx->force, ctx->num_force,
+			sizeof(unsigned int), walk_compare_id);
+}
+
+/*
+ * Queue subdirectory @name of @wd. If @fd is valid the
+ * subdirectory has already been opened, otherwise it'll be
+ * opened relative to @wd once it's processed.
+ */
+static void walk_subdir(struct walk_thread *wt, struct walk_dir *wd,
+			const char *name, int fd)
+{
+	struct walk_dir *child;
+
+	if (wt->recording && walk_record_subdir(wt, name) < 0)
+		wt->recording = -1;
+	child = walk_dir_alloc(wd, name);
+	if (!child) {
+		if (fd >= 0) {
+			close(fd);
+			__atomic_sub_fetch(&walk_open_fds, 1,
+					   __ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+	catalog_touch(child->id, wt->ctx->generation);
+	child->force = walk_forced(wt->ctx, child->id);
+	if (fd >= 0) {
+		child->fd = fd;
+		child->parent = NULL;
+		walk_dir_put(wd);
+	}
+	walk_queue_add(wt, child);
+}
+
+static int walk_skip(struct dirent *dirent)
+{
+	if (!strcmp(dirent->d_name, "."))
+		return 1;
+	if (!strcmp(dirent->d_name, ".."))
+		return 1;
+	if (dirent->d_type != DT_DIR && dirent->d_type != DT_REG &&
+	    dirent->d_type != DT_UNKNOWN)
+		return 1;
+	return 0;
+}
+
+static int walk_entries(struct walk_thread *wt, struct walk_dir *wd,
+			DIR *dirfd)
+{
+	struct dirent *dirent;
+	struct stat st;
+
+	while ((dirent = readdir(dirfd))) {
+		if (walk_skip(dirent))
+			continue;
+		if (dirent->d_type == DT_DIR) {
+			walk_subdir(wt, wd, dirent->d_name, -1);
+			continue;
+		}
+		if (fstatat(wd->fd, dirent->d_name, &st,
+			    AT_SYMLINK_NOFOLLOW) < 0) {
+			err("Cannot open %s/%s: error %d",
+			    wd->path, dirent->d_name, errno);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode))
+			walk_subdir(wt, wd, dirent->d_name, -1);
+		else if (S_ISREG(st.st_mode))
+			walk_file(wt, wd, dirent->d_name, &st);
+	}
+	return 0;
+}
+
+static void walk_statx_to_stat(struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_mode = stx->stx_mode;
+	st->st_ino = stx->stx_ino;
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static void walk_complete(struct walk_thread *wt, struct walk_dir *wd,
+			  struct walk_slot *slot, int res)
+{
+	struct stat st;
+
+	if (slot->d_type == DT_DIR) {
+		if (res < 0) {
+			__atomic_sub_fetch(&walk_open_fds, 1,
+					   __ATOMIC_SEQ_CST);
+			err("Cannot open directory %s/%s: error %d",
+			    wd->path, slot->name, -res);
+			return;
+		}
+		walk_subdir(wt, wd, slot->name, res);
+		return;
+	}
+	if (res < 0) {
+		err("Cannot open %s/%s: error %d",
+		    wd->path, slot->name, -res);
+		return;
+	}
+	if (S_ISDIR(slot->stx.stx_mode))
+		walk_subdir(wt, wd, slot->name, -1);
+	else if (S_ISREG(slot->stx.stx_mode)) {
+		walk_statx_to_stat(&slot->stx, &st);
+		walk_file(wt, wd, slot->name, &st);
+	}
+}
+
+/* Handle all completions, returns the number of entries completed */
+static int walk_uring_reap(struct walk_thread *wt, struct walk_dir *wd)
+{
+	struct io_uring_cqe *cqe;
+	int idx, res, num = 0;
+
+	while ((cqe = uring_peek_cqe(&wt->ring))) {
+		idx = cqe->user_data;
+		res = cqe->res;
+		uring_cqe_seen(&wt->ring);
+		walk_complete(wt, wd, &wt->slots[idx], res);
+		wt->free_slots[wt->num_free++] = idx;
+		num++;
+	}
+	return num;
+}
+
+/*
+ * Give up on io_uring after a failed submission. Entries the
+ * kernel has not taken are run synchronously, the ones in
+ * flight are waited for, and the rest of the directory is
+ * read by walk_entries().
+ */
+static int walk_uring_abort(struct walk_thread *wt, struct walk_dir *wd,
+			    DIR *dirfd, int inflight)
+{
+	struct io_uring_sqe *sqe;
+	struct walk_slot *slot;
+	int idx, ret;
+
+	while ((sqe = uring_unqueue_sqe(&wt->ring))) {
+		idx = sqe->user_data;
+		slot = &wt->slots[idx];
+		if (slot->d_type == DT_DIR)
+			ret = openat(wd->fd, slot->name, O_RDONLY |
+				     O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		else
+			ret = statx(wd->fd, slot->name, AT_SYMLINK_NOFOLLOW,
+				    STATX_BASIC_STATS, &slot->stx);
+		walk_complete(wt, wd, slot, ret < 0 ? -errno : ret);
+		wt->free_slots[wt->num_free++] = idx;
+		inflight--;
+	}
+	while (inflight) {
+		ret = uring_submit(&wt->ring, 1);
+		if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+			err("%s: lost %d io_uring requests, error %d",
+			    wd->path, inflight, -ret);
+			break;
+		}
+		inflight -= walk_uring_reap(wt, wd);
+	}
+	uring_exit(&wt->ring);
+	return walk_entries(wt, wd, dirfd);
+}
+
+static int walk_entries_uring(struct walk_thread *wt, struct walk_dir *wd,
+			      DIR *dirfd)
+{
+	struct dirent *dirent;
+	struct io_uring_sqe *sqe;
+	struct walk_slot *slot;
+	int inflight = 0, eof = 0, idx, ret;
+
+	while (!eof || inflight) {
+		/* Only read an entry once it can be submitted */
+		while (!eof && wt->num_free && uring_sq_space(&wt->ring)) {
+			dirent = readdir(dirfd);
+			if (!dirent) {
+				eof = 1;
+				break;
+			}
+			if (walk_skip(dirent))
+				continue;
+			if (dirent->d_type == DT_DIR &&
+			    __atomic_load_n(&walk_open_fds, __ATOMIC_SEQ_CST) >=
+			    walk_max_fds) {
+				walk_subdir(wt, wd, dirent->d_name, -1);
+				continue;
+			}
+			sqe = uring_get_sqe(&wt->ring);
+			idx = wt->free_slots[--wt->num_free];
+			slot = &wt->slots[idx];
+			slot->d_type = dirent->d_type;
+			strcpy(slot->name, dirent->d_name);
+			sqe->fd = wd->fd;
+			sqe->addr = (unsigned long)slot->name;
+			sqe->user_data = idx;
+			if (slot->d_type == DT_DIR) {
+				/* Only the type is needed, skip statx() */
+				__atomic_add_fetch(&walk_open_fds, 1,
+						   __ATOMIC_SEQ_CST);
+				sqe->opcode = IORING_OP_OPENAT;
+				sqe->open_flags = O_RDONLY | O_DIRECTORY |
+					O_NOFOLLOW | O_CLOEXEC;
+			} else {
+				sqe->opcode = IORING_OP_STATX;
+				sqe->len = STATX_BASIC_STATS;
+				sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+				sqe->off = (unsigned long)&slot->stx;
+			}
+			inflight++;
+		}
+		if (!inflight)
+			break;
+		/* Entries not taken on -EAGAIN or -EBUSY are resubmitted */
+		ret = uring_submit(&wt->ring, 1);
+		if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+			/* Should not happen; give up on io_uring */
+			err("%s: io_uring submission failed, error %d",
+			    wd->path, -ret);
+			return walk_uring_abort(wt, wd, dirfd, inflight);
+		}
+		inflight -= walk_uring_reap(wt, wd);
+	}
+	return 0;
+}
+
+struct walk_cached {
+	struct walk_thread *wt;
+	struct walk_dir *wd;
+};
+
+static void walk_cached_subdir(void *arg, const char *name)
+{
+	struct walk_cached *wc = arg;
+
+	walk_subdir(wc->wt, wc->wd, name, -1);
+}
+
+static void walk_one(struct walk_thread *wt, struct walk_dir *wd)
+{
+	struct walk_ctx *ctx = wt->ctx;
+	struct walk_cached wc = { .wt = wt, .wd = wd };
+	struct stat st;
+	DIR *dirfd;
+	int fd, ret;
+
+	if (walk_dir_open(wd) < 0)
+		return;
+	if (fstat(wd->fd, &st) < 0) {
+		err("Cannot stat directory %s: error %d", wd->path, errno);
+		return;
+	}
+	if (ctx->incremental && !wd->force &&
+	    (dircache_unchanged(wd->id, &st, ctx->generation,
+				walk_cached_subdir, &wc) ||
+	     catalog_unchanged(wd->id, &st, walk_cached_subdir, &wc))) {
+		wt->num_cached++;
+		return;
+	}
+	/* An unwatched directory is still picked up by rescans */
+	ret = insert_watch(wd->path, &st);
+	if (ret < 0 && ret != -EEXIST)
+		warn("%s: not watched, error %d", wd->path, -ret);
+	wt->num_dirs++;
+
+	/* The directory fd stays open for openat() in subdirectories */
+	fd = dup(wd->fd);
+	if (fd < 0) {
+		err("%s: cannot duplicate fd, error %d", wd->path, errno);
+		return;
+	}
+	dirfd = fdopendir(fd);
+	if (!dirfd) {
+		err("Cannot open directory %s: error %d", wd->path, errno);
+		close(fd);
+		return;
+	}
+	wt->subdirs_len = 0;
+	wt->recording = 1;
+	if (wt->ring.fd >= 0)
+		ret = walk_entries_uring(wt, wd, dirfd);
+	else
+		ret = walk_entries(wt, wd, dirfd);
+	closedir(dirfd);
+	/* Only cache directories which have been read completely */
+	if (!ret && wt->recording > 0)
+		dircache_update(wd->id, &st, ctx->generation,
+				wt->subdirs, wt->subdirs_len);
+	wt->recording = 0;
+	if (!ret && catalog_update(wd->id, &st, ctx->generation) == 0)
+		catalog_prune(wd->id, ctx->generation);
+}
+
+static int walk_uring_init(struct walk_thread *wt, int queue_depth)
+{
+	int i;
+
+	wt->ring.fd = -1;
+	if (!queue_depth)
+		return 0;
+	wt->slots = malloc(queue_depth * sizeof(struct walk_slot));
+	wt->free_slots = malloc(queue_depth * sizeof(int));
+	if (!wt->slots || !wt->free_slots) {
+		err("Cannot allocate io_uring slots");
+		return -ENOMEM;
+	}
+	for (i = 0; i < queue_depth; i++)
+		wt->free_slots[i] = i;
+	wt->num_free = queue_depth;
+	if (uring_init(&wt->ring, queue_depth) < 0) {
+		warn("io_uring not available, using synchronous scan");
+		wt->ring.fd = -1;
+	}
+	return 0;
+}
+
+static void *walk_thread(void *arg)
+{
+	struct walk_thread *wt = arg;
+	struct walk_ctx *ctx = wt->ctx;
+	struct walk_dir *wd;
+
+	while (1) {
+		wd = walk_queue_pop(&wt->queue);
+		if (!wd)
+			wd = walk_steal(wt);
+		if (wd) {
+			walk_one(wt, wd);
+			walk_dir_put(wd);
+			__atomic_sub_fetch(&ctx->pending, 1,
+					   __ATOMIC_SEQ_CST);
+			continue;
+		}
+		pthread_mutex_lock(&ctx->idle_lock);
+		if (!__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST)) {
+			pthread_cond_broadcast(&ctx->idle_cond);
+			pthread_mutex_unlock(&ctx->idle_lock);
+			break;
+		} else {
+			struct timespec tmo;
+
+			/*
+			 * Pending tasks might be running without having
+			 * pushed any subdirectories yet, so only sleep
+			 * for a short while.
+			 */
+			clock_gettime(CLOCK_REALTIME, &tmo);
+			tmo.tv_nsec += 1000000;
+			if (tmo.tv_nsec >= 1000000000) {
+				tmo.tv_sec++;
+				tmo.tv_nsec -= 1000000000;
+			}
+			__atomic_add_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+			pthread_cond_timedwait(&ctx->idle_cond,
+					       &ctx->idle_lock, &tmo);
+			__atomic_sub_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&ctx->idle_lock);
+	}
+	return NULL;
+}
+
+static int walk_start(struct walk_ctx *ctx, int num_threads,
+		      int queue_depth, int incremental)
+{
+	struct rlimit rlim;
+	int i;
+
+	if (num_threads < 1)
+		num_threads = 1;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0)
+		walk_max_fds = 512;
+	else
+		walk_max_fds = rlim.rlim_cur / 2;
+	memset(ctx, 0, sizeof(struct walk_ctx));
+	pthread_mutex_init(&ctx->idle_lock, NULL);
+	pthread_cond_init(&ctx->idle_cond, NULL);
+	ctx->threads = malloc(num_threads * sizeof(struct walk_thread));
+	if (!ctx->threads) {
+		err("Cannot allocate walker threads");
+		return -ENOMEM;
+	}
+	memset(ctx->threads, 0, num_threads * sizeof(struct walk_thread));
+	for (i = 0; i < num_threads; i++)
+		ctx->threads[i].ring.fd = -1;
+	ctx->num_threads = num_threads;
+	for (i = 0; i < num_threads; i++) {
+		ctx->threads[i].ctx = ctx;
+		ctx->threads[i].seed = i + 1;
+		if (walk_queue_init(&ctx->threads[i].queue) < 0 ||
+		    walk_uring_init(&ctx->threads[i], queue_depth) < 0) {
+			err("Cannot allocate walker queue");
+			ctx->num_threads = i + 1;
+			return -ENOMEM;
+		}
+	}
+	ctx->queue_depth = queue_depth;
+	ctx->incremental = incremental;
+	ctx->generation = catalog_next_generation();
+	return 0;
+}
+
+/* Process all queued directories, returns the number of files */
+static int walk_run(struct walk_ctx *ctx)
+{
+	int i, num_files = 0, num_dirs = 0, num_cached = 0, num_steals = 0;
+
+	for (i = 1; i < ctx->num_threads; i++) {
+		if (pthread_create(&ctx->threads[i].thr, NULL,
+				   walk_thread, &ctx->threads[i])) {
+			err("Failed to create walker thread %d", i);
+			ctx->threads[i].thr = (pthread_t)0;
+		}
+	}
+	walk_thread(&ctx->threads[0]);
+	for (i = 1; i < ctx->num_threads; i++) {
+		if (ctx->threads[i].thr)
+			pthread_join(ctx->threads[i].thr, NULL);
+	}
+	for (i = 0; i < ctx->num_threads; i++) {
+		dbg("thread %d: %d dirs, %d cached, %d files, %d steals", i,
+		    ctx->threads[i].num_dirs, ctx->threads[i].num_cached,
+		    ctx->threads[i].num_files, ctx->threads[i].num_steals);
+		num_files += ctx->threads[i].num_files;
+		num_dirs += ctx->threads[i].num_dirs;
+		num_cached += ctx->threads[i].num_cached;
+		num_steals += ctx->threads[i].num_steals;
+	}
+	info("Walked %d directories (%d unchanged) with %d threads, "
+	     "%d steals", num_dirs, num_cached, ctx->num_threads, num_steals);
+	return num_files;
+}
+
+static void walk_free(struct walk_ctx *ctx)
+{
+	int i;
+
+	if (!ctx->threads)
+		return;
+	for (i = 0; i < ctx->num_threads; i++) {
+		free(ctx->threads[i].queue.tasks);
+		if (ctx->threads[i].ring.fd >= 0)
+			uring_exit(&ctx->threads[i].ring);
+		free(ctx->threads[i].slots);
+		free(ctx->threads[i].free_slots);
+		free(ctx->threads[i].subdirs);
+	}
+	free(ctx->threads);
+}
+
+int walk_tree(char *dirname, int num_threads, int queue_depth,
+	      int incremental)
+{
+	struct walk_ctx ctx;
+	struct walk_dir *root;
+	int num_files = 0;
+
+	if (walk_start(&ctx, num_threads, queue_depth, incremental) < 0)
+		goto out_free;
+	root = walk_dir_alloc(NULL, dirname);
+	if (!root)
+		goto out_free;
+	walk_queue_add(&ctx.threads[0], root);
+	num_files = walk_run(&ctx);
+	dircache_prune(ctx.generation);
+out_free:
+	walk_free(&ctx);
+	return num_files;
+}
+
+/*
+ * Check whether any parent of @dir is to be read again; @dir
+ * is forced once the rescan of that parent reaches it.
+ */
+static int walk_rescan_below(struct walk_ctx *ctx, unsigned int dir)
+{
+	while ((dir = path_parent(dir)) != PATH_ID_INVALID) {
+		if (walk_forced(ctx, dir))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Read the directories @dirs again, and rescan incrementally
+ * below them. Returns the number of files seen.
+ */
+int walk_rescan(unsigned int *dirs, int num, int num_threads,
+		int queue_depth)
+{
+	struct walk_ctx ctx;
+	struct walk_dir *wd;
+	char path[PATH_MAX];
+	int i, n = 0, num_files = 0;
+
+	if (walk_start(&ctx, num_threads, queue_depth, 1) < 0)
+		goto out_free;
+	qsort(dirs, num, sizeof(unsigned int), walk_compare_id);
+	ctx.force = dirs;
+	ctx.num_force = num;
+	for (i = 0; i < num; i++) {
+		if (i && dirs[i] == dirs[i - 1])
+			continue;
+		/* Do not scan a directory twice, nor concurrently */
+		if (walk_rescan_below(&ctx, dirs[i]))
+			continue;
+		if (path_name(dirs[i], path, PATH_MAX) < 0)
+			continue;
+		wd = walk_dir_alloc(NULL, path);
+		if (!wd)
+			continue;
+		wd->force = 1;
+		dbg("%s: rescanning", path);
+		walk_queue_add(&ctx.threads[n++ % ctx.num_threads], wd);
+	}
+	info("Rescanning %d directories", n);
+	num_files = walk_run(&ctx);
+out_free:
+	walk_free(&ctx);
+	return num_files;
+}
@@ -0,0 +1,9 @@
+#ifndef _WALKER_H
+#define _WALKER_H
+
+int walk_tree(char *dirname, int num_threads, int queue_depth,
+	      int incremental);
+int walk_rescan(unsigned int *dirs, int num, int num_threads,
+		int queue_depth);
+
+#endif /* _WALKER_H */
@@ -0,0 +1,470 @@
+/*
+ * watcher-fanotify.c
+ *
+ * Fanotify-based filesystem watcher for trawler.
+ *
+ * Instead of one inotify watch per directory a single
+ * filesystem mark is placed on every filesystem encountered
+ * during the trawl. Events carry the file handle of the parent
+ * directory and the name of the entry; directory handles are
+ * resolved to pathnames through a small LRU cache, so memory
+ * usage does not depend on the number of directories.
+ *
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/fanotify.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "logging.h"
+#include "watcher.h"
+#include "catalog.h"
+#include "events.h"
+#include "paths.h"
+
+#define LOG_AREA "watcher"
+
+#define FAN_WATCH_MASK (FAN_OPEN | FAN_MODIFY | FAN_CLOSE_WRITE | \
+			FAN_CREATE | FAN_DELETE | FAN_MOVE | FAN_ONDIR)
+
+#define FAN_MAX_FS 64
+#define FAN_CACHE_SIZE 4096
+#define FAN_BUF_LEN 65536
+
+struct fan_fs {
+	dev_t dev;
+	fsid_t fsid;
+	int mount_fd;
+};
+
+struct fan_handle {
+	struct list_head lru;
+	struct fan_handle *next;
+	unsigned int hash;
+	int fs;
+	char *path;
+	unsigned int handle_len;
+	unsigned char handle[];
+};
+
+static struct fan_fs fan_fs[FAN_MAX_FS];
+static int fan_num_fs;
+static pthread_mutex_t fan_fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fan_handle *fan_cache[FAN_CACHE_SIZE];
+static unsigned int fan_cache_entries;
+static LIST_HEAD(fan_lru);
+
+static int fanotify_fd = -1;
+static pthread_t fan_thr;
+static int stopped;
+static char fan_root[PATH_MAX];
+static size_t fan_root_len;
+
+static unsigned int fan_hash(int fs, const unsigned char *handle,
+			     unsigned int len)
+{
+	unsigned int hash = 2166136261u ^ fs;
+
+	while (len--) {
+		hash ^= *handle++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+static void fan_cache_flush(void)
+{
+	struct fan_handle *fh, *tmp;
+
+	list_for_each_entry_safe(fh, tmp, &fan_lru, lru) {
+		list_del(&fh->lru);
+		free(fh->path);
+		free(fh);
+	}
+	memset(fan_cache, 0, sizeof(fan_cache));
+	fan_cache_entries = 0;
+}
+
+static void fan_cache_evict(struct fan_handle *fh)
+{
+	struct fan_handle **pfh;
+
+	pfh = &fan_cache[fh->hash % FAN_CACHE_SIZE];
+	while (*pfh != fh)
+		pfh = &(*pfh)->next;
+	*pfh = fh->next;
+	list_del(&fh->lru);
+	free(fh->path);
+	free(fh);
+	fan_cache_entries--;
+}
+
+static int fan_resolve(int fs, struct file_handle *handle, char *path)
+{
+	char buf[PATH_MAX];
+	int fd, len;
+
+	fd = open_by_handle_at(fan_fs[fs].mount_fd, handle, O_PATH);
+	if (fd < 0)
+		return -errno;
+	sprintf(buf, "/proc/self/fd/%d", fd);
+	len = readlink(buf, path, PATH_MAX - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	path[len] = '\0';
+	return len;
+}
+
+/*
+ * Return the pathname of directory handle @handle on filesystem
+ * @fs, resolving it and adding it to the cache if required.
+ */
+static const char *fan_lookup(int fs, struct file_handle *handle)
+{
+	struct fan_handle *fh;
+	unsigned int len, hash;
+	char path[PATH_MAX];
+	int ret;
+
+	len = sizeof(struct file_handle) + handle->handle_bytes;
+	hash = fan_hash(fs, (unsigned char *)handle, len);
+	for (fh = fan_cache[hash % FAN_CACHE_SIZE]; fh; fh = fh->next) {
+		if (fh->hash == hash && fh->fs == fs &&
+		    fh->handle_len == len &&
+		    !memcmp(fh->handle, handle, len)) {
+			list_move(&fh->lru, &fan_lru);
+			return fh->path;
+		}
+	}
+	ret = fan_resolve(fs, handle, path);
+	if (ret < 0) {
+		dbg("cannot resolve file handle, error %d", -ret);
+		return NULL;
+	}
+	if (fan_cache_entries >= FAN_CACHE_SIZE)
+		fan_cache_evict(list_entry(fan_lru.prev,
+					   struct fan_handle, lru));
+	fh = malloc(sizeof(struct fan_handle) + len);
+	if (!fh) {
+		err("%s: cannot allocate cache entry", path);
+		return NULL;
+	}
+	fh->path = strdup(path);
+	if (!fh->path) {
+		err("%s: cannot allocate cache entry", path);
+		free(fh);
+		return NULL;
+	}
+	fh->fs = fs;
+	fh->hash = hash;
+	fh->handle_len = len;
+	memcpy(fh->handle, handle, len);
+	fh->next = fan_cache[hash % FAN_CACHE_SIZE];
+	fan_cache[hash % FAN_CACHE_SIZE] = fh;
+	list_add(&fh->lru, &fan_lru);
+	fan_cache_entries++;
+	return fh->path;
+}
+
+static int fan_lookup_fs(__kernel_fsid_t *fsid)
+{
+	int i, num_fs = __atomic_load_n(&fan_num_fs, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < num_fs; i++)
+		if (!memcmp(&fan_fs[i].fsid, fsid, sizeof(fsid_t)))
+			return i;
+	return -1;
+}
+
+static int fan_in_root(const char *path)
+{
+	if (fan_root_len == 1)
+		return 1;
+	if (strncmp(path, fan_root, fan_root_len))
+		return 0;
+	return path[fan_root_len] == '/' || path[fan_root_len] == '\0';
+}
+
+static void fan_handle_event(struct fanotify_event_metadata *meta)
+{
+	struct fanotify_event_info_fid *fid = NULL;
+	struct file_handle *handle;
+	const char *dirpath, *name, *type, *op;
+	char path[PATH_MAX];
+	unsigned int off, dir;
+	int fs;
+
+	for (off = meta->metadata_len; off < meta->event_len; ) {
+		struct fanotify_event_info_header *hdr;
+
+		hdr = (struct fanotify_event_info_header *)
+			((char *)meta + off);
+		if (!hdr->len)
+			break;
+		if (hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+			fid = (struct fanotify_event_info_fid *)hdr;
+		off += hdr->len;
+	}
+	if (!fid) {
+		dbg("event %llx: no directory handle",
+		    (unsigned long long)meta->mask);
+		return;
+	}
+	fs = fan_lookup_fs(&fid->fsid);
+	if (fs < 0) {
+		dbg("event %llx: unknown filesystem",
+		    (unsigned long long)meta->mask);
+		return;
+	}
+	handle = (struct file_handle *)fid->handle;
+	name = (const char *)(handle->f_handle + handle->handle_bytes);
+	dirpath = fan_lookup(fs, handle);
+	if (!dirpath || !fan_in_root(dirpath))
+		return;
+	/* Reading a directory, e.g. by a rescan, changes nothing */
+	dir = path_lookup(dirpath);
+	if (dir != PATH_ID_INVALID &&
+	    (!(meta->mask & FAN_ONDIR) ||
+	     (meta->mask & (FAN_CREATE | FAN_DELETE | FAN_MOVE))))
+		watcher_seen(dir);
+
+	if (meta->mask & FAN_ONDIR)
+		type = "dir";
+	else
+		type = "file";
+	info("event %llx", (unsigned long long)meta->mask);
+	if (meta->mask & FAN_CREATE)
+		op = "created";
+	else if (meta->mask & FAN_DELETE)
+		op = "deleted";
+	else if (meta->mask & FAN_MODIFY)
+		op = "modified";
+	else if (meta->mask & FAN_OPEN)
+		op = "opened";
+	else if (meta->mask & FAN_CLOSE_WRITE)
+		op = "closed";
+	else if (meta->mask & FAN_MOVE)
+		op = "moved";
+	else
+		op = "<unhandled>";
+	if (!strcmp(name, "."))
+		snprintf(path, PATH_MAX, "%s", dirpath);
+	else
+		snprintf(path, PATH_MAX, "%s/%s", dirpath, name);
+	info("\t%s %s %s", op, type, path);
+
+	if (meta->mask & (FAN_DELETE | FAN_MOVED_FROM))
+		catalog_remove_path(path);
+	else if (!(meta->mask & FAN_ONDIR) &&
+		 (meta->mask & (FAN_CREATE | FAN_MOVED_TO | FAN_CLOSE_WRITE)))
+		update_event(path);
+	/* Events may be merged, so count an open in any case */
+	if (!(meta->mask & FAN_ONDIR) &&
+	    (meta->mask & (FAN_OPEN | FAN_MODIFY)))
+		access_event(path, !(meta->mask & FAN_OPEN));
+
+	/*
+	 * Cached pathnames of the directory and everything
+	 * below it are stale now.
+	 */
+	if ((meta->mask & FAN_ONDIR) &&
+	    (meta->mask & (FAN_DELETE | FAN_MOVED_FROM)))
+		fan_cache_flush();
+}
+
+static void *watch_fanotify(void *arg)
+{
+	fd_set rfd;
+	struct timeval tmo;
+	struct fanotify_event_metadata *meta;
+	char *buf;
+
+	buf = malloc(FAN_BUF_LEN);
+	if (!buf) {
+		err("Cannot allocate event buffer");
+		return NULL;
+	}
+	pthread_cleanup_push(free, buf);
+	while (!stopped) {
+		ssize_t rlen;
+		int ret, avail;
+
+		FD_ZERO(&rfd);
+		FD_SET(fanotify_fd, &rfd);
+		tmo.tv_sec = 5;
+		tmo.tv_usec = 0;
+		ret = select(fanotify_fd + 1, &rfd, NULL, NULL, &tmo);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err("select returned %d", errno);
+			break;
+		}
+		if (ret == 0) {
+			watcher_idle();
+			continue;
+		}
+
+		rlen = read(fanotify_fd, buf, FAN_BUF_LEN);
+		if (rlen < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err("error %d on reading fanotify event", errno);
+			break;
+		}
+		meta = (struct fanotify_event_metadata *)buf;
+		while (FAN_EVENT_OK(meta, rlen)) {
+			if (meta->vers != FANOTIFY_METADATA_VERSION) {
+				err("fanotify metadata version mismatch");
+				break;
+			}
+			if (meta->mask & FAN_Q_OVERFLOW) {
+				info("fanotify queue overflow");
+				watcher_overflow();
+			}
+			else if (meta->pid != getpid())
+				/* Skip events caused by the trawl itself */
+				fan_handle_event(meta);
+			if (meta->fd >= 0)
+				close(meta->fd);
+			meta = FAN_EVENT_NEXT(meta, rlen);
+		}
+		if (ioctl(fanotify_fd, FIONREAD, &avail) == 0 && !avail)
+			watcher_idle();
+	}
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/*
+ * Add a filesystem mark for the filesystem containing @dirname
+ * unless it is already marked.
+ */
+static int insert_fanotify(char *dirname, struct stat *st)
+{
+	struct stat dirst;
+	struct statfs stfs;
+	int i, num_fs, fd;
+
+	if (!st) {
+		if (stat(dirname, &dirst) < 0) {
+			err("Cannot stat %s: error %d", dirname, errno);
+			return -errno;
+		}
+		st = &dirst;
+	}
+	num_fs = __atomic_load_n(&fan_num_fs, __ATOMIC_ACQUIRE);
+	for (i = 0; i < num_fs; i++)
+		if (fan_fs[i].dev == st->st_dev)
+			return 0;
+
+	pthread_mutex_lock(&fan_fs_lock);
+	for (i = 0; i < fan_num_fs; i++) {
+		if (fan_fs[i].dev == st->st_dev) {
+			pthread_mutex_unlock(&fan_fs_lock);
+			return 0;
+		}
+	}
+	if (fan_num_fs == FAN_MAX_FS) {
+		pthread_mutex_unlock(&fan_fs_lock);
+		err("%s: too many filesystems", dirname);
+		return -ENOSPC;
+	}
+	if (statfs(dirname, &stfs) < 0) {
+		pthread_mutex_unlock(&fan_fs_lock);
+		err("Cannot statfs %s: error %d", dirname, errno);
+		return -errno;
+	}
+	fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		pthread_mutex_unlock(&fan_fs_lock);
+		err("Cannot open %s: error %d", dirname, errno);
+		return -errno;
+	}
+	if (fanotify_mark(fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+			  FAN_WATCH_MASK, AT_FDCWD, dirname) < 0) {
+		pthread_mutex_unlock(&fan_fs_lock);
+		err("%s: fanotify_mark failed with %d", dirname, errno);
+		close(fd);
+		return -errno;
+	}
+	fan_fs[fan_num_fs].dev = st->st_dev;
+	fan_fs[fan_num_fs].fsid = stfs.f_fsid;
+	fan_fs[fan_num_fs].mount_fd = fd;
+	__atomic_store_n(&fan_num_fs, fan_num_fs + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fan_fs_lock);
+	info("%s: added fanotify filesystem mark", dirname);
+	return 0;
+}
+
+static int start_fanotify(char *dirname)
+{
+	int retval;
+
+	stopped = 0;
+	fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC |
+				    FAN_REPORT_DFID_NAME,
+				    O_RDONLY | O_LARGEFILE);
+	if (fanotify_fd < 0) {
+		info("Failed to initialize fanotify, error %d", errno);
+		return errno;
+	}
+	strcpy(fan_root, dirname);
+	fan_root_len = strlen(fan_root);
+	retval = insert_fanotify(dirname, NULL);
+	if (retval < 0) {
+		close(fanotify_fd);
+		fanotify_fd = -1;
+		return -retval;
+	}
+	retval = pthread_create(&fan_thr, NULL, watch_fanotify, NULL);
+	if (retval) {
+		err("Failed to create watcher thread: %d", retval);
+		close(fan_fs[0].mount_fd);
+		fan_num_fs = 0;
+		close(fanotify_fd);
+		fanotify_fd = -1;
+		return retval;
+	}
+	info("Starting fanotify watcher");
+	return 0;
+}
+
+static int stop_fanotify(void)
+{
+	int i;
+
+	stopped = 1;
+	pthread_cancel(fan_thr);
+	pthread_join(fan_thr, NULL);
+	info("Stopped fanotify watcher");
+	fan_cache_flush();
+	for (i = 0; i < fan_num_fs; i++)
+		close(fan_fs[i].mount_fd);
+	fan_num_fs = 0;
+	close(fanotify_fd);
+	fanotify_fd = -1;
+	return 0;
+}
+
+struct watcher_template watcher_fanotify = {
+	.name = "fanotify",
+	.start = start_fanotify,
+	.insert = insert_fanotify,
+	.stop = stop_fanotify,
+};
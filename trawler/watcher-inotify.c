@@ -0,0 +1,691 @@
+/*
+ * watcher-inotify.c
+ *
+ * Inotify-based directory watcher for trawler.
+ * Copyright (c) 2012 Hannes Reinecke <hare@suse.de>
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "list.h"
+#include "logging.h"
+#include "watcher.h"
+#include "paths.h"
+#include "catalog.h"
+#include "events.h"
+
+#define LOG_AREA "watcher"
+
+/* Only the events which are actually used */
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+		    IN_CLOSE_WRITE | IN_OPEN | IN_MODIFY | IN_ONLYDIR)
+
+#define WATCH_MIN_BUCKETS 256
+#define WATCH_STRIPES 64
+
+/*
+ * Watches are kept in two hash tables, one indexed by the
+ * watch descriptor for the event thread and one indexed by
+ * the path id for removal. Each table is protected by a
+ * rwlock, which is only taken for writing when the table is
+ * resized, and by an array of mutexes covering the buckets.
+ * Lookups and updates on different buckets do not contend,
+ * so the event thread can run alongside the scanner adding
+ * watches.
+ */
+struct watch_link {
+	struct watch_link *next;
+	unsigned int key;
+};
+
+struct watch_hash {
+	struct watch_link **buckets;
+	unsigned int size;
+	unsigned int count;
+	pthread_rwlock_t lock;
+	pthread_mutex_t stripe[WATCH_STRIPES];
+};
+
+struct event_watch {
+	struct watch_link ew_wd;
+	struct watch_link ew_path;
+};
+
+static struct watch_hash watch_wd_hash;
+static struct watch_hash watch_path_hash;
+pthread_t watcher_thr;
+int inotify_fd;
+static int epoll_fd = -1;
+static int stop_fd = -1;
+
+static unsigned int watch_hash_key(unsigned int key)
+{
+	return key * 2654435761u;
+}
+
+static int watch_hash_init(struct watch_hash *h)
+{
+	int i;
+
+	h->buckets = calloc(WATCH_MIN_BUCKETS, sizeof(struct watch_link *));
+	if (!h->buckets)
+		return -ENOMEM;
+	h->size = WATCH_MIN_BUCKETS;
+	h->count = 0;
+	pthread_rwlock_init(&h->lock, NULL);
+	for (i = 0; i < WATCH_STRIPES; i++)
+		pthread_mutex_init(&h->stripe[i], NULL);
+	return 0;
+}
+
+/*
+ * Lock the bucket for @key and return it.
+ * The bucket index is a multiple of the stripe index,
+ * so the stripe stays the same when the table grows.
+ */
+static struct watch_link **watch_hash_lock(struct watch_hash *h,
+					   unsigned int key)
+{
+	unsigned int b;
+
+	pthread_rwlock_rdlock(&h->lock);
+	b = watch_hash_key(key) & (h->size - 1);
+	pthread_mutex_lock(&h->stripe[b & (WATCH_STRIPES - 1)]);
+	return &h->buckets[b];
+}
+
+static void watch_hash_unlock(struct watch_hash *h, unsigned int key)
+{
+	unsigned int b = watch_hash_key(key) & (h->size - 1);
+
+	pthread_mutex_unlock(&h->stripe[b & (WATCH_STRIPES - 1)]);
+	pthread_rwlock_unlock(&h->lock);
+}
+
+static void watch_hash_resize(struct watch_hash *h)
+{
+	struct watch_link **buckets, *wl, *next;
+	unsigned int i, size;
+
+	pthread_rwlock_wrlock(&h->lock);
+	if (h->count <= 2 * h->size) {
+		pthread_rwlock_unlock(&h->lock);
+		return;
+	}
+	size = h->size * 2;
+	buckets = calloc(size, sizeof(struct watch_link *));
+	if (!buckets) {
+		/* Continue with the old table */
+		pthread_rwlock_unlock(&h->lock);
+		return;
+	}
+	for (i = 0; i < h->size; i++) {
+		for (wl = h->buckets[i]; wl; wl = next) {
+			unsigned int b = watch_hash_key(wl->key) & (size - 1);
+
+			next = wl->next;
+			wl->next = buckets[b];
+			buckets[b] = wl;
+		}
+	}
+	free(h->buckets);
+	h->buckets = buckets;
+	h->size = size;
+	pthread_rwlock_unlock(&h->lock);
+}
+
+/*
+ * Insert @link into @h unless an entry with the same
+ * key exists already. Returns the existing entry or NULL.
+ */
+static struct watch_link *watch_hash_insert(struct watch_hash *h,
+					    struct watch_link *link)
+{
+	struct watch_link **bucket, *wl;
+	unsigned int count;
+
+	bucket = watch_hash_lock(h, link->key);
+	for (wl = *bucket; wl; wl = wl->next) {
+		if (wl->key == link->key) {
+			watch_hash_unlock(h, link->key);
+			return wl;
+		}
+	}
+	link->next = *bucket;
+	*bucket = link;
+	count = __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	watch_hash_unlock(h, link->key);
+	if (count > 2 * h->size)
+		watch_hash_resize(h);
+	return NULL;
+}
+
+/* Remove and return the entry for @key from @h */
+static struct watch_link *watch_hash_remove(struct watch_hash *h,
+					    unsigned int key)
+{
+	struct watch_link **pwl, *wl;
+
+	pwl = watch_hash_lock(h, key);
+	while ((wl = *pwl) && wl->key != key)
+		pwl = &wl->next;
+	if (wl) {
+		*pwl = wl->next;
+		__atomic_sub_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	}
+	watch_hash_unlock(h, key);
+	return wl;
+}
+
+/* Remove the entry @link from @h */
+static void watch_hash_del(struct watch_hash *h, struct watch_link *link)
+{
+	struct watch_link **pwl;
+
+	pwl = watch_hash_lock(h, link->key);
+	while (*pwl && *pwl != link)
+		pwl = &(*pwl)->next;
+	if (*pwl) {
+		*pwl = link->next;
+		__atomic_sub_fetch(&h->count, 1, __ATOMIC_RELAXED);
+	}
+	watch_hash_unlock(h, link->key);
+}
+
+/* Return the path id watched by @wd */
+static unsigned int watch_lookup_wd(int wd)
+{
+	struct watch_link *wl;
+	unsigned int path = PATH_ID_INVALID;
+
+	for (wl = *watch_hash_lock(&watch_wd_hash, wd); wl; wl = wl->next) {
+		if (wl->key == (unsigned int)wd) {
+			path = container_of(wl, struct event_watch,
+					    ew_wd)->ew_path.key;
+			break;
+		}
+	}
+	watch_hash_unlock(&watch_wd_hash, wd);
+	return path;
+}
+
+int insert_inotify(char *dirname)
+{
+	struct event_watch *ew;
+	struct watch_link *old;
+	int wd;
+
+	ew = malloc(sizeof(struct event_watch));
+	if (!ew) {
+		err("%s: cannot allocate watch entry", dirname);
+		return -ENOMEM;
+	}
+	ew->ew_path.key = path_intern(dirname);
+	if (ew->ew_path.key == PATH_ID_INVALID) {
+		free(ew);
+		return -ENOMEM;
+	}
+	wd = inotify_add_watch(inotify_fd, dirname, WATCH_MASK);
+	if (wd < 0) {
+		err("%s: inotify_add_watch failed with %d", dirname, errno);
+		free(ew);
+		return -errno;
+	}
+	ew->ew_wd.key = wd;
+	if (watch_hash_insert(&watch_wd_hash, &ew->ew_wd)) {
+		dbg("%s: watch %d already present", dirname, wd);
+		free(ew);
+		return -EEXIST;
+	}
+	/*
+	 * A different directory has been watched under this
+	 * name; its watch is removed once the kernel drops it.
+	 */
+	old = watch_hash_remove(&watch_path_hash, ew->ew_path.key);
+	if (old)
+		dbg("%s: replacing watch %d", dirname,
+		    container_of(old, struct event_watch, ew_path)->ew_wd.key);
+	watch_hash_insert(&watch_path_hash, &ew->ew_path);
+	info("%s: added inotify watch %d %p", dirname, wd, ew);
+	return 0;
+}
+
+int remove_inotify(char *dirname)
+{
+	struct watch_link *wl;
+	struct event_watch *ew;
+	unsigned int path;
+
+	path = path_lookup(dirname);
+	if (path == PATH_ID_INVALID ||
+	    !(wl = watch_hash_remove(&watch_path_hash, path))) {
+		/* The watch might have been dropped already */
+		dbg("%s: watch entry not found", dirname);
+		return -ENOENT;
+	}
+	ew = container_of(wl, struct event_watch, ew_path);
+	watch_hash_del(&watch_wd_hash, &ew->ew_wd);
+	inotify_rm_watch(inotify_fd, ew->ew_wd.key);
+	info("%s: removed inotify watch %d", dirname, ew->ew_wd.key);
+	free(ew);
+
+	return 0;
+}
+
+/*
+ * The kernel has dropped watch @wd, e.g. because the
+ * directory has been removed.
+ */
+static void release_inotify(int wd)
+{
+	struct watch_link *wl;
+	struct event_watch *ew;
+
+	wl = watch_hash_remove(&watch_wd_hash, wd);
+	if (!wl)
+		return;
+	ew = container_of(wl, struct event_watch, ew_wd);
+	watch_hash_del(&watch_path_hash, &ew->ew_path);
+	free(ew);
+}
+
+/*
+ * Events for the same directory entry are merged for
+ * 'watcher_window' milliseconds; records are kept in arrival
+ * order, which is also the order in which they are due.
+ */
+#define WATCH_PENDING_BUCKETS 4096
+#define WATCH_PENDING_MAX 65536
+
+struct watch_pending {
+	struct list_head list;
+	struct watch_pending *hash_next;
+	unsigned long long time;
+	unsigned int bucket;
+	unsigned int mask;
+	int wd;
+	char name[];
+};
+
+static LIST_HEAD(watch_pending_list);
+static struct watch_pending *watch_pending[WATCH_PENDING_BUCKETS];
+static unsigned int watch_num_pending;
+static unsigned int watch_coalesced;
+
+static int watch_flush(int all);
+
+#define EVENT_SIZE (sizeof(struct inotify_event))
+#define EVENT_BUF_MIN (1024 * (EVENT_SIZE + 16))
+#define EVENT_BUF_MAX (4 * 1024 * 1024)
+
+/*
+ * Grow the event buffer to hold all pending events, so a burst
+ * of events is drained with a single read before the kernel
+ * queue overflows.
+ */
+static char *watch_buf_grow(char *buf, size_t *buf_len)
+{
+	size_t len = *buf_len;
+	char *newbuf;
+	int avail;
+
+	if (ioctl(inotify_fd, FIONREAD, &avail) < 0 ||
+	    avail <= (int)len || len >= EVENT_BUF_MAX)
+		return buf;
+	while (len < (size_t)avail && len < EVENT_BUF_MAX)
+		len *= 2;
+	newbuf = realloc(buf, len);
+	if (!newbuf)
+		return buf;
+	dbg("growing event buffer to %zu bytes", len);
+	*buf_len = len;
+	return newbuf;
+}
+
+/*
+ * Handle the (coalesced) events @mask for entry @name
+ * in the directory watched by @wd.
+ */
+static void watch_event(int wd, unsigned int mask, const char *name)
+{
+	const char *type, *op;
+	unsigned int dir;
+	char path[PATH_MAX];
+
+	dir = watch_lookup_wd(wd);
+	if (dir == PATH_ID_INVALID) {
+		dbg("inotify event %d not found", wd);
+		return;
+	}
+	watcher_seen(dir);
+	if (mask & IN_ISDIR)
+		type = "dir";
+	else
+		type = "file";
+	if (mask & IN_CREATE)
+		op = "created";
+	else if (mask & IN_DELETE)
+		op = "deleted";
+	else if (mask & IN_MOVE)
+		op = "moved";
+	else if (mask & IN_CLOSE_WRITE)
+		op = "written";
+	else if (mask & IN_MODIFY)
+		op = "modified";
+	else if (mask & IN_OPEN)
+		op = "opened";
+	else
+		op = "<unhandled>";
+	if (path_name(dir, path, sizeof(path)) < 0 ||
+	    strlen(path) + strlen(name) + 1 >= sizeof(path)) {
+		err("inotify event %d: pathname overflow", wd);
+		return;
+	}
+	strcat(path, "/");
+	strcat(path, name);
+	info("\t%s %s %s (%x)", op, type, path, mask);
+	if (mask & IN_ISDIR) {
+		if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+			catalog_remove_path(path);
+			remove_inotify(path);
+		}
+		if (mask & (IN_CREATE | IN_MOVED_TO))
+			insert_inotify(path);
+		return;
+	}
+	/* The file is checked again, so this covers removal, too */
+	if (mask & (IN_CREATE | IN_DELETE | IN_MOVE | IN_CLOSE_WRITE))
+		update_event(path);
+	if (mask & (IN_OPEN | IN_MODIFY))
+		access_event(path, !(mask & IN_OPEN));
+}
+
+static unsigned long long watch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static unsigned int watch_pending_hash(int wd, const char *name)
+{
+	unsigned int hash = 2166136261u ^ wd;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+/*
+ * Queue event @mask for entry @name in the directory watched
+ * by @wd. Events for the same entry within the coalescing
+ * window are merged into a single record.
+ */
+static void watch_queue(int wd, unsigned int mask, const char *name)
+{
+	struct watch_pending *wp;
+	unsigned int b;
+
+	/* Only the directory entry itself matters for directories */
+	if ((mask & IN_ISDIR) &&
+	    !(mask & (IN_CREATE | IN_DELETE | IN_MOVE)))
+		return;
+	/* Directory events change the watch table, handle them now */
+	if (!watcher_window || (mask & IN_ISDIR)) {
+		watch_event(wd, mask, name);
+		return;
+	}
+	b = watch_pending_hash(wd, name) & (WATCH_PENDING_BUCKETS - 1);
+	for (wp = watch_pending[b]; wp; wp = wp->hash_next) {
+		if (wp->wd == wd && !strcmp(wp->name, name)) {
+			wp->mask |= mask;
+			watch_coalesced++;
+			return;
+		}
+	}
+	wp = malloc(sizeof(struct watch_pending) + strlen(name) + 1);
+	if (!wp) {
+		watch_event(wd, mask, name);
+		return;
+	}
+	wp->wd = wd;
+	wp->mask = mask;
+	wp->time = watch_now();
+	wp->bucket = b;
+	strcpy(wp->name, name);
+	wp->hash_next = watch_pending[b];
+	watch_pending[b] = wp;
+	list_add_tail(&wp->list, &watch_pending_list);
+	if (++watch_num_pending > WATCH_PENDING_MAX)
+		watch_flush(1);
+}
+
+/*
+ * Handle all queued records whose window has passed, or all
+ * records if @all is set. Returns the time in milliseconds
+ * until the next record is due, or -1 if none is queued.
+ */
+static int watch_flush(int all)
+{
+	struct watch_pending *wp, **pwp;
+	unsigned long long now = watch_now();
+
+	while (!list_empty(&watch_pending_list)) {
+		wp = list_first_entry(&watch_pending_list,
+				      struct watch_pending, list);
+		if (!all && wp->time + watcher_window > now)
+			return wp->time + watcher_window - now;
+		list_del(&wp->list);
+		pwp = &watch_pending[wp->bucket];
+		while (*pwp != wp)
+			pwp = &(*pwp)->hash_next;
+		*pwp = wp->hash_next;
+		watch_num_pending--;
+		watch_event(wp->wd, wp->mask, wp->name);
+		free(wp);
+	}
+	if (watch_coalesced) {
+		dbg("coalesced %u inotify events", watch_coalesced);
+		watch_coalesced = 0;
+	}
+	return -1;
+}
+
+void * watch_dir(void * arg)
+{
+	int inotify_fd = *(int *)arg;
+	struct epoll_event events[2];
+	size_t buf_len = EVENT_BUF_MIN;
+	int timeout = -1;
+	char *buf;
+
+	buf = malloc(buf_len);
+	if (!buf) {
+		err("Cannot allocate event buffer");
+		return NULL;
+	}
+	while (1) {
+		int rlen, ret, n, avail, i = 0;
+
+		ret = epoll_wait(epoll_fd, events, 2, timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err("epoll_wait failed, error %d", errno);
+			break;
+		}
+		if (ret == 0) {
+			timeout = watch_flush(0);
+			if (timeout < 0)
+				watcher_idle();
+			continue;
+		}
+		for (n = 0; n < ret; n++)
+			if (events[n].data.fd == stop_fd)
+				break;
+		if (n < ret)
+			break;
+
+		buf = watch_buf_grow(buf, &buf_len);
+		rlen = read(inotify_fd, buf, buf_len);
+		if (rlen < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			err("error %d on reading inotify event", errno);
+			break;
+		}
+		while (i < rlen) {
+			struct inotify_event *in_ev;
+
+			in_ev = (struct inotify_event *)&(buf[i]);
+			i += EVENT_SIZE + in_ev->len;
+
+			if (in_ev->mask & IN_IGNORED) {
+				info("inotify event %d removed",
+				     in_ev->wd);
+				release_inotify(in_ev->wd);
+				continue;
+			}
+			if (in_ev->mask & IN_Q_OVERFLOW) {
+				info("inotify event %d: queue overflow",
+				     in_ev->wd);
+				/* Record the directories of the events read */
+				watch_flush(1);
+				watcher_overflow();
+				continue;
+			}
+			if (in_ev->len)
+				watch_queue(in_ev->wd, in_ev->mask,
+					    in_ev->name);
+		}
+		timeout = watch_flush(0);
+		if (timeout < 0 &&
+		    ioctl(inotify_fd, FIONREAD, &avail) == 0 && !avail)
+			watcher_idle();
+	}
+	watch_flush(1);
+
+	free(buf);
+	return NULL;
+}
+
+static int start_inotify(char *dirname)
+{
+	struct epoll_event ev;
+	int retval;
+
+	if (watch_hash_init(&watch_wd_hash) < 0 ||
+	    watch_hash_init(&watch_path_hash) < 0) {
+		err("Failed to allocate watch tables");
+		free(watch_wd_hash.buckets);
+		return ENOMEM;
+	}
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		err("Failed to initialize inotify, error %d", errno);
+		retval = errno;
+		goto out_free;
+	}
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (stop_fd < 0 || epoll_fd < 0) {
+		err("Failed to initialize epoll, error %d", errno);
+		retval = errno;
+		goto out_close;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = inotify_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &ev) < 0) {
+		retval = errno;
+		goto out_close;
+	}
+	ev.data.fd = stop_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &ev) < 0) {
+		retval = errno;
+		goto out_close;
+	}
+
+	retval = pthread_create(&watcher_thr, NULL, watch_dir, &inotify_fd);
+	if (retval) {
+		err("Failed to create watcher thread: %d", retval);
+		goto out_close;
+	}
+	info("Starting inotify watcher");
+	return 0;
+
+out_close:
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	if (stop_fd >= 0)
+		close(stop_fd);
+	close(inotify_fd);
+	epoll_fd = stop_fd = -1;
+out_free:
+	free(watch_wd_hash.buckets);
+	free(watch_path_hash.buckets);
+	memset(&watch_wd_hash, 0, sizeof(struct watch_hash));
+	memset(&watch_path_hash, 0, sizeof(struct watch_hash));
+	return retval;
+}
+
+static int insert_watch_inotify(char *dirname, struct stat *st)
+{
+	return insert_inotify(dirname);
+}
+
+static int stop_inotify(void)
+{
+	struct watch_link *wl;
+	unsigned long long val = 1;
+	unsigned int i;
+
+	if (write(stop_fd, &val, sizeof(val)) < 0)
+		err("Failed to stop watcher thread, error %d", errno);
+	pthread_join(watcher_thr, NULL);
+	info("Stopped inotify watcher");
+	for (i = 0; i < watch_wd_hash.size; i++) {
+		while ((wl = watch_wd_hash.buckets[i])) {
+			struct event_watch *ew;
+
+			ew = container_of(wl, struct event_watch, ew_wd);
+			watch_wd_hash.buckets[i] = wl->next;
+			inotify_rm_watch(inotify_fd, wl->key);
+			info("removed inotify watch %d", wl->key);
+			free(ew);
+		}
+	}
+	free(watch_wd_hash.buckets);
+	free(watch_path_hash.buckets);
+	memset(&watch_wd_hash, 0, sizeof(struct watch_hash));
+	memset(&watch_path_hash, 0, sizeof(struct watch_hash));
+	close(epoll_fd);
+	close(stop_fd);
+	close(inotify_fd);
+	epoll_fd = stop_fd = -1;
+	return 0;
+}
+
+struct watcher_template watcher_inotify = {
+	.name = "inotify",
+	.start = start_inotify,
+	.insert = insert_watch_inotify,
+	.stop = stop_inotify,
+};
@@ -1,9 +1,22 @@
 #ifndef _WATCHER_H
 #define _WATCHER_H
 
-int insert_inotify(char *dirname, int locked);
-int remove_inotify(char *dirname, int locked);
-int start_watcher(void);
+struct stat;
+
+extern int watcher_window;
+
+struct watcher_template {
+	const char *name;
+	int (*start) (char *dirname);
+	int (*insert) (char *dirname, struct stat *st);
+	int (*stop) (void);
+};
+
+int insert_watch(char *dirname, struct stat *st);
+int start_watcher(const char *name, char *dirname);
 int stop_watcher(void);
+void watcher_seen(unsigned int dir);
+void watcher_idle(void);
+void watcher_overflow(void);
 
 #endif /* _WATCHER_H */